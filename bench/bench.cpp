@@ -0,0 +1,433 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    benchmark suite of tiny-cnn
+
+    measures each layer type at representative shapes (ns/op and GFLOP/s per sample),
+    and full networks of the samples (LeNet-5, MLP, GHH convnet) in training and inference,
+    for each thread count. all inputs are synthetic, so no dataset is required.
+    results are written as JSON to stdout (or --output file).
+
+    heap allocations per sample (operator new and vec_t) are reported as allocs_per_op.
+    training counts allocations between mini-batches only (per-epoch setup is excluded),
+    so that it is 0 if the hot path of training is allocation-free.
+
+    usage: bench [--threads 1,2,4] [--min-time seconds] [--filter substring] [--output file]
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <thread>
+
+#define CNN_COUNT_ALLOCATIONS
+#include "tiny_cnn.h"
+
+using namespace tiny_cnn;
+using namespace tiny_cnn::activation;
+
+static std::atomic<size_t> new_count(0);
+
+void* operator new(size_t size) {
+    new_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+// not inlined, so that gcc doesn't take free() of the pointer from operator new as mismatched (-Wmismatched-new-delete)
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+// heap allocations so far, by operator new and by aligned_allocator of vec_t
+size_t allocation_count() {
+    return new_count.load(std::memory_order_relaxed) + aligned_allocation_count().load(std::memory_order_relaxed);
+}
+
+struct bench_options {
+    bench_options() : min_time(0.2) {}
+
+    std::vector<size_t> threads;
+    double min_time;     // minimum seconds spent for each case
+    std::string filter;  // run only cases whose name contains this
+    std::string output;  // empty means stdout
+};
+
+struct bench_record {
+    std::string suite;   // "layer" or "network"
+    std::string name;
+    std::string mode;    // "forward", "train", "train_batch", "inference" or "predict"
+    size_t threads;
+    size_t iterations;
+    double ns_per_op;    // op = one sample
+    double flops_per_op; // 0 if unknown
+    double allocs_per_op;
+};
+
+// returns seconds per call of f. *allocations is the number of heap allocations after warm up
+template <typename Func>
+double measure(Func f, double min_seconds, size_t* iterations, size_t* allocations) {
+    f(); // warm up
+    size_t n = 0;
+    const size_t first = allocation_count();
+    timer t;
+    do {
+        f();
+        n++;
+    } while (t.elapsed() < min_seconds);
+    const double elapsed = t.elapsed();
+    *iterations = n;
+    *allocations = allocation_count() - first;
+    return elapsed / n;
+}
+
+// on_batch_enumerate callback which counts allocations between consecutive mini-batches of an epoch
+struct batch_allocations {
+    batch_allocations() : allocations(0), batches(0), last(0), first(true) {}
+
+    void begin_epoch() { first = true; }
+
+    void operator () () {
+        const size_t now = allocation_count();
+        if (!first) {
+            allocations += now - last;
+            batches++;
+        }
+        first = false;
+        last = now;
+    }
+
+    size_t allocations;
+    size_t batches; // batches counted (all but the first of each epoch)
+    size_t last;
+    bool first;
+};
+
+// deterministic pseudo-random data so that results are comparable between runs
+vec_t synthetic_vec(size_t size, size_t seed) {
+    vec_t v(size);
+    for (size_t i = 0; i < size; i++)
+        v[i] = static_cast<float_t>(std::sin(0.37 * i + 1.3 * seed));
+    return v;
+}
+
+std::vector<vec_t> synthetic_data(size_t num, size_t size) {
+    std::vector<vec_t> data;
+    for (size_t i = 0; i < num; i++)
+        data.push_back(synthetic_vec(size, i));
+    return data;
+}
+
+std::vector<label_t> synthetic_labels(size_t num, size_t num_classes) {
+    std::vector<label_t> labels;
+    for (size_t i = 0; i < num; i++)
+        labels.push_back(static_cast<label_t>(i % num_classes));
+    return labels;
+}
+
+class bench_suite {
+public:
+    explicit bench_suite(const bench_options& opt) : opt_(opt), threads_(1) {}
+
+    void set_threads(size_t n) {
+        threads_ = n;
+        set_num_threads(n);
+    }
+
+    bool enabled(const std::string& name) const {
+        return opt_.filter.empty() || name.find(opt_.filter) != std::string::npos;
+    }
+
+    /**
+     * forward:     layer::forward on a single sample
+     * train:       network which consists of the layer only, trained by mini-batch of 16
+     * train_batch: same as train in batch mode (forward_batch/backward_batch)
+     **/
+    template <typename Layer>
+    void layer(const std::string& name, Layer l) {
+        if (!enabled(name)) return;
+
+        const layer_base& base = l; // some layers hide in_size/out_size by helpers
+        l.init_weight();
+        const double flops = 2.0 * base.connection_size();
+        const vec_t in = synthetic_vec(base.in_size(), 0);
+        layer_workspace ws;
+        size_t iterations, allocations;
+
+        double t = measure([&] { l.forward(in, ws); }, opt_.min_time, &iterations, &allocations);
+        add("layer", name, "forward", t, iterations, flops, double(allocations) / iterations);
+
+        const size_t num_samples = 64;
+        network<mse, gradient_descent> nn;
+        nn << Layer(l);
+        nn.init_weight();
+
+        const std::vector<vec_t> x = synthetic_data(num_samples, base.in_size());
+        std::vector<vec_t> y = synthetic_data(num_samples, base.out_size());
+        for (auto& v : y) for (auto& e : v) e *= float_t(0.5);
+
+        for (int batch_mode = 0; batch_mode < 2; batch_mode++) {
+            batch_allocations b;
+            nn.set_batch_mode(batch_mode != 0);
+            t = measure([&] { b.begin_epoch(); nn.train(x, y, 16, 1, std::ref(b), nop, false); }, opt_.min_time, &iterations, &allocations);
+            add("layer", name, batch_mode ? "train_batch" : "train", t / num_samples, iterations, 3.0 * flops, double(b.allocations) / (b.batches * 16));
+        }
+    }
+
+    /**
+     * train:       one epoch over synthetic samples with the mini-batch size of the sample
+     * train_batch: same as train in batch mode (forward_batch/backward_batch)
+     * inference:   network::test over the same samples
+     * predict:     network::predict of each sample with one predict_context on the calling thread
+     **/
+    template <typename N>
+    void net(const std::string& name, N& nn, size_t batch_size, size_t num_classes) {
+        if (!enabled(name)) return;
+
+        const size_t num_samples = 256;
+        const std::vector<vec_t> x = synthetic_data(num_samples, nn.in_dim());
+        const std::vector<label_t> y = synthetic_labels(num_samples, num_classes);
+
+        double flops = 0.0;
+        for (size_t i = 0; i < nn.depth(); i++)
+            flops += 2.0 * nn[i]->connection_size();
+
+        nn.init_weight();
+        size_t iterations, allocations;
+        double t;
+
+        for (int batch_mode = 0; batch_mode < 2; batch_mode++) {
+            batch_allocations b;
+            nn.set_batch_mode(batch_mode != 0);
+            t = measure([&] { b.begin_epoch(); nn.train(x, y, batch_size, 1, std::ref(b), nop, false); },
+                        opt_.min_time, &iterations, &allocations);
+            add("network", name, batch_mode ? "train_batch" : "train", t / num_samples, iterations, 3.0 * flops,
+                double(b.allocations) / (b.batches * batch_size));
+        }
+        nn.set_batch_mode(false);
+
+        t = measure([&] { nn.test(x); }, opt_.min_time, &iterations, &allocations);
+        add("network", name, "inference", t / num_samples, iterations, flops, double(allocations) / (iterations * num_samples));
+
+        predict_context ctx;
+        t = measure([&] { for (auto& v : x) nn.predict(v, ctx); }, opt_.min_time, &iterations, &allocations);
+        add("network", name, "predict", t / num_samples, iterations, flops, double(allocations) / (iterations * num_samples));
+    }
+
+    void write_json(std::ostream& os) const {
+        os << "{\n"
+           << "  \"config\": {\"float_t\": \"" << (sizeof(float_t) == sizeof(float) ? "float" : "double") << "\""
+           << ", \"backend\": \"" << backend_name() << "\""
+           << ", \"avx\": " << (has_avx() ? "true" : "false")
+           << ", \"min_time\": " << opt_.min_time << "},\n"
+           << "  \"results\": [\n";
+
+        for (size_t i = 0; i < records_.size(); i++) {
+            const bench_record& r = records_[i];
+            const double gflops = r.flops_per_op / r.ns_per_op; // flop/ns == GFLOP/s
+
+            os << "    {\"suite\": \"" << r.suite << "\""
+               << ", \"name\": \"" << r.name << "\""
+               << ", \"mode\": \"" << r.mode << "\""
+               << ", \"threads\": " << r.threads
+               << ", \"iterations\": " << r.iterations
+               << ", \"ns_per_op\": " << r.ns_per_op
+               << ", \"ops_per_sec\": " << 1e9 / r.ns_per_op
+               << ", \"gflops\": " << gflops
+               << ", \"allocs_per_op\": " << r.allocs_per_op << "}"
+               << (i + 1 < records_.size() ? ",\n" : "\n");
+        }
+        os << "  ]\n}" << std::endl;
+    }
+
+private:
+    void add(const std::string& suite, const std::string& name, const std::string& mode,
+             double seconds_per_op, size_t iterations, double flops_per_op, double allocs_per_op) {
+        bench_record r;
+        r.suite = suite;
+        r.name = name;
+        r.mode = mode;
+        r.threads = threads_;
+        r.iterations = iterations;
+        r.ns_per_op = seconds_per_op * 1e9;
+        r.flops_per_op = flops_per_op;
+        r.allocs_per_op = allocs_per_op;
+        records_.push_back(r);
+
+        // progress goes to stderr, so that stdout stays valid JSON
+        std::cerr << suite << "/" << name << "/" << mode << " threads=" << threads_
+                  << " : " << r.ns_per_op << " ns/op, " << r.allocs_per_op << " allocs/op" << std::endl;
+    }
+
+    static const char* backend_name() {
+#if defined(CNN_USE_TBB)
+        return "tbb";
+#elif defined(CNN_USE_OMP)
+        return "omp";
+#elif defined(CNN_USE_THREAD_POOL)
+        return "thread_pool";
+#else
+        return "single";
+#endif
+    }
+
+    static bool has_avx() {
+#ifdef CNN_USE_AVX
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bench_options opt_;
+    size_t threads_;
+    std::vector<bench_record> records_;
+};
+
+// connection table of LeNet-5 [Y.Lecun, 1998 Table.1]
+#define O true
+#define X false
+static const bool lenet5_connection [] = {
+    O, X, X, X, O, O, O, X, X, O, O, O, O, X, O, O,
+    O, O, X, X, X, O, O, O, X, X, O, O, O, O, X, O,
+    O, O, O, X, X, X, O, O, O, X, X, O, X, O, O, O,
+    X, O, O, O, X, X, O, O, O, O, X, X, O, X, O, O,
+    X, X, O, O, O, X, X, O, O, O, O, X, O, O, X, O,
+    X, X, X, O, O, O, X, X, O, O, O, O, X, O, O, O
+};
+#undef O
+#undef X
+
+void bench_layers(bench_suite& b) {
+    b.layer("conv_32x32_5x5_1x6",        convolutional_layer<tan_h>(32, 32, 5, 1, 6));
+    b.layer("conv_14x14_5x5_6x16_table", convolutional_layer<tan_h>(14, 14, 5, 6, 16, connection_table(lenet5_connection, 6, 16)));
+    b.layer("conv_5x5_5x5_16x120",       convolutional_layer<tan_h>(5, 5, 5, 16, 120));
+    b.layer("avepool_28x28x6_2",         average_pooling_layer<tan_h>(28, 28, 6, 2));
+    b.layer("maxpool_28x28x6_2",         max_pooling_layer<identity>(28, 28, 6, 2));
+    b.layer("fc_784x500",                fully_connected_layer<tan_h>(784, 500));
+    b.layer("fc_500x10",                 fully_connected_layer<tan_h>(500, 10));
+    b.layer("fc_1024x1024",              fully_connected_layer<relu>(1024, 1024));
+    b.layer("ghh_160x10_4x4",            ghh_activation_layer<identity>(10, 4, 4));
+}
+
+// sample1_convnet
+void bench_lenet5(bench_suite& b) {
+    network<mse, gradient_descent_levenberg_marquardt> nn;
+    nn << convolutional_layer<tan_h>(32, 32, 5, 1, 6)
+       << average_pooling_layer<tan_h>(28, 28, 6, 2)
+       << convolutional_layer<tan_h>(14, 14, 5, 6, 16, connection_table(lenet5_connection, 6, 16))
+       << average_pooling_layer<tan_h>(10, 10, 16, 2)
+       << convolutional_layer<tan_h>(5, 5, 5, 16, 120)
+       << fully_connected_layer<tan_h>(120, 10);
+
+    b.net("lenet5", nn, 10, 10);
+}
+
+// sample2_mlp
+void bench_mlp(bench_suite& b) {
+    auto nn = make_mlp<mse, gradient_descent, tan_h>({ 28 * 28, 500, 10 });
+
+    b.net("mlp_784_500_10", nn, 1, 10);
+}
+
+// sample5_convnet_ghh
+void bench_convnet_ghh(bench_suite& b) {
+    network<cross_entropy_multiclass, adam> nn;
+    nn << convolutional_layer<relu>(32, 32, 5, 1, 6)
+       << max_pooling_layer<identity>(28, 28, 6, 2)
+       << convolutional_layer<relu>(14, 14, 5, 6, 16)
+       << max_pooling_layer<identity>(10, 10, 16, 2)
+       << convolutional_layer<relu>(5, 5, 5, 16, 100)
+       << fully_connected_layer<identity>(100, 160)
+       << ghh_activation_layer<identity>(10, 4, 4)
+       << max_pooling_layer<softmax>(1, 1, 10, 1);
+
+    b.net("convnet_ghh", nn, 10, 10);
+}
+
+std::vector<size_t> parse_list(const std::string& s) {
+    std::vector<size_t> values;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        values.push_back(static_cast<size_t>(std::stoul(item)));
+    return values;
+}
+
+// 1, 2, 4, ... up to the number of hardware threads
+std::vector<size_t> default_threads() {
+    const size_t hw = std::max<size_t>(1, std::thread::hardware_concurrency());
+    std::vector<size_t> threads;
+    for (size_t n = 1; n < hw; n *= 2)
+        threads.push_back(n);
+    threads.push_back(hw);
+    return threads;
+}
+
+int main(int argc, char** argv) {
+    bench_options opt;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 < argc && arg == "--threads")       opt.threads = parse_list(argv[++i]);
+        else if (i + 1 < argc && arg == "--min-time") opt.min_time = std::stod(argv[++i]);
+        else if (i + 1 < argc && arg == "--filter")   opt.filter = argv[++i];
+        else if (i + 1 < argc && arg == "--output")   opt.output = argv[++i];
+        else {
+            std::cerr << "Usage : " << argv[0]
+                      << " [--threads 1,2,4] [--min-time seconds] [--filter substring] [--output file]" << std::endl;
+            return 1;
+        }
+    }
+    if (opt.threads.empty()) opt.threads = default_threads();
+
+    bench_suite b(opt);
+
+    for (size_t n : opt.threads) {
+        b.set_threads(n);
+        bench_layers(b);
+        bench_lenet5(b);
+        bench_mlp(b);
+        bench_convnet_ghh(b);
+    }
+    set_num_threads(0);
+
+    if (opt.output.empty()) {
+        b.write_json(std::cout);
+    } else {
+        std::ofstream ofs(opt.output.c_str());
+        b.write_json(ofs);
+    }
+}
@@ -0,0 +1,90 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <iostream>
+#include <iomanip>
+
+#include "tiny_cnn.h"
+
+using namespace tiny_cnn;
+using namespace tiny_cnn::activation;
+
+// forward kernel before streaming W_ by rows: inner loop over inputs strides W_ by out_size
+void strided_forward(const vec_t& W, const vec_t& b, const vec_t& in, vec_t& a, layer_size_t in_size, layer_size_t out_size) {
+    for (layer_size_t i = 0; i < out_size; i++) {
+        a[i] = 0.0;
+        for (layer_size_t c = 0; c < in_size; c++)
+            a[i] += W[c * out_size + i] * in[c];
+        a[i] += b[i];
+    }
+}
+
+// returns seconds per call
+template <typename Func>
+double measure(Func f, double min_seconds = 0.2) {
+    f(); // warm up
+    int iterations = 0;
+    timer t;
+    do {
+        f();
+        iterations++;
+    } while (t.elapsed() < min_seconds);
+    return t.elapsed() / iterations;
+}
+
+void bench(layer_size_t in_size, layer_size_t out_size) {
+    fully_connected_layer<identity> layer(in_size, out_size);
+    vec_t in(in_size), a(out_size);
+
+    layer.init_weight();
+    uniform_rand(in.begin(), in.end(), -1.0, 1.0);
+
+    const double t_strided = measure([&] { strided_forward(layer.weight(), layer.bias(), in, a, in_size, out_size); });
+    const double t_layer = measure([&] { layer.forward_propagation(in, 0); });
+
+    const vec_t& out = layer.output(0);
+    float_t max_diff = 0;
+    for (layer_size_t i = 0; i < out_size; i++)
+        max_diff = std::max(max_diff, std::abs(out[i] - a[i]));
+
+    std::cout << std::fixed << std::setprecision(2)
+              << std::setw(6) << in_size << " x" << std::setw(6) << out_size
+              << std::setw(12) << t_strided * 1e6 << "us"
+              << std::setw(12) << t_layer * 1e6 << "us"
+              << std::setw(9) << t_strided / t_layer << "x"
+              << std::scientific << "   max-diff:" << max_diff << std::endl;
+}
+
+int main() {
+    std::cout << "fully_connected_layer::forward_propagation (in x out, strided, current, speedup)" << std::endl;
+
+    const layer_size_t shapes[][2] = {
+        { 120, 10 }, { 784, 100 }, { 784, 500 }, { 500, 10 }, { 1024, 1024 }, { 4096, 256 }, { 256, 4096 }
+    };
+
+    for (auto& s : shapes)
+        bench(s[0], s[1]);
+}
@@ -202,14 +202,16 @@ void sample3_dae()
 
     // load train-data
 
-    std::vector<vec_t> train_data_corrupted(train_data_original);
+    // corrupt 10% data on the fly, while previous mini-batch is trained
+    memory_dataset<vec_t> train_data(train_data_original, train_data_original);
+    async_dataset<memory_dataset<vec_t>> train_data_corrupted(train_data);
 
-    for (auto& d : train_data_corrupted) {
-        d = corrupt(move(d), 0.1, 0.0); // corrupt 10% data
-    }
+    train_data_corrupted.set_transform([](vec_t& in, vec_t& /*t*/, std::mt19937& rng) {
+        corrupt(in, 0.1, 0.0, rng);
+    });
 
     // learning 100-400-100 denoising auto-encoder
-    nn.train(train_data_corrupted, train_data_original);
+    nn.train(train_data_corrupted);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
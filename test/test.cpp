@@ -24,6 +24,7 @@
     (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
     SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
+#include <array>
 #include "picotest.h"
 #include "tiny_cnn.h"
 
@@ -175,6 +176,105 @@ TEST(convolutional, gradient_check5) { // sigmoid - cross-entropy
     EXPECT_TRUE(nn.gradient_check(&a, &t, 1, 1e-3, GRAD_CHECK_ALL));
 }
 
+TEST(convolutional, gradient_check6) { // tanh - mse, multi-channel
+    network<mse, gradient_descent_levenberg_marquardt> nn;
+    nn << convolutional_layer<tan_h>(5, 5, 3, 2, 2);
+
+    vec_t a(5*5*2, 0.0);
+    label_t t = 3;
+
+    // deterministic values keep the shared random sequence of later tests intact
+    for (size_t i = 0; i < a.size(); i++) a[i] = std::sin(i * 0.7);
+    vec_t& w = nn[0]->weight();
+    for (size_t i = 0; i < w.size(); i++) w[i] = 0.3 * std::cos(i * 1.3);
+    EXPECT_TRUE(nn.gradient_check(&a, &t, 1, 1e-3, GRAD_CHECK_ALL));
+}
+
+TEST(convolutional, fprop_padding) {
+    const int w = 7, h = 6, ws = 3, inc = 2, outc = 3, pad = ws / 2;
+    convolutional_layer<identity> l(w, h, ws, inc, outc, padding::same);
+
+    vec_t in(w*h*inc);
+    for (size_t i = 0; i < in.size(); i++) in[i] = std::sin(i * 0.7);
+    for (size_t i = 0; i < l.weight().size(); i++) l.weight()[i] = std::cos(i * 1.3);
+    for (size_t i = 0; i < l.bias().size(); i++) l.bias()[i] = 0.1 * i;
+
+    const vec_t& out = l.forward_propagation(in, 0);
+    ASSERT_EQ(out.size(), w*h*outc);
+
+    for (int o = 0; o < outc; o++) {
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                tiny_cnn::float_t expected = l.bias()[o];
+
+                for (int c = 0; c < inc; c++)
+                    for (int dy = 0; dy < ws; dy++)
+                        for (int dx = 0; dx < ws; dx++) {
+                            int ix = x + dx - pad, iy = y + dy - pad;
+                            if (ix < 0 || iy < 0 || ix >= w || iy >= h) continue;
+                            expected += l.weight()[((o*inc + c)*ws + dy)*ws + dx] * in[(c*h + iy)*w + ix];
+                        }
+                EXPECT_NEAR(expected, out[(o*h + y)*w + x], 1e-5);
+            }
+        }
+    }
+}
+
+TEST(convolutional, connection_table) {
+    static const bool tbl[] = {
+        true,  false, true,
+        true,  true,  false,
+        false, true,  true,
+        true,  false, true
+    };
+    const int w = 6, h = 5, ws = 3, inc = 4, outc = 3, pad = ws / 2;
+    convolutional_layer<identity> l(w, h, ws, inc, outc, connection_table(tbl, inc, outc), padding::same);
+
+    vec_t in(w*h*inc);
+    for (size_t i = 0; i < in.size(); i++) in[i] = std::sin(i * 0.7);
+    for (size_t i = 0; i < l.weight().size(); i++) l.weight()[i] = std::cos(i * 1.3);
+    for (size_t i = 0; i < l.bias().size(); i++) l.bias()[i] = 0.1 * i;
+
+    // kernels of connected channels are packed in (out, in) order
+    EXPECT_EQ(0u, l.kernel_offset(0, 0));
+    EXPECT_EQ(9u, l.kernel_offset(0, 1));
+    EXPECT_EQ(18u, l.kernel_offset(0, 3));
+    EXPECT_EQ(27u, l.kernel_offset(1, 1));
+    EXPECT_TRUE(l.kernel_offset(0, 2) == l.npos);
+    EXPECT_EQ(27u, l.fan_in_size());
+
+    const vec_t& out = l.forward_propagation(in, 0);
+
+    for (int o = 0; o < outc; o++) {
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                tiny_cnn::float_t expected = l.bias()[o];
+
+                for (int c = 0; c < inc; c++) {
+                    if (!tbl[c * outc + o]) continue;
+                    for (int dy = 0; dy < ws; dy++)
+                        for (int dx = 0; dx < ws; dx++) {
+                            int ix = x + dx - pad, iy = y + dy - pad;
+                            if (ix < 0 || iy < 0 || ix >= w || iy >= h) continue;
+                            expected += l.weight()[l.kernel_offset(o, c) + dy * ws + dx] * in[(c*h + iy)*w + ix];
+                        }
+                }
+                EXPECT_NEAR(expected, out[(o*h + y)*w + x], 1e-5);
+            }
+        }
+    }
+
+    network<mse, gradient_descent_levenberg_marquardt> nn;
+    nn << convolutional_layer<tan_h>(4, 4, 3, 4, 3, connection_table(tbl, 4, 3));
+
+    vec_t a(4*4*4);
+    label_t t = 3;
+    for (size_t i = 0; i < a.size(); i++) a[i] = std::sin(i * 0.7);
+    vec_t& W = nn[0]->weight();
+    for (size_t i = 0; i < W.size(); i++) W[i] = 0.3 * std::cos(i * 1.3);
+    EXPECT_TRUE(nn.gradient_check(&a, &t, 1, 1e-3, GRAD_CHECK_ALL));
+}
+
 TEST(convolutional, serialize) {
     convolutional_layer<tan_h> layer1(14, 14, 5, 1, 2);
     convolutional_layer<tan_h> layer2(14, 14, 5, 1, 2);
@@ -228,6 +328,57 @@ TEST(convolutional, serialize2) {
         EXPECT_NEAR(out1[i], out2[i], 1e-4);
 }
 
+namespace {
+// out[o] = W[o % 2] * (in[o] + in[o + 1]) + b[0]
+class chain_layer : public partial_connected_layer<identity> {
+public:
+    explicit chain_layer(bool compile) : partial_connected_layer<identity>(4, 3, 2, 1) {
+        for (layer_size_t o = 0; o < 3; o++) {
+            connect_weight(o, o, o % 2);
+            connect_weight(o + 1, o, o % 2);
+            connect_bias(0, o);
+        }
+        if (compile) compile_connections();
+    }
+    std::string layer_type() const override { return "chain"; }
+};
+} // namespace
+
+TEST(partial_connected, compiled_connections) {
+    chain_layer l(true);
+    l.weight()[0] = 0.5;
+    l.weight()[1] = -2.0;
+    l.bias()[0] = 0.25;
+
+    EXPECT_EQ(2u, l.fan_in_size());
+    EXPECT_EQ(2u, l.fan_out_size());
+    EXPECT_EQ(9u, l.connection_size());
+    EXPECT_EQ(3u, l.param_size());
+
+    vec_t in = { 1.0, 2.0, 3.0, 4.0 };
+    const vec_t& out = l.forward_propagation(in, 0);
+    EXPECT_NEAR(0.5 * 3.0 + 0.25, out[0], 1e-6);
+    EXPECT_NEAR(-2.0 * 5.0 + 0.25, out[1], 1e-6);
+    EXPECT_NEAR(0.5 * 7.0 + 0.25, out[2], 1e-6);
+
+    bool thrown = false;
+    try {
+        l.connect_weight(0, 0, 0);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+
+    chain_layer uncompiled(false);
+    thrown = false;
+    try {
+        uncompiled.forward_propagation(in, 0);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
 TEST(fully_connected, bprop) {
     network<cross_entropy, gradient_descent_levenberg_marquardt> nn;
 
@@ -452,6 +603,95 @@ TEST(max_pool, gradient_check) { // sigmoid - cross-entropy
     EXPECT_TRUE(nn.gradient_check(&a, &t, 1, 1e-5, GRAD_CHECK_ALL));
 }
 
+TEST(max_pool, overlapping_stride) {
+    network<mse, gradient_descent_levenberg_marquardt> nn;
+    nn << max_pooling_layer<identity>(5, 5, 2, 3, 2); // 3x3 windows at stride 2, 5x5 => 2x2
+
+    vec_t a(5*5*2);
+    for (size_t i = 0; i < a.size(); i++) a[i] = std::sin(i * 0.7);
+
+    const vec_t out = nn.predict(a);
+    EXPECT_EQ(8, out.size());
+    for (int c = 0; c < 2; c++) {
+        for (int y = 0; y < 2; y++) {
+            for (int x = 0; x < 2; x++) {
+                float_t expected = a[c*25 + y*2*5 + x*2];
+                for (int dy = 0; dy < 3; dy++)
+                    for (int dx = 0; dx < 3; dx++)
+                        expected = std::max(expected, a[c*25 + (y*2 + dy)*5 + x*2 + dx]);
+                EXPECT_FLOAT_EQ(expected, out[c*4 + y*2 + x]);
+            }
+        }
+    }
+    EXPECT_EQ(9, nn[0]->fan_in_size());
+    EXPECT_EQ(4, nn[0]->fan_out_size()); // 2x2 windows share the center input
+
+    bool thrown = false;
+    try {
+        max_pooling_layer<identity> mismatch(6, 6, 1, 3, 2);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+TEST(max_pool, gradient_check_stride) { // identity - mse, overlapping windows
+    network<mse, gradient_descent_levenberg_marquardt> nn;
+    nn << fully_connected_layer<tan_h>(3, 5*5*2)
+       << max_pooling_layer<identity>(5, 5, 2, 3, 2);
+
+    vec_t a(3);
+    for (size_t i = 0; i < a.size(); i++) a[i] = std::sin(i * 0.7 + 1);
+    label_t t = 2;
+
+    vec_t& w = nn[0]->weight();
+    for (size_t i = 0; i < w.size(); i++) w[i] = 0.5 * std::cos(i * 1.3);
+    EXPECT_TRUE(nn.gradient_check(&a, &t, 1, 1e-3, GRAD_CHECK_ALL));
+}
+
+TEST(average_pool, gradient_check_stride) { // tanh - mse, overlapping windows
+    network<mse, gradient_descent_levenberg_marquardt> nn;
+    nn << fully_connected_layer<tan_h>(3, 5*5*2)
+       << average_pooling_layer<tan_h>(5, 5, 2, 3, 2);
+
+    vec_t a(3);
+    for (size_t i = 0; i < a.size(); i++) a[i] = std::sin(i * 0.7 + 1);
+    label_t t = 2;
+
+    for (size_t l = 0; l < 2; l++) {
+        vec_t& w = nn[l]->weight();
+        for (size_t i = 0; i < w.size(); i++) w[i] = 0.5 * std::cos(i * 1.3 + l);
+    }
+    EXPECT_TRUE(nn.gradient_check(&a, &t, 1, 1e-3, GRAD_CHECK_ALL));
+    EXPECT_EQ(9, nn[1]->fan_in_size());
+    EXPECT_EQ(4, nn[1]->fan_out_size());
+    EXPECT_EQ((9 + 1) * 8, nn[1]->connection_size());
+}
+
+TEST(ghh_activation, fprop_and_gradient_check) { // tanh - mse
+    network<mse, gradient_descent_levenberg_marquardt> nn;
+    nn << fully_connected_layer<tan_h>(3, 4*3*2)
+       << ghh_activation_layer<identity>(4, 3, 2); // 3 signed sums of max over 2
+
+    vec_t a(3);
+    for (size_t i = 0; i < a.size(); i++) a[i] = std::sin(i * 0.7 + 1);
+    label_t t = 1;
+
+    vec_t& w = nn[0]->weight();
+    for (size_t i = 0; i < w.size(); i++) w[i] = 0.5 * std::cos(i * 1.3);
+
+    const vec_t out = nn.predict(a);
+    const vec_t& in = nn[0]->output(0);
+    for (int i = 0; i < 4; i++) {
+        float_t expected = 0;
+        for (int n = 0; n < 3; n++)
+            expected += (n % 2 ? -1 : 1) * std::max(in[(n * 2) * 4 + i], in[(n * 2 + 1) * 4 + i]);
+        EXPECT_NEAR(expected, out[i], 1e-6);
+    }
+
+    EXPECT_TRUE(nn.gradient_check(&a, &t, 1, 1e-3, GRAD_CHECK_ALL));
+}
+
 template <typename T>
 void serialization_test(const T& src, T& dst)
 {
@@ -552,6 +792,1005 @@ TEST(read_write, network)
     }
 }
 
+TEST(network, batch_mode) {
+    typedef network<mse, gradient_descent> net_t;
+    net_t nn1, nn2;
+
+    for (auto nn : { &nn1, &nn2 }) {
+        *nn << convolutional_layer<tan_h>(8, 8, 3, 1, 4)     // gemm
+            << max_pooling_layer<tan_h>(6, 6, 4, 2)          // per-sample fallback
+            << convolutional_layer<relu>(3, 3, 2, 4, 3)
+            << fully_connected_layer<sigmoid>(12, 5);
+    }
+    nn1.init_weight();
+
+    std::stringstream ss;
+    ss << nn1;
+    ss >> nn2;
+
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 10; i++) {
+        vec_t v(8 * 8);
+        uniform_rand(v.begin(), v.end(), -1.0, 1.0);
+        in.push_back(v);
+        t.push_back(i % 5);
+    }
+
+    nn2.set_batch_mode(true);
+    nn1.train(in, t, 4, 2, nop, nop, false);
+    nn2.train(in, t, 4, 2, nop, nop, false);
+
+    EXPECT_TRUE(nn1.has_same_weights(nn2, 1e-5));
+}
+
+TEST(network, batch_mode_dropout) {
+    network<mse, gradient_descent> nn;
+    nn << fully_connected_layer<identity>(4, 6)
+       << fully_connected_dropout_layer<identity>(6, 5);  // per-sample fallback, a new mask for each sample
+    nn.init_weight();
+
+    const size_t batch_size = 8;
+    vec_t in(batch_size * 4), delta(batch_size * 5, 1.0);
+    uniform_rand(in.begin(), in.end(), -1.0, 1.0);
+
+    const vec_t& x = nn[0]->forward_batch(in, batch_size);
+    const vec_t out = nn[1]->forward_batch(x, batch_size);
+    const vec_t& prev_delta = nn[1]->backward_batch(delta, batch_size);
+    const vec_t& W = nn[1]->weight();
+
+    // backward_batch must mask each sample with the mask used by forward_batch
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t c = 0; c < 6; c++) {
+            tiny_cnn::float_t expected = 0;
+            for (size_t o = 0; o < 5; o++)
+                if (out[n * 5 + o] != 0) expected += W[c * 5 + o];
+            EXPECT_NEAR(expected, prev_delta[n * 6 + c], 1e-5);
+        }
+    }
+}
+
+TEST(network, predict_context) {
+    network<mse, adagrad> nn;
+    static const bool tbl[] = { true, false, true, true, true, false };
+
+    nn << convolutional_layer<tan_h>(10, 10, 3, 1, 3)
+       << max_pooling_layer<relu>(8, 8, 3, 2)
+       << convolutional_layer<sigmoid>(4, 4, 3, 3, 2, connection_table(tbl, 3, 2))
+       << average_pooling_layer<identity>(2, 2, 2, 2)
+       << fully_connected_dropout_layer<tan_h>(2, 6)
+       << ghh_activation_layer<identity>(3, 2, 1);
+    nn.init_weight();
+    dynamic_cast<fully_connected_dropout_layer<tan_h>*>(nn[4])->set_context(dropout::test_phase);
+
+    std::vector<vec_t> in;
+    for (int i = 0; i < 5; i++) {
+        vec_t v(10 * 10);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 100 + j * 0.3);
+        in.push_back(v);
+    }
+
+    std::vector<vec_t> results = nn.test(in);
+    predict_context ctx;
+
+    for (size_t i = 0; i < in.size(); i++) {
+        vec_t expected = nn.predict(in[i]);
+        vec_t actual = nn.predict(in[i], ctx);
+
+        ASSERT_EQ(expected.size(), actual.size());
+        for (size_t j = 0; j < expected.size(); j++) {
+            EXPECT_EQ(expected[j], actual[j]);
+            EXPECT_EQ(expected[j], results[i][j]);
+        }
+    }
+}
+
+TEST(read_write, binary) {
+    typedef network<mse, adagrad> net;
+    net n1, n2, n3, n4;
+
+    n1 << convolutional_layer<tan_h>(10, 10, 3, 1, 3)
+       << average_pooling_layer<tan_h>(8, 8, 3, 2)
+       << fully_connected_layer<sigmoid>(4 * 4 * 3, 5);
+    n2 << convolutional_layer<tan_h>(10, 10, 3, 1, 3)
+       << average_pooling_layer<tan_h>(8, 8, 3, 2)
+       << fully_connected_layer<sigmoid>(4 * 4 * 3, 5);
+    n3 << convolutional_layer<tan_h>(10, 10, 3, 1, 3)
+       << average_pooling_layer<tan_h>(8, 8, 3, 2)
+       << fully_connected_layer<sigmoid>(4 * 4 * 3, 5);
+    n4 << convolutional_layer<tan_h>(10, 10, 3, 1, 4)
+       << average_pooling_layer<tan_h>(8, 8, 4, 2)
+       << fully_connected_layer<sigmoid>(4 * 4 * 4, 5);
+    n1.init_weight();
+
+    // copy from stream
+    std::stringstream ss;
+    n1.save_binary(ss);
+    n2.load_binary(ss);
+    ASSERT_TRUE(n1.has_same_weights(n2, 0.0));
+
+    // map from file
+    const std::string path = "binary_model.tmp";
+    n1.save_binary(path);
+    n3.map_binary(path);
+    ASSERT_TRUE(n1.has_same_weights(n3, 0.0));
+
+    for (size_t i = 0; i < n3.depth(); i++)
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(n3[i]->weight().data()) % 64);
+
+    vec_t in(10 * 10);
+    for (size_t i = 0; i < in.size(); i++) in[i] = std::cos(i * 0.7);
+
+    vec_t res1 = n1.predict(in), res3 = n3.predict(in);
+    for (size_t i = 0; i < res1.size(); i++)
+        EXPECT_EQ(res1[i], res3[i]);
+
+    // architecture mismatch
+    bool thrown = false;
+    try {
+        n4.map_binary(path);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+
+    // offset + size of weights overflows
+    std::string broken = ss.str();
+    const uint64_t offset = ~uint64_t(63);
+    std::memcpy(&broken[sizeof(binary_format::file_header) + offsetof(binary_format::layer_record, weight_offset)], &offset, sizeof(offset));
+    std::stringstream bs(broken);
+    thrown = false;
+    try {
+        n2.load_binary(bs);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+
+    std::remove(path.c_str());
+}
+
+// writes big-endian 32bit integer as MNIST header does
+void write_be32(std::ostream& os, uint32_t v) {
+    const char b[] = { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+    os.write(b, 4);
+}
+
+TEST(dataset, mnist) {
+    const std::string image_file = "images.idx3.tmp", label_file = "labels.idx1.tmp";
+    const int num = 12, rows = 6, cols = 5;
+    {
+        std::ofstream images(image_file.c_str(), std::ios::binary), labels(label_file.c_str(), std::ios::binary);
+        write_be32(images, 0x803); write_be32(images, num); write_be32(images, rows); write_be32(images, cols);
+        write_be32(labels, 0x801); write_be32(labels, num);
+        for (int i = 0; i < num; i++) {
+            for (int j = 0; j < rows * cols; j++) images.put(char((i * 31 + j * 17) % 256));
+            labels.put(char(i % 10));
+        }
+    }
+
+    std::vector<vec_t> images;
+    std::vector<label_t> labels;
+    parse_mnist_images(image_file, &images, -1.0, 1.0, 2, 1);
+    parse_mnist_labels(label_file, &labels);
+
+    image_dataset data = image_dataset::mnist(image_file, label_file, -1.0, 1.0, 2, 1);
+    ASSERT_EQ(images.size(), data.size());
+    ASSERT_EQ(images[0].size(), data.sample_size());
+
+    std::vector<vec_t> batch;
+    std::vector<label_t> batch_labels;
+    std::vector<size_t> order(data.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    data.get_batch(order, 2, 5, &batch, &batch_labels);
+    for (int i = 0; i < 5; i++) {
+        EXPECT_EQ(labels[i + 2], batch_labels[i]);
+        for (size_t j = 0; j < images[i + 2].size(); j++)
+            EXPECT_EQ(images[i + 2][j], batch[i][j]);
+    }
+
+    // training from dataset is same as training from vectors
+    network<mse, gradient_descent> n1, n2;
+    n1 << fully_connected_layer<tan_h>(9 * 8, 10);
+    n2 << fully_connected_layer<tan_h>(9 * 8, 10);
+    n1.init_weight();
+    n2[0]->weight() = n1[0]->weight();
+    n2[0]->bias() = n1[0]->bias();
+
+    n1.train(images, labels, 5, 2, nop, nop, false);
+    n2.train(data, 5, 2, nop, nop, false);
+    EXPECT_TRUE(n1.has_same_weights(n2, 0.0));
+
+    std::remove(image_file.c_str());
+    std::remove(label_file.c_str());
+}
+
+TEST(dataset, cifar10) {
+    const std::string file = "cifar10.tmp";
+    {
+        std::ofstream ofs(file.c_str(), std::ios::binary);
+        for (int i = 0; i < 3; i++) {
+            ofs.put(char(i));
+            for (int j = 0; j < CIFAR10_IMAGE_SIZE; j++) ofs.put(char((i * 7 + j * 13) % 256));
+        }
+    }
+
+    for (int padding = 0; padding < 2; padding++) {
+        std::vector<vec_t> images;
+        std::vector<label_t> labels;
+        parse_cifar10(file, &images, &labels, 0.0, 1.0, padding, padding);
+
+        image_dataset data = image_dataset::cifar10(file, 0.0, 1.0, padding, padding);
+        ASSERT_EQ(images.size(), data.size());
+
+        vec_t img;
+        for (size_t i = 0; i < data.size(); i++) {
+            data.image(i, img);
+            EXPECT_EQ(labels[i], data.label(i));
+            ASSERT_EQ(images[i].size(), img.size());
+            for (size_t j = 0; j < img.size(); j++)
+                EXPECT_EQ(images[i][j], img[j]);
+        }
+    }
+    std::remove(file.c_str());
+}
+
+TEST(dataset, async) {
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 23; i++) {
+        vec_t v(16);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 7 + j * 0.2);
+        in.push_back(v);
+        t.push_back(i % 4);
+    }
+
+    auto transform = [](vec_t& x, label_t&, std::mt19937& rng) { corrupt(x, 0.3, 0.0, rng); };
+
+    memory_dataset<> data(in, t);
+    async_dataset<memory_dataset<>> sync(data, 1, 0), async(data, 3, 4);
+    sync.set_transform(transform, 1);
+    async.set_transform(transform, 1);
+
+    // prefetched batches are same as synchronously loaded ones, also across epochs and after seek
+    std::vector<vec_t> x1, x2;
+    std::vector<label_t> t1, t2;
+    std::vector<size_t> order(in.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    const size_t firsts[] = { 0, 5, 10, 15, 20, 0, 5, 15, 20 };
+    for (size_t first : firsts) {
+        const size_t n = std::min<size_t>(5, in.size() - first);
+        sync.get_batch(order, first, n, &x1, &t1);
+        async.get_batch(order, first, n, &x2, &t2);
+        for (size_t i = 0; i < n; i++) {
+            EXPECT_EQ(t[first + i], t2[i]);
+            for (size_t j = 0; j < x1[i].size(); j++)
+                EXPECT_EQ(x1[i][j], x2[i][j]);
+        }
+    }
+
+    network<mse, gradient_descent> n1, n2;
+    n1 << fully_connected_layer<tan_h>(16, 4);
+    n2 << fully_connected_layer<tan_h>(16, 4);
+    n1.init_weight();
+    n2[0]->weight() = n1[0]->weight();
+    n2[0]->bias() = n1[0]->bias();
+
+    int batches = 0;
+    sync.set_transform(transform, 2);
+    async.set_transform(transform, 2);
+    n1.sampler(sampling::shuffle(3));
+    n2.sampler(sampling::shuffle(3));
+    n1.train(sync, 5, 3, nop, nop, false);
+    n2.train(async, 5, 3, [&]() { batches++; }, nop, false);
+
+    EXPECT_EQ(15, batches);
+    EXPECT_TRUE(n1.has_same_weights(n2, 0.0));
+}
+
+TEST(sampler, orders) {
+    std::vector<size_t> order, prev;
+
+    sampling::shuffle shuffle(7);
+    shuffle.next_epoch(50, &prev);
+    shuffle.next_epoch(50, &order);
+    EXPECT_TRUE(order != prev);
+    std::sort(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); i++) EXPECT_EQ(i, order[i]);
+
+    // each 4 consecutive samples hold all of 4 classes
+    std::vector<label_t> labels;
+    for (int i = 0; i < 40; i++) labels.push_back(i < 10 ? 0 : i < 20 ? 1 : i < 30 ? 2 : 3);
+    sampling::stratified stratified(labels);
+    stratified.next_epoch(labels.size(), &order);
+    for (size_t i = 0; i < order.size(); i += 4) {
+        std::set<label_t> classes;
+        for (size_t j = i; j < i + 4; j++) classes.insert(labels[order[j]]);
+        EXPECT_EQ(4u, classes.size());
+    }
+
+    std::vector<double> weights(10, 1.0);
+    weights[3] = 0.0;
+    sampling::weighted weighted(weights, 100);
+    weighted.next_epoch(10, &order);
+    EXPECT_EQ(100u, order.size());
+    EXPECT_TRUE(std::find(order.begin(), order.end(), 3u) == order.end());
+
+    std::vector<size_t> indices;
+    indices.push_back(4);
+    indices.push_back(1);
+    sampling::subset subset(indices);
+    subset.next_epoch(10, &order);
+    EXPECT_TRUE(order == indices);
+}
+
+TEST(sampler, train) {
+    std::vector<vec_t> in, shuffled_in;
+    std::vector<label_t> t, shuffled_t;
+    for (int i = 0; i < 20; i++) {
+        vec_t v(16);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 7 + j * 0.2);
+        in.push_back(v);
+        t.push_back(i % 4);
+    }
+
+    // training through sampler is same as training physically permuted data
+    std::vector<size_t> order;
+    sampling::shuffle(5).next_epoch(in.size(), &order);
+    for (size_t i : order) {
+        shuffled_in.push_back(in[i]);
+        shuffled_t.push_back(t[i]);
+    }
+
+    network<mse, gradient_descent> n1, n2;
+    n1 << fully_connected_layer<tan_h>(16, 4);
+    n2 << fully_connected_layer<tan_h>(16, 4);
+    n1.init_weight();
+    n2[0]->weight() = n1[0]->weight();
+    n2[0]->bias() = n1[0]->bias();
+
+    n1.sampler(sampling::shuffle(5));
+    n1.train(in, t, 4, 1, nop, nop, false);
+    n2.train(shuffled_in, shuffled_t, 4, 1, nop, nop, false);
+    EXPECT_TRUE(n1.has_same_weights(n2, 0.0));
+}
+
+TEST(network, predict_dense) {
+    // table of in(4) x out(3) channels
+    static const bool table[] = {
+        true,  false, true,
+        true,  true,  false,
+        false, true,  true,
+        true,  false, true
+    };
+    network<mse, adagrad> nn;
+    nn << convolutional_layer<tan_h>(12, 12, 3, 1, 4)
+       << average_pooling_layer<tan_h>(10, 10, 4, 2)
+       << convolutional_layer<relu>(5, 5, 2, 4, 3, connection_table(table, 4, 3))
+       << max_pooling_layer<identity>(4, 4, 3, 2)
+       << fully_connected_layer<tan_h>(12, 6)
+       << fully_connected_layer<softmax>(6, 3);
+    nn.init_weight();
+
+    const layer_size_t stride = 4, patch = 12, width = patch + stride * 3, height = patch + stride * 2;
+    vec_t image(width * height);
+    for (size_t i = 0; i < image.size(); i++) image[i] = std::sin(i * 0.37) + std::cos(i * 0.11);
+
+    index3d<layer_size_t> shape;
+    vec_t map = nn.predict_dense(image, width, height, &shape);
+
+    EXPECT_EQ(4u, shape.width_);
+    EXPECT_EQ(3u, shape.height_);
+    EXPECT_EQ(3u, shape.depth_);
+
+    // same as patch-wise prediction at the step of the pooling stride
+    for (layer_size_t y = 0; y < shape.height_; y++) {
+        for (layer_size_t x = 0; x < shape.width_; x++) {
+            vec_t patch_in(patch * patch);
+            for (layer_size_t py = 0; py < patch; py++)
+                for (layer_size_t px = 0; px < patch; px++)
+                    patch_in[py * patch + px] = image[(y * stride + py) * width + x * stride + px];
+
+            vec_t expected = nn.predict(patch_in);
+            for (layer_size_t c = 0; c < shape.depth_; c++)
+                EXPECT_NEAR(expected[c], map[shape.get_index(x, y, c)], 1E-5);
+        }
+    }
+
+    // padding::same can't be slid
+    network<mse, adagrad> padded;
+    padded << convolutional_layer<tan_h>(8, 8, 3, 1, 2, padding::same);
+    bool thrown = false;
+    try {
+        padded.predict_dense(vec_t(16 * 16), 16, 16);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+TEST(network, test_result) {
+    network<mse, adagrad> nn;
+    nn << fully_connected_layer<tan_h>(8, 6)
+       << fully_connected_layer<tan_h>(6, 4);
+    nn.init_weight();
+    set_num_threads(4);
+
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 50; i++) {
+        vec_t v(8);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 1.3 + j * 0.4);
+        in.push_back(v);
+        t.push_back(i % 4);
+    }
+
+    result res = nn.test(in, t, 2);
+    int success = 0, top2 = 0;
+    double loss = 0.0;
+    std::vector<std::vector<int> > confusion(4, std::vector<int>(4, 0));
+
+    for (size_t i = 0; i < in.size(); i++) {
+        vec_t out = nn.predict(in[i]);
+        vec_t target(4, -0.8);
+        target[t[i]] = 0.8;
+        std::vector<size_t> rank(4);
+        for (size_t j = 0; j < 4; j++) rank[j] = j;
+        std::sort(rank.begin(), rank.end(), [&](size_t a, size_t b) { return out[a] > out[b]; });
+
+        confusion[max_index(out)][t[i]]++;
+        if (static_cast<label_t>(max_index(out)) == t[i]) success++;
+        if (rank[0] == t[i] || rank[1] == t[i]) top2++;
+        for (size_t j = 0; j < 4; j++) loss += mse::f(out[j], target[j]);
+    }
+
+    EXPECT_EQ(50, res.num_total);
+    EXPECT_EQ(success, res.num_success);
+    EXPECT_EQ(top2, res.num_top_k_success);
+    EXPECT_NEAR(loss, res.loss, 1E-4);
+    for (label_t r = 0; r < 4; r++)
+        for (label_t c = 0; c < 4; c++)
+            EXPECT_EQ(confusion[r][c], res.count(r, c));
+
+    // every label is within top-4 of 4 outputs
+    EXPECT_EQ(50, nn.test(in, t, 4).num_top_k_success);
+
+    // dataset is evaluated in chunks with same result
+    result res2 = nn.test(memory_dataset<>(in, t), 2, 16);
+    EXPECT_EQ(res.num_success, res2.num_success);
+    EXPECT_EQ(res.num_top_k_success, res2.num_top_k_success);
+    EXPECT_TRUE(res.confusion_matrix == res2.confusion_matrix);
+
+    set_num_threads(0);
+}
+
+
+namespace {
+// user layer which implements only forward_propagation (out = 2 * in)
+class twice_layer : public layer<identity> {
+public:
+    explicit twice_layer(layer_size_t dim) : layer<identity>(dim, dim, 0, 0) {}
+
+    size_t fan_in_size() const override { return 1; }
+    size_t fan_out_size() const override { return 1; }
+    size_t connection_size() const override { return in_size_; }
+    std::string layer_type() const override { return "twice"; }
+
+    const vec_t& forward_propagation(const vec_t& in, size_t index) override {
+        for (size_t i = 0; i < in.size(); i++) output_[index][i] = in[i] * 2;
+        return forward_next(output_[index], index);
+    }
+
+    const vec_t& back_propagation(const vec_t& current_delta, size_t index) override {
+        for (size_t i = 0; i < current_delta.size(); i++) prev_delta_[index][i] = current_delta[i] * 2;
+        return backward_prev(prev_delta_[index], index);
+    }
+
+    const vec_t& back_propagation_2nd(const vec_t& current_delta2) override {
+        return backward_prev_2nd(current_delta2);
+    }
+};
+} // namespace
+
+TEST(network, test_without_forward) {
+    network<mse, adagrad> nn;
+    nn << fully_connected_layer<tan_h>(8, 4)
+       << twice_layer(4);
+    nn.init_weight();
+
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 20; i++) {
+        vec_t v(8);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 0.9 + j * 0.3);
+        in.push_back(v);
+        t.push_back(i % 4);
+    }
+
+    // falls back to forward_propagation instead of throwing
+    result res = nn.test(in, t, 1);
+    int success = 0;
+    for (size_t i = 0; i < in.size(); i++)
+        if (static_cast<label_t>(max_index(nn.predict(in[i]))) == t[i]) success++;
+
+    EXPECT_EQ(20, res.num_total);
+    EXPECT_EQ(success, res.num_success);
+    EXPECT_EQ(success, res.num_top_k_success);
+
+    EXPECT_EQ(0, nn.test(std::vector<vec_t>(), std::vector<label_t>()).num_total);
+
+    // outputs and regression scores also fall back to forward_propagation
+    std::vector<vec_t> out = nn.test(in);
+    std::vector<tiny_cnn::float_t> score = nn.scoreRegressor(in, 4, nop);
+    std::vector<vec_t> scores;
+    nn.scoreRegressor(in, 4, nop, &scores);
+
+    ASSERT_EQ(in.size(), out.size());
+    ASSERT_EQ(in.size(), score.size());
+    ASSERT_EQ(in.size(), scores.size());
+    for (size_t i = 0; i < in.size(); i++) {
+        const vec_t expected = nn.predict(in[i]);
+        EXPECT_TRUE(expected == out[i]);
+        EXPECT_TRUE(expected == scores[i]);
+        EXPECT_EQ(expected[0], score[i]);
+    }
+}
+
+TEST(network, freeze_without_forward) {
+    network<mse, adagrad> nn;
+    nn << fully_connected_layer<tan_h>(8, 4)
+       << twice_layer(4);
+    nn.init_weight();
+
+    // per-worker buffers which forward_propagation needs are kept
+    bool thrown = false;
+    try {
+        nn.freeze();
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    EXPECT_FALSE(nn.frozen());
+
+    std::vector<vec_t> in(4, vec_t(8, 0.5));
+    std::vector<label_t> t(4, 1);
+    EXPECT_EQ(4, nn.test(in, t, 1).num_total);
+}
+
+TEST(network, checkpoint) {
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 30; i++) {
+        vec_t v(10);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 0.9 + j * 0.3);
+        in.push_back(v);
+        t.push_back(i % 3);
+    }
+    const std::string path = "checkpoint_test.bin";
+
+    network<mse, adam> n1, n2;
+    n1 << fully_connected_layer<tan_h>(10, 8) << fully_connected_layer<tan_h>(8, 3);
+    n2 << fully_connected_layer<tan_h>(10, 8) << fully_connected_layer<tan_h>(8, 3);
+    n1.sampler(sampling::shuffle(11));
+    n2.sampler(sampling::shuffle(11));
+
+    // save in the middle of 2nd epoch, and keep training
+    int batches = 0;
+    n1.train(in, t, 4, 3, [&]() { if (++batches == 12) n1.save_checkpoint(path); }, nop);
+    n1.wait_checkpoint();
+
+    // resumed training ends up with same weights, including adam moments and shuffled order
+    n2.load_checkpoint(path);
+    n2.train(in, t, 4, 3);
+    EXPECT_TRUE(n1.has_same_weights(n2, 0.0));
+
+    // checkpoint is also a binary model
+    network<mse, adam> n3;
+    n3 << fully_connected_layer<tan_h>(10, 8) << fully_connected_layer<tan_h>(8, 3);
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    n3.load_binary(ifs);
+    ifs.close();
+
+    // optimizer mismatch
+    network<mse, momentum> n4;
+    n4 << fully_connected_layer<tan_h>(10, 8) << fully_connected_layer<tan_h>(8, 3);
+    bool thrown = false;
+    try {
+        n4.load_checkpoint(path);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+
+    std::remove(path.c_str());
+}
+
+TEST(network, checkpoint_dropout) {
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 30; i++) {
+        vec_t v(10);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 0.7 + j * 0.4);
+        in.push_back(v);
+        t.push_back(i % 3);
+    }
+    const std::string path = "checkpoint_dropout_test.bin";
+    set_num_threads(4);
+
+    network<mse, gradient_descent> n1, n2;
+    n1 << fully_connected_dropout_layer<tan_h>(10, 8) << fully_connected_layer<tan_h>(8, 3);
+    n2 << fully_connected_dropout_layer<tan_h>(10, 8) << fully_connected_layer<tan_h>(8, 3);
+
+    int batches = 0;
+    n1.train(in, t, 6, 3, [&]() { if (++batches == 7) n1.save_checkpoint(path); }, nop);
+    n1.wait_checkpoint();
+
+    // per-sample masks are drawn concurrently by workers, but only depend on the saved random state
+    n2.load_checkpoint(path);
+    n2.train(in, t, 6, 3);
+    EXPECT_TRUE(n1.has_same_weights(n2, 0.0));
+
+    set_num_threads(0);
+    std::remove(path.c_str());
+}
+
+TEST(optimizer, fused_update) {
+    // larger than a block, and not a multiple of vector width
+    const size_t size = 4096 + 37;
+    vec_t W(size), dW(size), H(size), rW, vprev(size, 0), mt(size, 0), vt(size, 0);
+    for (size_t i = 0; i < size; i++) {
+        W[i] = std::sin(i * 0.1);
+        dW[i] = std::cos(i * 0.7) * 0.1;
+    }
+
+    momentum m;
+    std::vector<vec_t> slots;
+    rW = W;
+    for (int step = 0; step < 3; step++) {
+        tiny_cnn::detail::update_weight(m, dW, H, W, slots, 0);
+        for (size_t i = 0; i < size; i++) {
+            float_t V = m.mu * vprev[i] - m.alpha * (dW[i] + rW[i] * m.lambda);
+            rW[i] += V;
+            vprev[i] = V;
+        }
+    }
+    EXPECT_EQ(1u, slots.size());
+    for (size_t i = 0; i < size; i++) EXPECT_NEAR(rW[i], W[i], 1E-6);
+
+    adam a, ra;
+    slots.clear();
+    rW = W;
+    for (int step = 0; step < 3; step++) {
+        a.begin_step();
+        tiny_cnn::detail::update_weight(a, dW, H, W, slots, 0);
+        ra.b1_t *= ra.b1;
+        ra.b2_t *= ra.b2;
+        for (size_t i = 0; i < size; i++) {
+            mt[i] = ra.b1 * mt[i] + (1 - ra.b1) * dW[i];
+            vt[i] = ra.b2 * vt[i] + (1 - ra.b2) * dW[i] * dW[i];
+            rW[i] -= ra.alpha * (mt[i] / (1 - ra.b1_t)) / std::sqrt(vt[i] / (1 - ra.b2_t) + float_t(1e-8));
+        }
+    }
+    EXPECT_EQ(2u, slots.size());
+    for (size_t i = 0; i < size; i++) EXPECT_NEAR(rW[i], W[i], 1E-5);
+}
+
+TEST(optimizer, fused_sweep) {
+    // fused sweep over all layers gives same weights as updating layer by layer
+    layers l1, l2;
+    for (int i = 0; i < 2; i++) {
+        layers& l = i == 0 ? l1 : l2;
+        l.add(std::make_shared<fully_connected_layer<tan_h>>(70, 90));
+        l.add(std::make_shared<fully_connected_layer<tan_h>>(90, 3));
+        l.init_weight();
+        l.set_worker_size(3);
+    }
+
+    momentum m1, m2;
+    adam a;
+
+    for (int step = 0; step < 2; step++) {
+        for (size_t j = 0; j < 2; j++) {
+            for (int w = 0; w < 3; w++) {
+                vec_t& dW1 = l1[j]->weight_diff(w);
+                vec_t& db1 = l1[j]->bias_diff(w);
+                for (size_t k = 0; k < dW1.size(); k++) dW1[k] = std::sin(k * 0.3 + w + step);
+                for (size_t k = 0; k < db1.size(); k++) db1[k] = std::cos(k * 0.5 + w + step);
+                if (step == 0) {
+                    l2[j]->weight() = l1[j]->weight();
+                    l2[j]->bias() = l1[j]->bias();
+                }
+                l2[j]->weight_diff(w) = dW1;
+                l2[j]->bias_diff(w) = db1;
+            }
+        }
+        l1.update_weights(&m1, 3, 5);
+        for (size_t j = 0; j < 2; j++) l2[j]->update_weight(&m2, 3, 5);
+
+        // gradients are averaged by the same operation on both paths
+        for (size_t j = 0; j < 2; j++) {
+            for (size_t k = 0; k < l1[j]->weight().size(); k++)
+                EXPECT_EQ(l2[j]->weight()[k], l1[j]->weight()[k]);
+            for (size_t k = 0; k < l1[j]->bias().size(); k++)
+                EXPECT_EQ(l2[j]->bias()[k], l1[j]->bias()[k]);
+            for (int w = 0; w < 3; w++)
+                EXPECT_FLOAT_EQ(float_t(0), l1[j]->weight_diff(w)[7]);
+        }
+    }
+
+    // adam advances t once per sweep, not once per tensor
+    l1.update_weights(&a, 3, 5);
+    EXPECT_NEAR(0.9 * 0.9, a.b1_t, 1E-6);
+
+    // parameters of all layers live in one arena, each tensor aligned
+    EXPECT_TRUE(l1.packed());
+    EXPECT_FALSE(l2.packed());
+    EXPECT_EQ(l1[0]->weight().data() + 6304, l1[0]->bias().data()); // 70 * 90 padded to 64 bytes
+    EXPECT_EQ(l1[0]->bias().data() + 96, l1[1]->weight().data());
+    for (size_t j = 0; j < 2; j++) {
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(l1[j]->weight().data()) % 64);
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(l1[j]->weight_diff(2).data()) % 64);
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(l1[j]->bias_slots()[1].data()) % 64);
+    }
+
+    // new replicas are not in the arena, and are packed again by next update
+    const vec_t W = l1[1]->weight();
+    l1.set_worker_size(4);
+    EXPECT_FALSE(l1.packed());
+    l1.update_weights(&a, 4, 5);
+    EXPECT_TRUE(l1.packed());
+    EXPECT_TRUE(W == l1[1]->weight()); // gradients are zero
+}
+
+namespace {
+// out-of-tree style optimizer which reaches its state by get<Index>(W) (same update as adagrad)
+struct legacy_adagrad : public stateful_optimizer<tiny_cnn::float_t, 1, false> {
+    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W) {
+        vec_t& g = get<0>(W);
+        for (size_t i = 0; i < W.size(); i++) {
+            g[i] += dW[i] * dW[i];
+            W[i] -= tiny_cnn::float_t(0.01) * dW[i] / (std::sqrt(g[i]) + tiny_cnn::float_t(1e-8));
+        }
+    }
+};
+} // namespace
+
+TEST(optimizer, legacy_stateful) {
+    fully_connected_layer<tan_h> l1(10, 7), l2(10, 7);
+    l1.init_weight();
+    l2.weight() = l1.weight();
+    l2.bias() = l1.bias();
+
+    adagrad a;
+    legacy_adagrad b;
+
+    for (int step = 0; step < 3; step++) {
+        for (size_t k = 0; k < l1.weight().size(); k++) l1.weight_diff(0)[k] = std::sin(k * 0.3 + step);
+        for (size_t k = 0; k < l1.bias().size(); k++) l1.bias_diff(0)[k] = std::cos(k * 0.5 + step);
+        l2.weight_diff(0) = l1.weight_diff(0);
+        l2.bias_diff(0) = l1.bias_diff(0);
+
+        l1.update_weight(&a, 1, 1);
+        l2.update_weight(&b, 1, 1);
+    }
+
+    // state of the legacy optimizer is held by the layer, as built-in ones
+    ASSERT_EQ(1u, l2.weight_slots().size());
+    for (size_t k = 0; k < l1.weight().size(); k++) {
+        EXPECT_NEAR(l1.weight()[k], l2.weight()[k], 1E-5);
+        EXPECT_NEAR(l1.weight_slots()[0][k], l2.weight_slots()[0][k], 1E-5);
+    }
+    for (size_t k = 0; k < l1.bias().size(); k++)
+        EXPECT_NEAR(l1.bias()[k], l2.bias()[k], 1E-5);
+}
+
+TEST(network, freeze) {
+    network<mse, adam> nn;
+
+    nn << fully_connected_layer<tan_h>(100, 50)
+       << fully_connected_layer<tan_h>(50, 10);
+    nn.init_weight();
+
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 4; i++) {
+        vec_t v(100);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 10 + j * 0.1);
+        in.push_back(v);
+        t.push_back(i);
+    }
+    nn.train(in, t, 4, 1, nop, nop, false);
+
+    const size_t trained = nn.memory_usage();
+    std::vector<vec_t> expected;
+    for (auto& v : in) expected.push_back(nn.predict(v));
+
+    nn.freeze();
+    EXPECT_TRUE(nn.frozen());
+    EXPECT_TRUE(nn.memory_usage() * 5 < trained);
+
+    for (size_t i = 0; i < in.size(); i++) {
+        vec_t actual = nn.predict(in[i]);
+        for (size_t j = 0; j < actual.size(); j++)
+            EXPECT_EQ(expected[i][j], actual[j]);
+    }
+
+    bool thrown = false;
+    try {
+        nn.train(in, t);
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+TEST(parallel, for_and_task_group) {
+    set_num_threads(4);
+
+    std::vector<int> hit(1000, 0);
+    for_(true, 0, hit.size(), [&](const blocked_range& r) {
+        for (int i = r.begin(); i < r.end(); i++) hit[i]++;
+    }, 1);
+    for (auto h : hit) EXPECT_EQ(1, h);
+
+    // nested parallelism
+    std::vector<int> sum(8, 0);
+    task_group g;
+    for (int i = 0; i < 8; i++) {
+        g.run([&, i] {
+            std::vector<int> v(100, 0);
+            for_i(true, 100, [&](int j) { v[j] = j; });
+            sum[i] = std::accumulate(v.begin(), v.end(), 0);
+        });
+    }
+    g.wait();
+    for (auto s : sum) EXPECT_EQ(4950, s);
+
+    // exception in task is rethrown by wait
+    bool thrown = false;
+    task_group g2;
+    g2.run([] { throw nn_error("error in task"); });
+    try {
+        g2.wait();
+    } catch (const nn_error&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+
+    // more tasks than the initial size of queues, with captures too large to be stored inline
+    std::vector<int> hit2(100, 0);
+    task_group g3;
+    for (int i = 0; i < 100; i++) {
+        std::array<int, 32> index;
+        index.fill(i);
+        g3.run([&hit2, index] { hit2[index[0]]++; });
+    }
+    g3.wait();
+    for (auto h : hit2) EXPECT_EQ(1, h);
+
+    set_num_threads(0);
+}
+
+TEST(network, gradient_replicas) {
+    typedef network<mse, gradient_descent> net;
+    net n1, n2;
+
+    n1 << convolutional_layer<tan_h>(8, 8, 3, 1, 2)
+       << fully_connected_layer<sigmoid>(6 * 6 * 2, 4);
+    n2 << convolutional_layer<tan_h>(8, 8, 3, 1, 2)
+       << fully_connected_layer<sigmoid>(6 * 6 * 2, 4);
+
+    for (size_t i = 0; i < n1.depth(); i++) {
+        vec_t& w1 = n1[i]->weight();
+        vec_t& w2 = n2[i]->weight();
+        for (size_t j = 0; j < w1.size(); j++) w1[j] = w2[j] = std::cos(j * 0.37) * 0.3;
+    }
+
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 20; i++) {
+        vec_t v(8 * 8);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 7 + j * 0.2);
+        in.push_back(v);
+        t.push_back(i % 4);
+    }
+
+    // one gradient replica vs. one replica per thread, merged in parallel
+    set_num_threads(1);
+    n1.train(in, t, 10, 2, nop, nop, false);
+
+    set_num_threads(4);
+    n2.train(in, t, 10, 2, nop, nop, false);
+    set_num_threads(0);
+
+    EXPECT_TRUE(n1.has_same_weights(n2, 1e-5));
+}
+
+template <typename Activation>
+void check_activation_vec() {
+    Activation h;
+    vec_t a(100), out(100), delta(100, 0.5);
+
+    for (size_t i = 0; i < a.size(); i++) a[i] = std::sin(i * 0.9) * 10.0;
+
+    h.f_vec(&a[0], &out[0], a.size());
+    for (size_t i = 0; i < a.size(); i++)
+        EXPECT_EQ(h.f(a, i), out[i]);
+
+    h.df_vec(&out[0], &delta[0], out.size());
+    for (size_t i = 0; i < out.size(); i++)
+        EXPECT_EQ(float_t(0.5) * h.df(out[i]), delta[i]);
+
+    // df_chain is the product with rows of the jacobian df(y, i)
+    vec_t dE_dy(out.size());
+    for (size_t i = 0; i < out.size(); i++) dE_dy[i] = std::cos(i * 0.3);
+    vec_t chain = dE_dy;
+    h.df_chain(&out[0], &chain[0], out.size());
+    for (size_t i = 0; i < out.size(); i++) {
+        const vec_t row = static_cast<const activation::function&>(h).df(out, i);
+        float_t expected = 0;
+        for (size_t k = 0; k < out.size(); k++) expected += dE_dy[k] * row[k];
+        EXPECT_NEAR(expected, chain[i], 1e-5);
+    }
+
+    h.set_approximate(true);
+    h.f_vec(&a[0], &out[0], a.size());
+    for (size_t i = 0; i < a.size(); i++)
+        EXPECT_NEAR(h.f(a, i), out[i], 1e-6);
+}
+
+TEST(activation, vectorized) {
+    check_activation_vec<activation::identity>();
+    check_activation_vec<activation::sigmoid>();
+    check_activation_vec<activation::relu>();
+    check_activation_vec<activation::leaky_relu>();
+    check_activation_vec<activation::softmax>();
+    check_activation_vec<activation::tan_h>();
+    check_activation_vec<activation::tan_hp1m2>();
+}
+
+#ifdef CNN_USE_PROFILER
+TEST(network, profile) {
+    network<mse, gradient_descent> nn;
+
+    nn << convolutional_layer<tan_h>(8, 8, 3, 1, 2)
+       << fully_connected_layer<sigmoid>(6 * 6 * 2, 4);
+
+    std::vector<vec_t> in;
+    std::vector<label_t> t;
+    for (int i = 0; i < 20; i++) {
+        vec_t v(8 * 8);
+        for (size_t j = 0; j < v.size(); j++) v[j] = std::sin(i * 7 + j * 0.2);
+        in.push_back(v);
+        t.push_back(i % 4);
+    }
+
+    for (int batch_mode = 0; batch_mode < 2; batch_mode++) {
+        nn.set_batch_mode(batch_mode != 0);
+        nn.reset_profile();
+
+        set_num_threads(4);
+        nn.train(in, t, 10, 1);
+        set_num_threads(0);
+
+        for (size_t i = 0; i < nn.depth(); i++) {
+            const profile_stats f = nn[i]->profile().total(profile_phase::forward);
+            const profile_stats b = nn[i]->profile().total(profile_phase::backward);
+            const profile_stats u = nn[i]->profile().total(profile_phase::update);
+
+            EXPECT_EQ(20, f.samples);
+            EXPECT_EQ(20, b.samples);
+            EXPECT_EQ(2, u.calls);
+            EXPECT_TRUE(f.seconds > 0.0 && b.seconds > 0.0 && u.seconds > 0.0);
+        }
+    }
+
+    std::ostringstream os;
+    nn.print_profile(os);
+    EXPECT_TRUE(os.str().find("fully-connected") != std::string::npos);
+}
+#endif
+
 int main(void) {
     RUN_ALL_TESTS();
 }
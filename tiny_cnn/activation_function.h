@@ -27,12 +27,54 @@
 #pragma once
 #include "util.h"
 #include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
 
 namespace tiny_cnn {
 namespace activation {
 
+namespace detail {
+
+/**
+ * exp with range reduction exp(x) = 2^n * exp(r), |r| <= ln2/2 and polynomial of cephes expf.
+ * max relative error is about 2e-7 in float. unlike std::exp it has no branches and
+ * library calls, so loops of fast_exp are auto-vectorized.
+ **/
+inline float fast_exp(float x) {
+    x = x < -87.0f ? -87.0f : x;
+    x = x > 88.0f ? 88.0f : x;
+
+    // n = round(x / ln2). argument of the cast is always positive, so truncation is floor
+    const int n = static_cast<int>(x * 1.44269504088896341f + 128.5f) - 128;
+    const float fn = static_cast<float>(n);
+    float r = x - fn * 0.693359375f;
+    r = r - fn * -2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+
+    const int32_t bits = (n + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// no approximation for double precision
+inline double fast_exp(double x) {
+    return std::exp(x);
+}
+
+} // namespace detail
+
 class function {
 public:
+    function() : approximate_(false) {}
     virtual ~function() {}
 
     virtual float_t f(const vec_t& v, size_t index) const = 0;
@@ -45,6 +87,55 @@ public:
 
     // target value range for learning
     virtual std::pair<float_t, float_t> scale() const = 0;
+
+    /**
+     * out[i] = f(in, i) for i in [0, n) (in and out can be the same buffer).
+     * built-in functions override this by vectorizable loops.
+     **/
+    virtual void f_vec(const float_t* in, float_t* out, size_t n) const {
+        vec_t v(in, in + n);
+        for (size_t i = 0; i < n; i++)
+            out[i] = f(v, i);
+    }
+
+    ///< delta[i] *= df(y[i]) for i in [0, n)
+    virtual void df_vec(const float_t* y, float_t* delta, size_t n) const {
+        for (size_t i = 0; i < n; i++)
+            delta[i] *= df(y[i]);
+    }
+
+    /**
+     * delta = (dy/da)^T delta for output y of size n, that is dE/da from dE/dy in place.
+     * same as df_vec for elementwise functions. otherwise falls back to rows of the jacobian df(y, i),
+     * which allocates; built-in functions override this without allocation
+     **/
+    virtual void df_chain(const float_t* y, float_t* delta, size_t n) const {
+        if (elementwise()) {
+            df_vec(y, delta, n);
+            return;
+        }
+        const vec_t v(y, y + n), dE_dy(delta, delta + n);
+        for (size_t i = 0; i < n; i++) {
+            const vec_t dy_da = df(v, i);
+            delta[i] = float_t(0);
+            for (size_t k = 0; k < n; k++) delta[i] += dE_dy[k] * dy_da[k];
+        }
+    }
+
+    ///< true if f(v, i) depends only on v[i], so that f_vec can be applied to any part of vector
+    virtual bool elementwise() const { return false; }
+
+    /**
+     * use approximations of exp in f_vec (see detail::fast_exp).
+     * faster, but results are slightly different from f
+     **/
+    void set_approximate(bool approximate) { approximate_ = approximate; }
+    bool approximate() const { return approximate_; }
+
+protected:
+    float_t exp(float_t x) const { return approximate_ ? detail::fast_exp(x) : std::exp(x); }
+
+    bool approximate_;
 };
 
 class identity : public function {
@@ -52,6 +143,12 @@ public:
     float_t f(const vec_t& v, size_t i) const override { return v[i]; }
     float_t df(float_t /*y*/) const override { return 1; }  
     std::pair<float_t, float_t> scale() const override { return std::make_pair(-0.8, 0.8); }
+
+    void f_vec(const float_t* in, float_t* out, size_t n) const override {
+        if (in != out) std::copy(in, in + n, out);
+    }
+    void df_vec(const float_t* /*y*/, float_t* /*delta*/, size_t /*n*/) const override {}
+    bool elementwise() const override { return true; }
 };
 
 class sigmoid : public function {
@@ -59,6 +156,18 @@ public:
     float_t f(const vec_t& v, size_t i) const override { return 1.0 / (1.0 + std::exp(-v[i])); }
     float_t df(float_t y) const override { return y * (1.0 - y); }
     std::pair<float_t, float_t> scale() const override { return std::make_pair(0.1, 0.9); }
+
+    void f_vec(const float_t* in, float_t* out, size_t n) const override {
+        if (approximate_) {
+            for (size_t i = 0; i < n; i++) out[i] = float_t(1) / (float_t(1) + detail::fast_exp(-in[i]));
+        } else {
+            for (size_t i = 0; i < n; i++) out[i] = 1.0 / (1.0 + std::exp(-in[i]));
+        }
+    }
+    void df_vec(const float_t* y, float_t* delta, size_t n) const override {
+        for (size_t i = 0; i < n; i++) delta[i] *= static_cast<float_t>(y[i] * (1.0 - y[i]));
+    }
+    bool elementwise() const override { return true; }
 };
 
 class relu : public function {
@@ -66,6 +175,14 @@ public:
     float_t f(const vec_t& v, size_t i) const override { return std::max(static_cast<float_t>(0.0), v[i]); }
     float_t df(float_t y) const override { return y > 0.0 ? 1.0 : 0.0; }
     std::pair<float_t, float_t> scale() const override { return std::make_pair(0.1, 0.9); }
+
+    void f_vec(const float_t* in, float_t* out, size_t n) const override {
+        for (size_t i = 0; i < n; i++) out[i] = std::max(float_t(0), in[i]);
+    }
+    void df_vec(const float_t* y, float_t* delta, size_t n) const override {
+        for (size_t i = 0; i < n; i++) delta[i] = y[i] > 0 ? delta[i] : float_t(0);
+    }
+    bool elementwise() const override { return true; }
 };
 
 typedef relu rectified_linear; // for compatibility
@@ -75,6 +192,14 @@ public:
     float_t f(const vec_t& v, size_t i) const override { return (v[i] > 0) ? v[i] : 0.01 * v[i]; }
     float_t df(float_t y) const override { return y > 0.0 ? 1.0 : 0.01; }
     std::pair<float_t, float_t> scale() const override { return std::make_pair(0.1, 0.9); }
+
+    void f_vec(const float_t* in, float_t* out, size_t n) const override {
+        for (size_t i = 0; i < n; i++) out[i] = (in[i] > 0) ? in[i] : static_cast<float_t>(0.01 * in[i]);
+    }
+    void df_vec(const float_t* y, float_t* delta, size_t n) const override {
+        for (size_t i = 0; i < n; i++) delta[i] *= y[i] > 0 ? float_t(1) : float_t(0.01);
+    }
+    bool elementwise() const override { return true; }
 };
 
 class softmax : public function {
@@ -101,6 +226,30 @@ public:
     }
 
     std::pair<float_t, float_t> scale() const override { return std::make_pair(0.0, 1.0); }
+
+    // O(n) version of f: max and denominator are computed once
+    void f_vec(const float_t* in, float_t* out, size_t n) const override {
+        if (n == 0) return;
+        const float_t alpha = *std::max_element(in, in + n);
+        float_t denom = 0.0;
+
+        for (size_t i = 0; i < n; i++) {
+            out[i] = exp(in[i] - alpha);
+            denom += out[i];
+        }
+        for (size_t i = 0; i < n; i++)
+            out[i] /= denom;
+    }
+    void df_vec(const float_t* y, float_t* delta, size_t n) const override {
+        for (size_t i = 0; i < n; i++) delta[i] *= static_cast<float_t>(y[i] * (1.0 - y[i]));
+    }
+
+    // jacobian is diag(y) - y y^T, so dE/da[i] = y[i] * (dE/dy[i] - dot(dE/dy, y))
+    void df_chain(const float_t* y, float_t* delta, size_t n) const override {
+        float_t s = 0.0;
+        for (size_t i = 0; i < n; i++) s += delta[i] * y[i];
+        for (size_t i = 0; i < n; i++) delta[i] = y[i] * (delta[i] - s);
+    }
 };
 
 class tan_h : public function {
@@ -111,26 +260,25 @@ public:
         return (ep - em) / (ep + em);
     }
 
-    // fast approximation of tanh (improve 2-3% speed in LeNet-5)
-    /*float_t f(float_t x) const {
-        const float_t x2 = x * x;
-        x *= 1.0 + x2 * (0.1653 + x2 * 0.0097);
-        return x / std::sqrt(1.0 + x * x);// invsqrt(static_cast<float>(1.0 + x * x));
-    }*/
-
     float_t df(float_t y) const override { return 1.0 - sqr(y); }
     std::pair<float_t, float_t> scale() const override { return std::make_pair(-0.8, 0.8); }
 
-private:
-    /*float invsqrt(float x) const {
-        float x2 = x * 0.5f;
-        long i = *reinterpret_cast<long*>(&x);
-
-        i = 0x5f3759df - (i >> 1);
-        x = *reinterpret_cast<float*>(&i);
-        x = x * (1.5f - (x2 * x * x));
-        return x;
-    }*/
+    void f_vec(const float_t* in, float_t* out, size_t n) const override {
+        if (approximate_) {
+            // tanh(x) = 1 - 2 / (exp(2x) + 1), one exp per element
+            for (size_t i = 0; i < n; i++) out[i] = float_t(1) - float_t(2) / (detail::fast_exp(2 * in[i]) + float_t(1));
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                const float_t ep = std::exp(in[i]);
+                const float_t em = std::exp(-in[i]);
+                out[i] = (ep - em) / (ep + em);
+            }
+        }
+    }
+    void df_vec(const float_t* y, float_t* delta, size_t n) const override {
+        for (size_t i = 0; i < n; i++) delta[i] *= static_cast<float_t>(1.0 - y[i] * y[i]);
+    }
+    bool elementwise() const override { return true; }
 };
 
 // s tan_h, but scaled to match the other functions
@@ -143,6 +291,22 @@ public:
 
     float_t df(float_t y) const override { return 2 * y *(1.0 - y); }
     std::pair<float_t, float_t> scale() const override { return std::make_pair(0.1, 0.9); }
+
+    void f_vec(const float_t* in, float_t* out, size_t n) const override {
+        if (approximate_) {
+            // e^x / (e^x + e^-x) = 1 / (1 + e^-2x)
+            for (size_t i = 0; i < n; i++) out[i] = float_t(1) / (float_t(1) + detail::fast_exp(-2 * in[i]));
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                const float_t ep = std::exp(in[i]);
+                out[i] = ep / (ep + std::exp(-in[i]));
+            }
+        }
+    }
+    void df_vec(const float_t* y, float_t* delta, size_t n) const override {
+        for (size_t i = 0; i < n; i++) delta[i] *= static_cast<float_t>(2 * y[i] * (1.0 - y[i]));
+    }
+    bool elementwise() const override { return true; }
 };
 
 } // namespace activation
@@ -0,0 +1,149 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace tiny_cnn {
+
+/**
+ * number of heap allocations made by aligned_allocator so far.
+ * counted only if CNN_COUNT_ALLOCATIONS is defined, and always 0 otherwise
+ **/
+inline std::atomic<size_t>& aligned_allocation_count() {
+    static std::atomic<size_t> count(0);
+    return count;
+}
+
+/**
+ * allocator for vec_t.
+ * - memory is aligned to 64 bytes (cache line, and enough for aligned SSE/AVX loads)
+ * - it can also adopt memory owned by someone else (e.g. weights in memory-mapped model file).
+ *   such memory is never freed, and its elements are left untouched on construction.
+ **/
+template <typename T, std::size_t Alignment = 64>
+class aligned_allocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    // copy of a container gets its own memory, but moves and swaps carry external memory with them
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template <typename U>
+    struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+    aligned_allocator() : external_(nullptr), external_size_(0) {}
+
+    // allocator which returns [external, external + size) for the request of size elements
+    aligned_allocator(T* external, size_type size) : external_(external), external_size_(size) {}
+
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment>& rhs)
+        : external_(reinterpret_cast<T*>(rhs.external())), external_size_(rhs.external_size()) {}
+
+    aligned_allocator select_on_container_copy_construction() const { return aligned_allocator(); }
+
+    T* allocate(size_type n) {
+        if (external_ && n == external_size_) return external_;
+        if (n == 0) return nullptr;
+#ifdef CNN_COUNT_ALLOCATIONS
+        aligned_allocation_count().fetch_add(1, std::memory_order_relaxed);
+#endif
+
+        void* p = nullptr;
+#ifdef _WIN32
+        p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) p = nullptr;
+#endif
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_type /*n*/) {
+        if (!p || is_external(p)) return;
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        // keep contents of external memory (value-initialization would clear it)
+        if (sizeof...(Args) == 0 && is_external(p)) return;
+        ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U* p) { p->~U(); }
+
+    size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+
+    T* external() const { return external_; }
+    size_type external_size() const { return external_size_; }
+
+    template <typename U>
+    bool is_external(const U* p) const {
+        const std::uintptr_t first = reinterpret_cast<std::uintptr_t>(external_);
+        const std::uintptr_t last = reinterpret_cast<std::uintptr_t>(external_ + external_size_);
+        const std::uintptr_t x = reinterpret_cast<std::uintptr_t>(p);
+        return external_ && first <= x && x < last;
+    }
+
+private:
+    T* external_;
+    size_type external_size_;
+};
+
+template <typename T, typename U, std::size_t A>
+bool operator == (const aligned_allocator<T, A>& lhs, const aligned_allocator<U, A>& rhs) {
+    return static_cast<const void*>(lhs.external()) == static_cast<const void*>(rhs.external());
+}
+
+template <typename T, typename U, std::size_t A>
+bool operator != (const aligned_allocator<T, A>& lhs, const aligned_allocator<U, A>& rhs) {
+    return !(lhs == rhs);
+}
+
+} // namespace tiny_cnn
@@ -26,7 +26,7 @@
 */
 #pragma once
 #include "util.h"
-#include "partial_connected_layer.h"
+#include "layer.h"
 #include "image.h"
 #include "activation_function.h"
 
@@ -34,22 +34,135 @@ namespace tiny_cnn {
 
 
 template<typename Activation = activation::identity>
-class average_pooling_layer : public partial_connected_layer<Activation> {
+class average_pooling_layer : public layer<Activation> {
 public:
-    typedef partial_connected_layer<Activation> Base;
+    typedef layer<Activation> Base;
     CNN_USE_LAYER_MEMBERS;
 
     average_pooling_layer(layer_size_t in_width, layer_size_t in_height, layer_size_t in_channels, layer_size_t pooling_size)
+        : average_pooling_layer(in_width, in_height, in_channels, pooling_size, pooling_size) {}
+
+    /**
+     * @param stride [in] distance between windows. windows overlap if stride < pooling_size
+     **/
+    average_pooling_layer(layer_size_t in_width, layer_size_t in_height, layer_size_t in_channels, layer_size_t pooling_size, layer_size_t stride)
     : Base(in_width * in_height * in_channels, 
-           in_width * in_height * in_channels / sqr(pooling_size), 
-           in_channels, in_channels, 1.0 / sqr(pooling_size)),
+           pooled_length(in_width, pooling_size, stride) * pooled_length(in_height, pooling_size, stride) * in_channels,
+           in_channels, in_channels),
       in_(in_width, in_height, in_channels), 
-      out_(in_width/pooling_size, in_height/pooling_size, in_channels)
+      out_(pooled_length(in_width, pooling_size, stride), pooled_length(in_height, pooling_size, stride), in_channels),
+      pool_size_(pooling_size),
+      stride_(stride),
+      scale_factor_(float_t(1) / sqr(pooling_size))
     {
-        if ((in_width % pooling_size) || (in_height % pooling_size))
-            pooling_size_mismatch(in_width, in_height, pooling_size);
+        check_pooling_size(in_width, in_height, pooling_size, stride);
+    }
+
+    size_t connection_size() const override {
+        return (sqr(pool_size_) + 1) * out_.size();
+    }
+
+    size_t fan_in_size() const override {
+        return sqr(pool_size_);
+    }
+
+    size_t fan_out_size() const override {
+        return pooling_overlap(pool_size_, stride_, out_.width_) * pooling_overlap(pool_size_, stride_, out_.height_);
+    }
+
+    const vec_t& forward_propagation(const vec_t& in, size_t index) override {
+        fprop(in, a_[index], output_[index]);
+
+        return forward_next(output_[index], index);
+    }
+
+    bool supports_forward() const override { return true; }
+
+    const vec_t& forward(const vec_t& in, layer_workspace& ws) const override {
+        ws.a.resize(out_size_);
+        ws.output.resize(out_size_);
+
+        fprop(in, ws.a, ws.output);
+        return ws.output;
+    }
+
+    // a = W[c] * mean of window + b[c], the same kernel as fprop at every window of the map
+    const vec_t& forward_dense(const vec_t& in, index3d<layer_size_t>& shape, layer_workspace& ws) const override {
+        if (shape.depth_ != in_.depth_ || shape.width_ < pool_size_ || shape.height_ < pool_size_)
+            dense_shape_mismatch(*this, shape);
+
+        const index3d<layer_size_t> out(pooled_length(shape.width_, pool_size_, stride_),
+                                        pooled_length(shape.height_, pool_size_, stride_), shape.depth_);
+        ws.a.resize(out.size());
+        ws.output.resize(out.size());
+
+        for_(parallelize_, 0, out.depth_ * out.height_, [&](const blocked_range& r) {
+            for (int i = r.begin(); i < r.end(); i++)
+                pool_row(&in[0], shape, out, i / out.height_, i % out.height_, &ws.a[0]);
+        });
+
+        this->activate_map(ws.a, ws.output, out, ws);
+        shape = out;
+        return ws.output;
+    }
+
+    /**
+     * prev_delta[i] = sum of W[c] * delta / pool^2 over windows containing i,
+     * dW[c] += sum of delta * mean of window, db[c] += sum of delta.
+     * channels own their inputs and weights, so they run in parallel without synchronization
+     **/
+    const vec_t& back_propagation(const vec_t& current_delta, size_t index) override {
+        const vec_t& prev_out = prev_->output(index);
+        const activation::function& prev_h = prev_->activation_function();
+        vec_t& prev_delta = prev_delta_[index];
 
-        init_connection(pooling_size);
+        for_(parallelize_, 0, in_.depth_, [&](const blocked_range& r) {
+            for (int c = r.begin(); c < r.end(); c++) {
+                float_t dw = 0, db = 0;
+
+                spread(&current_delta[0], c, W_[c] * scale_factor_, &prev_delta[0]);
+
+                for (layer_size_t y = 0; y < out_.height_; y++) {
+                    for (layer_size_t x = 0; x < out_.width_; x++) {
+                        const float_t d = current_delta[out_.get_index(x, y, c)];
+                        dw += d * window_sum(&prev_out[0], x, y, c, false);
+                        db += d;
+                    }
+                }
+                dW_[index][c] += dw * scale_factor_;
+                db_[index][c] += db;
+            }
+        }, 1);
+
+        prev_h.df_vec(&prev_out[0], &prev_delta[0], in_size_);
+
+        return backward_prev(prev_delta_[index], index);
+    }
+
+    const vec_t& back_propagation_2nd(const vec_t& current_delta2) override {
+        const vec_t& prev_out = prev_->output(0);
+        const activation::function& prev_h = prev_->activation_function();
+
+        for (layer_size_t c = 0; c < in_.depth_; c++) {
+            float_t dw = 0, db = 0;
+
+            spread(&current_delta2[0], c, sqr(W_[c] * scale_factor_), &prev_delta2_[0]);
+
+            for (layer_size_t y = 0; y < out_.height_; y++) {
+                for (layer_size_t x = 0; x < out_.width_; x++) {
+                    const float_t d = current_delta2[out_.get_index(x, y, c)];
+                    dw += d * window_sum(&prev_out[0], x, y, c, true);
+                    db += d;
+                }
+            }
+            Whessian_[c] += dw * sqr(scale_factor_);
+            bhessian_[c] += db;
+        }
+
+        for (layer_size_t i = 0; i < in_size_; i++)
+            prev_delta2_[i] *= sqr(prev_h.df(prev_out[i]));
+
+        return backward_prev_2nd(prev_delta2_);
     }
 
     image<> output_to_image(size_t worker_index = 0) const override {
@@ -59,32 +172,79 @@ public:
     index3d<layer_size_t> in_shape() const override { return in_; }
     index3d<layer_size_t> out_shape() const override { return out_; }
     std::string layer_type() const override { return "ave-pool"; }
+    size_t pool_size() const { return pool_size_; }
+    size_t stride() const { return stride_; }
 
 private:
-    void init_connection(layer_size_t pooling_size) {
-        for (layer_size_t c = 0; c < in_.depth_; ++c)
-            for (layer_size_t y = 0; y < in_.height_; y += pooling_size)
-                for (layer_size_t x = 0; x < in_.width_; x += pooling_size)
-                    connect_kernel(pooling_size, x, y, c);
+    void fprop(const vec_t& in, vec_t& a, vec_t& out) const {
+        const bool elementwise = h_.elementwise();
+        const layer_size_t w = out_.width_;
 
+        for_(parallelize_, 0, out_.depth_ * out_.height_, [&](const blocked_range& r) {
+            for (int i = r.begin(); i < r.end(); i++)
+                pool_row(&in[0], in_, out_, i / out_.height_, i % out_.height_, &a[0]);
 
-        for (layer_size_t c = 0; c < in_.depth_; ++c)
-            for (layer_size_t y = 0; y < out_.height_; ++y)
-                for (layer_size_t x = 0; x < out_.width_; ++x)
-                    this->connect_bias(c, out_.get_index(x, y, c));
+            if (elementwise) h_.f_vec(&a[r.begin() * w], &out[r.begin() * w], (r.end() - r.begin()) * w);
+        });
+
+        if (!elementwise) h_.f_vec(&a[0], &out[0], out_size_);
+    }
+
+    // row y of channel c: a = W[c] * (sum of window) / pool^2 + b[c]. each tap of the window is added to the whole row
+    void pool_row(const float_t* in, const index3d<layer_size_t>& in_shape, const index3d<layer_size_t>& out_shape,
+                  layer_size_t c, layer_size_t y, float_t* a) const {
+        const layer_size_t p = pool_size_, s = stride_, w = out_shape.width_;
+        float_t* dst = &a[out_shape.get_index(0, y, c)];
+
+        std::fill(dst, dst + w, float_t(0));
+
+        for (layer_size_t dy = 0; dy < p; dy++) {
+            for (layer_size_t dx = 0; dx < p; dx++) {
+                const float_t* src = &in[in_shape.get_index(dx, y * s + dy, c)];
+                for (layer_size_t x = 0; x < w; x++)
+                    dst[x] += src[x * s];
+            }
+        }
+
+        const float_t k = W_[c] * scale_factor_, b = b_[c];
+        for (layer_size_t x = 0; x < w; x++)
+            dst[x] = dst[x] * k + b;
+    }
+
+    // sum (or sum of squares) of window (x, y) in channel c of in
+    float_t window_sum(const float_t* in, layer_size_t x, layer_size_t y, layer_size_t c, bool squared) const {
+        float_t sum = 0;
+        for (layer_size_t dy = 0; dy < pool_size_; dy++) {
+            const float_t* src = &in[in_.get_index(x * stride_, y * stride_ + dy, c)];
+            for (layer_size_t dx = 0; dx < pool_size_; dx++)
+                sum += squared ? sqr(src[dx]) : src[dx];
+        }
+        return sum;
     }
 
-    void connect_kernel(layer_size_t pooling_size, layer_size_t x, layer_size_t y, layer_size_t inc) {
-        for (layer_size_t dy = 0; dy < pooling_size; ++dy)
-            for (layer_size_t dx = 0; dx < pooling_size; ++dx)
-                this->connect_weight(
-                    in_.get_index(x + dx, y + dy, inc), 
-                    out_.get_index(x / pooling_size, y / pooling_size, inc),
-                    inc);
+    // channel c of prev = sum of k * delta over windows containing each input
+    void spread(const float_t* delta, layer_size_t c, float_t k, float_t* prev) const {
+        const layer_size_t area = in_.width_ * in_.height_;
+
+        std::fill(prev + c * area, prev + (c + 1) * area, float_t(0));
+
+        for (layer_size_t y = 0; y < out_.height_; y++) {
+            for (layer_size_t x = 0; x < out_.width_; x++) {
+                const float_t d = k * delta[out_.get_index(x, y, c)];
+                for (layer_size_t dy = 0; dy < pool_size_; dy++) {
+                    float_t* dst = &prev[in_.get_index(x * stride_, y * stride_ + dy, c)];
+                    for (layer_size_t dx = 0; dx < pool_size_; dx++)
+                        dst[dx] += d;
+                }
+            }
+        }
     }
 
     index3d<layer_size_t> in_;
     index3d<layer_size_t> out_;
+    layer_size_t pool_size_;
+    layer_size_t stride_;
+    float_t scale_factor_;
 };
 
 } // namespace tiny_cnn
@@ -0,0 +1,249 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "util.h"
+#include "layers.h"
+#include "mapped_file.h"
+
+namespace tiny_cnn {
+
+/**
+ * binary model format
+ *
+ * [file_header][layer_record x num_layers][padding][weights of layer0][padding][biases of layer0][padding]...
+ *
+ * - all values are stored in native byte order. byte_order is checked when loading
+ * - weight/bias blobs are raw arrays of float_t, and each of them starts at 64-byte aligned offset,
+ *   so that layers can use them directly from memory-mapped file
+ **/
+namespace binary_format {
+
+enum {
+    current_version = 1,
+    alignment = 64,
+    type_length = 32
+};
+
+enum dtype : uint32_t {
+    float32 = 1,
+    float64 = 2
+};
+
+struct file_header {
+    char     magic[8];   // "tinycnn\0"
+    uint32_t version;
+    uint32_t byte_order; // 0x01020304
+    uint32_t dtype;      // type of float_t
+    uint32_t num_layers; // except input-layer
+    uint64_t file_size;
+};
+
+struct layer_record {
+    char     type[type_length]; // layer_type(), zero-padded
+    uint32_t in_shape[3];       // width, height, depth
+    uint32_t out_shape[3];
+    uint64_t weight_offset;     // offset from beginning of file
+    uint64_t weight_count;
+    uint64_t bias_offset;
+    uint64_t bias_count;
+};
+
+static_assert(sizeof(file_header) == 32, "unexpected padding in file_header");
+static_assert(sizeof(layer_record) == 88, "unexpected padding in layer_record");
+
+inline const char* magic() { return "tinycnn"; }
+inline uint32_t byte_order_mark() { return 0x01020304; }
+inline uint32_t native_dtype() { return sizeof(float_t) == 4 ? float32 : float64; }
+
+inline uint64_t align(uint64_t offset) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+inline void set_shape(uint32_t* dst, const index3d<layer_size_t>& shape) {
+    dst[0] = static_cast<uint32_t>(shape.width_);
+    dst[1] = static_cast<uint32_t>(shape.height_);
+    dst[2] = static_cast<uint32_t>(shape.depth_);
+}
+
+inline std::vector<layer_record> make_records(const layers& l, uint64_t* file_size) {
+    std::vector<layer_record> records(l.depth());
+    uint64_t offset = align(sizeof(file_header) + sizeof(layer_record) * records.size());
+
+    for (size_t i = 0; i < records.size(); i++) {
+        const layer_base* layer = l[i];
+        layer_record& r = records[i];
+        const std::string type = layer->layer_type();
+
+        std::memset(&r, 0, sizeof(r));
+        std::strncpy(r.type, type.c_str(), type_length - 1);
+        set_shape(r.in_shape, layer->in_shape());
+        set_shape(r.out_shape, layer->out_shape());
+
+        r.weight_count = layer->weight().size();
+        r.weight_offset = offset;
+        offset = align(offset + r.weight_count * sizeof(float_t));
+
+        r.bias_count = layer->bias().size();
+        r.bias_offset = offset;
+        offset = align(offset + r.bias_count * sizeof(float_t));
+    }
+    *file_size = offset;
+    return records;
+}
+
+inline void write_padding(std::ostream& os, uint64_t from, uint64_t to) {
+    static const char zeros[alignment] = {};
+    os.write(zeros, static_cast<std::streamsize>(to - from));
+}
+
+inline void write(std::ostream& os, const layers& l) {
+    file_header header;
+    std::vector<layer_record> records = make_records(l, &header.file_size);
+
+    std::memcpy(header.magic, magic(), sizeof(header.magic));
+    header.version = current_version;
+    header.byte_order = byte_order_mark();
+    header.dtype = native_dtype();
+    header.num_layers = static_cast<uint32_t>(records.size());
+
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!records.empty())
+        os.write(reinterpret_cast<const char*>(&records[0]), sizeof(layer_record) * records.size());
+
+    uint64_t pos = sizeof(header) + sizeof(layer_record) * records.size();
+
+    for (size_t i = 0; i < records.size(); i++) {
+        const vec_t* blobs[] = { &l[i]->weight(), &l[i]->bias() };
+        const uint64_t offsets[] = { records[i].weight_offset, records[i].bias_offset };
+
+        for (int j = 0; j < 2; j++) {
+            write_padding(os, pos, offsets[j]);
+            pos = offsets[j];
+            if (blobs[j]->empty()) continue;
+            os.write(reinterpret_cast<const char*>(&(*blobs[j])[0]), static_cast<std::streamsize>(blobs[j]->size() * sizeof(float_t)));
+            pos += blobs[j]->size() * sizeof(float_t);
+        }
+    }
+    write_padding(os, pos, header.file_size);
+
+    if (!os) throw nn_error("failed to write binary model");
+}
+
+inline std::string shape_str(const uint32_t* shape) {
+    return format_str("%ux%ux%u", shape[0], shape[1], shape[2]);
+}
+
+// true if count values of float_t starting at offset are within size bytes (without overflow)
+inline bool in_bounds(uint64_t offset, uint64_t count, uint64_t size) {
+    return offset <= size && count <= (size - offset) / sizeof(float_t);
+}
+
+// check that file is compatible with l, and return its layer records
+inline const layer_record* validate(const char* data, size_t size, const layers& l) {
+    if (size < sizeof(file_header))
+        throw nn_error("binary model is too small");
+
+    const file_header* header = reinterpret_cast<const file_header*>(data);
+
+    if (std::memcmp(header->magic, magic(), sizeof(header->magic)) != 0)
+        throw nn_error("not a binary model of tiny-cnn");
+    if (header->byte_order != byte_order_mark())
+        throw nn_error("binary model was saved on the machine with different byte order");
+    if (header->version > current_version)
+        throw nn_error(format_str("unsupported binary model version: %u", header->version));
+    if (header->dtype != native_dtype())
+        throw nn_error(format_str("binary model is saved with %d-byte float, but float_t is %d-byte",
+                                  header->dtype == float32 ? 4 : 8, (int)sizeof(float_t)));
+    if (header->file_size > size)
+        throw nn_error("binary model is truncated");
+    if (header->num_layers != l.depth())
+        throw nn_error(format_str("number of layers mismatch: file:%u network:%u", header->num_layers, (unsigned)l.depth()));
+    if (sizeof(file_header) + sizeof(layer_record) * uint64_t(header->num_layers) > header->file_size)
+        throw nn_error("binary model is broken (file_size is smaller than header)");
+
+    const layer_record* records = reinterpret_cast<const layer_record*>(data + sizeof(file_header));
+
+    for (size_t i = 0; i < l.depth(); i++) {
+        const layer_base* layer = l[i];
+        const layer_record& r = records[i];
+        uint32_t in_shape[3], out_shape[3];
+
+        set_shape(in_shape, layer->in_shape());
+        set_shape(out_shape, layer->out_shape());
+
+        const std::string type(r.type, std::find(r.type, r.type + type_length, '\0'));
+
+        if (type != layer->layer_type() ||
+            std::memcmp(in_shape, r.in_shape, sizeof(in_shape)) != 0 ||
+            std::memcmp(out_shape, r.out_shape, sizeof(out_shape)) != 0 ||
+            r.weight_count != layer->weight().size() || r.bias_count != layer->bias().size()) {
+            throw nn_error(format_str("layer mismatch at layer %u\nfile:    %s in:%s out:%s\nnetwork: %s in:%s out:%s",
+                (unsigned)i, type.c_str(), shape_str(r.in_shape).c_str(), shape_str(r.out_shape).c_str(),
+                layer->layer_type().c_str(), shape_str(in_shape).c_str(), shape_str(out_shape).c_str()));
+        }
+
+        if (r.weight_offset % alignment || r.bias_offset % alignment ||
+            !in_bounds(r.weight_offset, r.weight_count, header->file_size) ||
+            !in_bounds(r.bias_offset, r.bias_count, header->file_size))
+            throw nn_error(format_str("broken weight offset at layer %u", (unsigned)i));
+    }
+    return records;
+}
+
+// copy weights in binary model into layers
+inline void read(const char* data, size_t size, layers& l) {
+    const layer_record* records = validate(data, size, l);
+
+    for (size_t i = 0; i < l.depth(); i++) {
+        const float_t* w = reinterpret_cast<const float_t*>(data + records[i].weight_offset);
+        const float_t* b = reinterpret_cast<const float_t*>(data + records[i].bias_offset);
+
+        std::copy(w, w + records[i].weight_count, l[i]->weight().begin());
+        std::copy(b, b + records[i].bias_count, l[i]->bias().begin());
+    }
+}
+
+// let layers use weights in memory-mapped file directly
+inline void map(std::shared_ptr<mapped_file> file, layers& l) {
+    const layer_record* records = validate(file->data(), file->size(), l);
+
+    for (size_t i = 0; i < l.depth(); i++) {
+        float_t* w = reinterpret_cast<float_t*>(file->data() + records[i].weight_offset);
+        float_t* b = reinterpret_cast<float_t*>(file->data() + records[i].bias_offset);
+
+        l[i]->attach_weights(w, b, file);
+    }
+}
+
+} // namespace binary_format
+} // namespace tiny_cnn
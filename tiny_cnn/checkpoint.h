@@ -0,0 +1,289 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifndef CNN_SINGLE_THREAD
+#include <future>
+#endif
+#include "util.h"
+#include "binary_format.h"
+#include "sampler.h"
+
+namespace tiny_cnn {
+
+/**
+ * position of training in progress, saved to checkpoint
+ **/
+struct training_position {
+    training_position() : epoch(0), next_sample(0) {}
+
+    size_t epoch;              // index of epoch in progress
+    size_t next_sample;        // offset of next mini-batch in order
+    std::vector<size_t> order; // samples of epoch in progress (see sampling::function)
+};
+
+namespace binary_format {
+
+/**
+ * checkpoint = binary model + state of training
+ *
+ * [binary model][checkpoint_header][optimizer scalars]
+ * [for each layer: weight-hessian, optimizer slots of weight, bias-hessian, optimizer slots of bias]
+ * [order of epoch in progress][random engines]
+ *
+ * - binary model part is same as write(), so checkpoint can also be loaded by read()/map()
+ * - hessians and optimizer slots (see stateful_optimizer) are raw arrays of float_t with the same size
+ *   as weight/bias. slots which haven't been allocated yet are stored as zeros (their initial values)
+ * - order is an array of uint64_t, and random engines are text of std::mt19937 states
+ **/
+enum {
+    checkpoint_version = 1
+};
+
+struct checkpoint_header {
+    char     magic[8];     // "tcnnckp\0"
+    uint32_t version;
+    uint32_t num_layers;
+    uint64_t epoch;
+    uint64_t next_sample;
+    uint64_t order_size;
+    uint32_t num_slots;    // values per weight held by optimizer
+    uint32_t num_scalars;
+    uint64_t random_size;  // bytes of random engines
+};
+
+static_assert(sizeof(checkpoint_header) == 56, "unexpected padding in checkpoint_header");
+
+inline const char* checkpoint_magic() { return "tcnnckp"; }
+
+// states of engines used by uniform_rand (weight-init, dropout, ...) and sampler
+inline std::string save_random(const sampling::function* sampler) {
+    std::ostringstream os;
+    os << detail::random_engine<int>() << ' ' << detail::random_engine<float>() << ' ' << detail::random_engine<double>();
+    if (sampler) {
+        os << ' ';
+        sampler->save(os);
+    }
+    return os.str();
+}
+
+inline void load_random(const std::string& str, sampling::function* sampler) {
+    std::istringstream is(str);
+    is >> detail::random_engine<int>() >> detail::random_engine<float>() >> detail::random_engine<double>();
+    if (sampler) sampler->load(is);
+    if (!is) throw nn_error("broken random state in checkpoint");
+}
+
+inline void write_values(std::ostream& os, const float_t* p, size_t n) {
+    if (n > 0) os.write(reinterpret_cast<const char*>(p), static_cast<std::streamsize>(n * sizeof(float_t)));
+}
+
+// v, or zeros if v is null or released
+inline void write_values_or_zero(std::ostream& os, const vec_t* v, size_t n) {
+    if (v && v->size() == n) {
+        write_values(os, &(*v)[0], n);
+        return;
+    }
+    const vec_t zeros(n, float_t(0));
+    write_values(os, zeros.empty() ? nullptr : &zeros[0], n);
+}
+
+/**
+ * snapshot of weights and training state as a checkpoint image
+ **/
+template <typename Optimizer>
+std::string write_checkpoint(const layers& l, const Optimizer& o, const sampling::function* sampler, const training_position& pos) {
+    std::ostringstream os(std::ios::binary);
+    write(os, l);
+
+    const std::vector<float_t> scalars = o.scalars();
+    const std::string random = save_random(sampler);
+    const std::vector<uint64_t> order(pos.order.begin(), pos.order.end());
+    checkpoint_header header;
+
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, checkpoint_magic(), sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.num_layers = static_cast<uint32_t>(l.depth());
+    header.epoch = pos.epoch;
+    header.next_sample = pos.next_sample;
+    header.order_size = order.size();
+    header.num_slots = static_cast<uint32_t>(o.num_slots());
+    header.num_scalars = static_cast<uint32_t>(scalars.size());
+    header.random_size = random.size();
+
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_values(os, scalars.empty() ? nullptr : &scalars[0], scalars.size());
+
+    for (size_t i = 0; i < l.depth(); i++) {
+        const vec_t* blobs[] = { &l[i]->weight(), &l[i]->bias() };
+        const vec_t* hessians[] = { &l[i]->weight_hessian(), &l[i]->bias_hessian() };
+        const std::vector<vec_t>* slots[] = { &l[i]->weight_slots(), &l[i]->bias_slots() };
+
+        for (int j = 0; j < 2; j++) {
+            write_values_or_zero(os, hessians[j], blobs[j]->size());
+            for (size_t k = 0; k < header.num_slots; k++)
+                write_values_or_zero(os, k < slots[j]->size() ? &(*slots[j])[k] : nullptr, blobs[j]->size());
+        }
+    }
+
+    if (!order.empty())
+        os.write(reinterpret_cast<const char*>(&order[0]), static_cast<std::streamsize>(order.size() * sizeof(uint64_t)));
+    os.write(random.data(), static_cast<std::streamsize>(random.size()));
+
+    if (!os) throw nn_error("failed to write checkpoint");
+    return os.str();
+}
+
+/**
+ * restore weights and training state from checkpoint image.
+ * network must have the same architecture and the same type of optimizer as saved one
+ **/
+template <typename Optimizer>
+void read_checkpoint(const char* data, size_t size, layers& l, Optimizer& o, sampling::function* sampler, training_position* pos) {
+    read(data, size, l);
+
+    size_t offset = reinterpret_cast<const file_header*>(data)->file_size;
+
+    // pointer to next n bytes
+    auto take = [&](size_t n) -> const char* {
+        if (offset + n > size) throw nn_error("checkpoint is truncated");
+        const char* p = data + offset;
+        offset += n;
+        return p;
+    };
+
+    checkpoint_header header;
+    std::memcpy(&header, take(sizeof(header)), sizeof(header));
+
+    if (std::memcmp(header.magic, checkpoint_magic(), sizeof(header.magic)) != 0)
+        throw nn_error("binary model doesn't contain checkpoint");
+    if (header.version > checkpoint_version)
+        throw nn_error(format_str("unsupported checkpoint version: %u", header.version));
+    if (header.num_slots != static_cast<uint32_t>(o.num_slots()) || header.num_scalars != o.scalars().size())
+        throw nn_error("checkpoint is saved with different optimizer");
+
+    std::vector<float_t> scalars(header.num_scalars);
+    if (!scalars.empty()) std::memcpy(&scalars[0], take(scalars.size() * sizeof(float_t)), scalars.size() * sizeof(float_t));
+    o.set_scalars(scalars);
+
+    for (size_t i = 0; i < l.depth(); i++) {
+        const vec_t* blobs[] = { &l[i]->weight(), &l[i]->bias() };
+        vec_t* hessians[] = { &l[i]->weight_hessian(), &l[i]->bias_hessian() };
+        std::vector<vec_t>* slots[] = { &l[i]->weight_slots(), &l[i]->bias_slots() };
+
+        for (int j = 0; j < 2; j++) {
+            const size_t n = blobs[j]->size();
+            const char* h = take(n * sizeof(float_t));
+
+            hessians[j]->resize(n);
+            if (n > 0) std::memcpy(&(*hessians[j])[0], h, n * sizeof(float_t));
+
+            slots[j]->assign(header.num_slots, vec_t(n));
+            for (uint32_t k = 0; k < header.num_slots; k++) {
+                const char* v = take(n * sizeof(float_t)); // may be unaligned, so copied by memcpy
+                if (n > 0) std::memcpy(&(*slots[j])[k][0], v, n * sizeof(float_t));
+            }
+        }
+    }
+
+    std::vector<uint64_t> order(static_cast<size_t>(header.order_size));
+    if (!order.empty()) std::memcpy(&order[0], take(order.size() * sizeof(uint64_t)), order.size() * sizeof(uint64_t));
+
+    const size_t random_size = static_cast<size_t>(header.random_size);
+    load_random(std::string(take(random_size), random_size), sampler);
+
+    pos->epoch = static_cast<size_t>(header.epoch);
+    pos->next_sample = static_cast<size_t>(header.next_sample);
+    pos->order.assign(order.begin(), order.end());
+}
+
+} // namespace binary_format
+
+namespace detail {
+
+/**
+ * writes files in background, one at a time.
+ * the file is written to path + ".tmp" and renamed, so path always holds a complete file.
+ * pending write is not copied with the owner
+ **/
+class async_file_writer {
+public:
+    async_file_writer() {}
+    async_file_writer(const async_file_writer&) {}
+    async_file_writer& operator = (const async_file_writer&) { return *this; }
+
+    ~async_file_writer() {
+        try { wait(); } catch (...) {}
+    }
+
+    void write(const std::string& path, std::string&& data) {
+        wait();
+#ifdef CNN_SINGLE_THREAD
+        write_file(path, data);
+#else
+        auto buf = std::make_shared<std::string>(std::move(data));
+        pending_ = std::async(std::launch::async, [path, buf] { write_file(path, *buf); });
+#endif
+    }
+
+    // wait for the pending write, and rethrow its error
+    void wait() {
+#ifndef CNN_SINGLE_THREAD
+        if (pending_.valid()) pending_.get();
+#endif
+    }
+
+private:
+    static void write_file(const std::string& path, const std::string& data) {
+        const std::string tmp = path + ".tmp";
+        std::FILE* fp = std::fopen(tmp.c_str(), "wb");
+        if (!fp) throw nn_error("failed to open " + tmp);
+
+        const bool ok = std::fwrite(data.data(), 1, data.size(), fp) == data.size();
+        if (std::fclose(fp) != 0 || !ok) {
+            std::remove(tmp.c_str());
+            throw nn_error("failed to write " + tmp);
+        }
+
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(path.c_str()); // rename doesn't overwrite existing file on some platforms
+            if (std::rename(tmp.c_str(), path.c_str()) != 0)
+                throw nn_error("failed to rename " + tmp + " to " + path);
+        }
+    }
+
+#ifndef CNN_SINGLE_THREAD
+    std::future<void> pending_;
+#endif
+};
+
+} // namespace detail
+} // namespace tiny_cnn
@@ -46,6 +46,24 @@
  */
 //#define CNN_USE_OMP
 
+/**
+ * define to disable parallelization.
+ * if neither CNN_USE_TBB nor CNN_USE_OMP is defined, builtin thread pool is used by default
+ */
+//#define CNN_SINGLE_THREAD
+
+/**
+ * define to record per-layer timings while training (see network::print_profile).
+ * hooks are compiled out if not defined
+ */
+//#define CNN_USE_PROFILER
+
+/**
+ * define to count heap allocations of vec_t (see aligned_allocation_count).
+ * the benchmark suite defines this to check that training and inference allocate nothing in steady state
+ */
+//#define CNN_COUNT_ALLOCATIONS
+
 /**
  * number of task in batch-gradient-descent.
  * @todo automatic optimization
@@ -54,4 +72,12 @@
 #define CNN_TASK_SIZE 100
 #else
 #define CNN_TASK_SIZE 8
+#endif
+
+/**
+ * max bytes of gradient replicas for each layer.
+ * layers larger than CNN_GRADIENT_MEMORY / CNN_TASK_SIZE are trained by fewer workers.
+ */
+#ifndef CNN_GRADIENT_MEMORY
+#define CNN_GRADIENT_MEMORY (256 * 1024 * 1024)
 #endif
\ No newline at end of file
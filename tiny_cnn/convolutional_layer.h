@@ -26,9 +26,11 @@
 */
 #pragma once
 #include "util.h"
-#include "partial_connected_layer.h"
+#include "layer.h"
 #include "image.h"
 #include "activation_function.h"
+#include "product.h"
+#include <numeric>
 
 
 namespace tiny_cnn {
@@ -58,9 +60,9 @@ enum class padding {
 };
 
 template<typename Activation = activation::identity, typename Filter = filter_none>
-class convolutional_layer : public partial_connected_layer<Activation> {
+class convolutional_layer : public layer<Activation> {
 public:
-    typedef partial_connected_layer<Activation> Base;
+    typedef layer<Activation> Base;
     CNN_USE_LAYER_MEMBERS;
 
     /**
@@ -86,9 +88,11 @@ public:
       in_(in_width, in_height, in_channels), 
       out_(out_length(in_width, window_size, pad_type), out_length(in_height, window_size, pad_type), out_channels),
       weight_(window_size, window_size, in_channels*out_channels),
-      window_size_(window_size)
+      window_size_(window_size),
+      pad_(pad_type == padding::valid ? 0 : window_size / 2),
+      dense_(true)
     {
-        init_connection(connection_table(), pad_type);
+        init_connection(connection_table());
     }
 
     /**
@@ -116,11 +120,240 @@ public:
           in_(in_width, in_height, in_channels), 
           out_(out_length(in_width, window_size, pad_type), out_length(in_height, window_size, pad_type), out_channels),
           weight_(window_size, window_size, in_channels*out_channels),
-          connection_(connection_table),
-          window_size_(window_size)
+          window_size_(window_size),
+          pad_(pad_type == padding::valid ? 0 : window_size / 2),
+          dense_(is_fully_connected(connection_table))
     {
-        init_connection(connection_table, pad_type);
-        this->remap();
+        init_connection(connection_table);
+    }
+
+    size_t param_size() const override {
+        const axis_taps x = taps(in_.width_, out_.width_), y = taps(in_.height_, out_.height_);
+        return num_kernels() * x.used * y.used + out_.depth_;
+    }
+
+    size_t connection_size() const override {
+        const axis_taps x = taps(in_.width_, out_.width_), y = taps(in_.height_, out_.height_);
+        return num_kernels() * x.total * y.total + out_size_;
+    }
+
+    size_t fan_in_size() const override {
+        size_t channels = 0;
+        for (auto& runs : out_runs_) {
+            size_t n = 0;
+            for (auto& run : runs) n += run.count;
+            channels = std::max(channels, n);
+        }
+        return channels * taps(in_.width_, out_.width_).max_per_out * taps(in_.height_, out_.height_).max_per_out;
+    }
+
+    size_t fan_out_size() const override {
+        size_t channels = 0;
+        for (auto& kernels : in_kernels_)
+            channels = std::max(channels, kernels.size());
+        return channels * taps(in_.width_, out_.width_).max_per_in * taps(in_.height_, out_.height_).max_per_in;
+    }
+
+    /**
+     * convolution is lowered to gemm via im2col:
+     * a[out_channels x out_area] = W[out_channels x (in_channels*window^2)] * col[(in_channels*window^2) x out_area]
+     * with connection-table, each output channel multiplies only the rows of col of its connected input channels
+     **/
+    const vec_t& forward_propagation(const vec_t& in, size_t index) override {
+        fprop(in, a_[index], output_[index], col_[index]);
+
+        return forward_next(output_[index], index);
+    }
+
+    bool supports_forward() const override { return true; }
+
+    const vec_t& forward(const vec_t& in, layer_workspace& ws) const override {
+        ws.a.resize(out_size_);
+        ws.output.resize(out_size_);
+
+        fprop(in, ws.a, ws.output, ws.scratch);
+        return ws.output;
+    }
+
+    /**
+     * the kernel is slid over the whole input map by the same im2col/gemm as fprop.
+     * padding::same is rejected, since zero-padding at the border of each patch can't be reproduced
+     **/
+    const vec_t& forward_dense(const vec_t& in, index3d<layer_size_t>& shape, layer_workspace& ws) const override {
+        if (pad_ != 0)
+            throw nn_error("dense inference requires padding::valid");
+        if (shape.depth_ != in_.depth_ || shape.width_ < window_size_ || shape.height_ < window_size_)
+            dense_shape_mismatch(*this, shape);
+
+        const index3d<layer_size_t> out(shape.width_ - window_size_ + 1, shape.height_ - window_size_ + 1, out_.depth_);
+        const layer_size_t N = out.width_ * out.height_;
+
+        ws.scratch.resize(size_t(col_rows()) * N);
+        ws.a.resize(out.size());
+        ws.output.resize(out.size());
+
+        tiny_cnn::im2col(&in[0], shape, window_size_, window_size_, 0, out, &ws.scratch[0], N);
+
+        for_(parallelize_, 0, out_.depth_, [&](const blocked_range& r) {
+            for (int o = r.begin(); o < r.end(); o++)
+                std::fill(&ws.a[o * N], &ws.a[0] + (o + 1) * N, b_[o]);
+
+            gemm_forward(r, &W_[0], &ws.scratch[0], N, &ws.a[0]);
+        }, 1);
+
+        this->activate_map(ws.a, ws.output, out, ws);
+        shape = out;
+        return ws.output;
+    }
+
+    void freeze() override {
+        Base::freeze();
+        for (auto& c : col_) release(c);
+        release(batch_col_);
+        release(batch_a_);
+        release(W2_);
+    }
+
+    size_t memory_usage() const override {
+        size_t size = Base::memory_usage() + memory_size(batch_col_) + memory_size(batch_a_) + memory_size(W2_) +
+                      memory_size(out_runs_) + memory_size(in_kernels_);
+        for (auto& c : col_) size += memory_size(c);
+        return size;
+    }
+
+    const vec_t& back_propagation(const vec_t& current_delta, size_t index) override {
+        const vec_t& prev_out = prev_->output(index);
+        const activation::function& prev_h = prev_->activation_function();
+        vec_t& prev_delta = prev_delta_[index];
+        vec_t& col = col_[index]; // im2col(prev_out), filled in forward_propagation
+        vec_t& dW = dW_[index];
+        vec_t& db = db_[index];
+        const layer_size_t N = out_.width_ * out_.height_;
+
+        // dW += delta * col^T, db += sum(delta)
+        for_(parallelize_, 0, out_.depth_, [&](const blocked_range& r) {
+            gemm_weight(r, &current_delta[0], &col[0], N, &dW[0]);
+
+            for (int o = r.begin(); o < r.end(); o++)
+                db[o] += std::accumulate(&current_delta[o * N], &current_delta[0] + (o + 1) * N, float_t(0));
+        }, 1);
+
+        // col = W^T * delta (col is no longer needed, so reuse it as a buffer)
+        gemm_backward(&W_[0], &current_delta[0], N, &col[0]);
+
+        col2im(&col[0], N, &prev_delta[0]);
+
+        prev_h.df_vec(&prev_out[0], &prev_delta[0], in_size_);
+
+        return backward_prev(prev_delta_[index], index);
+    }
+
+    /**
+     * same products as back_propagation, on squares of inputs and weights:
+     * Whessian += delta2 * (col^2)^T, prev_delta2 = col2im((W^2)^T * delta2) * f'(prev_out)^2
+     **/
+    const vec_t& back_propagation_2nd(const vec_t& current_delta2) override {
+        const vec_t& prev_out = prev_->output(0);
+        const activation::function& prev_h = prev_->activation_function();
+        vec_t& col = col_[0];
+        const layer_size_t N = out_.width_ * out_.height_;
+
+        col.resize(size_t(col_rows()) * N);
+        im2col(&prev_out[0], &col[0], N);
+        for (auto& c : col) c *= c;
+
+        for_(parallelize_, 0, out_.depth_, [&](const blocked_range& r) {
+            gemm_weight(r, &current_delta2[0], &col[0], N, &Whessian_[0]);
+
+            for (int o = r.begin(); o < r.end(); o++)
+                bhessian_[o] += std::accumulate(&current_delta2[o * N], &current_delta2[0] + (o + 1) * N, float_t(0));
+        }, 1);
+
+        W2_.resize(W_.size());
+        for (size_t i = 0; i < W_.size(); i++) W2_[i] = sqr(W_[i]);
+
+        gemm_backward(&W2_[0], &current_delta2[0], N, &col[0]);
+        col2im(&col[0], N, &prev_delta2_[0]);
+
+        for (layer_size_t i = 0; i < in_size_; i++)
+            prev_delta2_[i] *= sqr(prev_h.df(prev_out[i]));
+
+        return backward_prev_2nd(prev_delta2_);
+    }
+
+    /**
+     * columns of all samples are concatenated, so that whole batch is computed by single gemm:
+     * a[out_channels x (batch*out_area)] = W * col[(in_channels*window^2) x (batch*out_area)]
+     **/
+    const vec_t& forward_batch(const vec_t& in, size_t batch_size) override {
+        const layer_size_t M = out_.depth_;
+        const layer_size_t A = out_.width_ * out_.height_;
+        const layer_size_t K = col_rows();
+        const size_t N = batch_size * A;
+
+        batch_col_.resize(K * N);
+        batch_a_.resize(M * N);
+        batch_output_.resize(batch_size * out_size_);
+
+        for_i(parallelize_, batch_size, [&](int n) {
+            im2col(&in[n * in_size_], &batch_col_[n * A], N);
+        });
+
+        for_(parallelize_, 0, M, [&](const blocked_range& r) {
+            for (int o = r.begin(); o < r.end(); o++)
+                std::fill(&batch_a_[o * N], &batch_a_[0] + (o + 1) * N, b_[o]);
+
+            gemm_forward(r, &W_[0], &batch_col_[0], N, &batch_a_[0]);
+        }, 1);
+
+        // [channel][sample][area] -> [sample][channel][area]
+        for_i(parallelize_, batch_size, [&](int n) {
+            for (layer_size_t o = 0; o < M; o++) {
+                const float_t *src = &batch_a_[o * N + n * A];
+                std::copy(src, src + A, &batch_output_[n * out_size_ + o * A]);
+            }
+        });
+
+        this->activate_batch(&batch_output_[0], &batch_output_[0], batch_size, out_size_);
+        return batch_output_;
+    }
+
+    const vec_t& backward_batch(const vec_t& current_delta, size_t batch_size) override {
+        const vec_t& prev_out = prev_->batch_output();
+        const activation::function& prev_h = prev_->activation_function();
+        vec_t& prev_delta = batch_prev_delta_;
+        vec_t& delta = batch_a_; // pre-activation values are no longer needed
+        vec_t& dW = dW_[0];
+        vec_t& db = db_[0];
+        const layer_size_t M = out_.depth_;
+        const layer_size_t A = out_.width_ * out_.height_;
+        const size_t N = batch_size * A;
+
+        prev_delta.resize(batch_size * in_size_);
+
+        // [sample][channel][area] -> [channel][sample][area]
+        for_i(parallelize_, batch_size, [&](int n) {
+            for (layer_size_t o = 0; o < M; o++)
+                std::copy(&current_delta[n * out_size_ + o * A], &current_delta[0] + n * out_size_ + (o + 1) * A, &delta[o * N + n * A]);
+        });
+
+        // dW += delta * col^T, db += sum(delta)
+        for_(parallelize_, 0, M, [&](const blocked_range& r) {
+            gemm_weight(r, &delta[0], &batch_col_[0], N, &dW[0]);
+
+            for (int o = r.begin(); o < r.end(); o++)
+                db[o] += std::accumulate(&delta[o * N], &delta[0] + (o + 1) * N, float_t(0));
+        }, 1);
+
+        // col = W^T * delta
+        gemm_backward(&W_[0], &delta[0], N, &batch_col_[0]);
+
+        for (size_t n = 0; n < batch_size; n++)
+            col2im(&batch_col_[n * A], N, &prev_delta[n * in_size_]);
+
+        this->apply_df(prev_h, &prev_out[0], &prev_delta[0], batch_size * in_size_);
+
+        return prev_delta;
     }
 
     image<> output_to_image(size_t worker_index = 0) const override {
@@ -142,14 +375,15 @@ public:
 
         for (layer_size_t r = 0; r < in_.depth_; ++r) {
             for (layer_size_t c = 0; c < out_.depth_; ++c) {
-                if (!connection_.is_connected(c, r)) continue;
+                const size_t kernel = kernel_offset(c, r);
+                if (kernel == npos) continue;
 
                 const auto top = r * pitch + border_width;
                 const auto left = c * pitch + border_width;
 
                 for (layer_size_t y = 0; y < window_size_; ++y) {
                     for (layer_size_t x = 0; x < window_size_; ++x) {
-                        const float_t w = W_[weight_.get_index(x, y, c * in_.depth_ + r)];
+                        const float_t w = W_[kernel + y * window_size_ + x];
 
                         img.at(left + x, top + y)
                             = static_cast<image<>::intensity_t>(rescale(w, *minmax.first, *minmax.second, 0, 255));
@@ -160,54 +394,213 @@ public:
         return img;
     }
 
+    static const size_t npos = static_cast<size_t>(-1);
+
+    /**
+     * offset in W_ of the window x window kernel between output channel outc and input channel inc,
+     * or npos if they are not connected. kernels of connected pairs are packed in (outc, inc) order
+     **/
+    size_t kernel_offset(layer_size_t outc, layer_size_t inc) const {
+        for (auto& run : out_runs_[outc])
+            if (run.first <= inc && inc < run.first + run.count)
+                return run.weight + (inc - run.first) * sqr(window_size_);
+        return npos;
+    }
+
     index3d<layer_size_t> in_shape() const override { return in_; }
     index3d<layer_size_t> out_shape() const override { return out_; }
     std::string layer_type() const override { return "conv"; }
 
 private:
-    layer_size_t out_length(layer_size_t in_length, layer_size_t window_size, padding pad_type) const {
-        return pad_type == padding::same ? in_length : (in_length - window_size + 1);
+    static bool is_fully_connected(const connection_table& table) {
+        return std::find(table.connected_.begin(), table.connected_.end(), false) == table.connected_.end();
     }
 
-    layer_size_t out_size(layer_size_t in_width, layer_size_t in_height, layer_size_t window_size, padding pad_type) const {
-        return out_length(in_width, window_size, pad_type) * out_length(in_height, window_size, pad_type);
+    void fprop(const vec_t& in, vec_t& a, vec_t& out, vec_t& col) const {
+        const layer_size_t M = out_.depth_;
+        const layer_size_t N = out_.width_ * out_.height_;
+        const layer_size_t K = col_rows();
+
+        col.resize(K * N);
+        im2col(&in[0], &col[0], N);
+
+        const bool elementwise = h_.elementwise();
+
+        // a = b + W * col, out = h(a), channel by channel
+        for_(parallelize_, 0, M, [&](const blocked_range& r) {
+            for (int o = r.begin(); o < r.end(); o++)
+                std::fill(&a[o * N], &a[0] + (o + 1) * N, b_[o]);
+
+            gemm_forward(r, &W_[0], &col[0], N, &a[0]);
+
+            if (elementwise) h_.f_vec(&a[r.begin() * N], &out[r.begin() * N], (r.end() - r.begin()) * N);
+        }, 1);
+
+        if (!elementwise) h_.f_vec(&a[0], &out[0], out_size_);
     }
 
-    void init_connection(const connection_table& table, padding pad_type) {
-        layer_size_t pad = (pad_type == padding::valid) ? 0 : window_size_ / 2;
+    layer_size_t col_rows() const {
+        return in_.depth_ * window_size_ * window_size_;
+    }
 
-        for (layer_size_t inc = 0; inc < in_.depth_; ++inc) {
-            for (layer_size_t outc = 0; outc < out_.depth_; ++outc) {
-                if (!table.is_connected(outc, inc)) {
-                    continue;
-                }
+    // a[o] += W[o] * col for output channels o in r. col has N columns
+    void gemm_forward(const blocked_range& r, const float_t* W, const float_t* col, size_t N, float_t* a) const {
+        const layer_size_t K = col_rows();
+        const layer_size_t ww = sqr(window_size_);
 
-                for (layer_size_t y = 0; y < out_.height_; ++y)
-                    for (layer_size_t x = 0; x < out_.width_; ++x)
-                        connect_kernel(inc, outc, x, y, pad);
+        if (dense_) {
+            vectorize::gemm_nn<float_t>(r.end() - r.begin(), N, K, &W[r.begin() * K], K, col, N, &a[r.begin() * N], N);
+            return;
+        }
+        for (int o = r.begin(); o < r.end(); o++)
+            for (auto& run : out_runs_[o])
+                vectorize::gemm_nn<float_t>(1, N, run.count * ww, &W[run.weight], run.count * ww,
+                                            &col[run.first * ww * N], N, &a[o * N], N);
+    }
+
+    // dW[o] += delta[o] * col^T for output channels o in r
+    void gemm_weight(const blocked_range& r, const float_t* delta, const float_t* col, size_t N, float_t* dW) const {
+        const layer_size_t K = col_rows();
+        const layer_size_t ww = sqr(window_size_);
+
+        if (dense_) {
+            vectorize::gemm_nt<float_t>(r.end() - r.begin(), K, N, &delta[r.begin() * N], N, col, N, &dW[r.begin() * K], K);
+            return;
+        }
+        for (int o = r.begin(); o < r.end(); o++)
+            for (auto& run : out_runs_[o])
+                vectorize::gemm_nt<float_t>(1, run.count * ww, N, &delta[o * N], N,
+                                            &col[run.first * ww * N], N, &dW[run.weight], run.count * ww);
+    }
+
+    // col = W^T * delta, in parallel over rows of col
+    void gemm_backward(const float_t* W, const float_t* delta, size_t N, float_t* col) const {
+        const layer_size_t M = out_.depth_;
+        const layer_size_t K = col_rows();
+        const layer_size_t ww = sqr(window_size_);
+
+        if (dense_) {
+            for_(parallelize_, 0, K, [&](const blocked_range& r) {
+                std::fill(&col[r.begin() * N], col + r.end() * N, float_t(0));
+                vectorize::gemm_tn<float_t>(r.end() - r.begin(), N, M, &W[r.begin()], K, delta, N, &col[r.begin() * N], N);
+            }, 1);
+            return;
+        }
+        for_(parallelize_, 0, in_.depth_, [&](const blocked_range& r) {
+            std::fill(&col[r.begin() * ww * N], col + r.end() * ww * N, float_t(0));
+
+            for (int c = r.begin(); c < r.end(); c++)
+                for (auto& k : in_kernels_[c])
+                    vectorize::gemm_tn<float_t>(ww, N, 1, &W[k.second], ww, &delta[k.first * N], N, &col[c * ww * N], N);
+        }, 1);
+    }
+
+    // number of kernel taps along one axis which hit the input (the others hit zero-padding)
+    struct axis_taps {
+        size_t max_per_out; // max taps of an output position
+        size_t max_per_in;  // max taps on an input position
+        size_t used;        // kernel offsets which hit the input at some output position
+        size_t total;       // sum of taps over output positions
+    };
+
+    axis_taps taps(layer_size_t in_length, layer_size_t out_length) const {
+        std::vector<size_t> per_in(in_length), per_offset(window_size_);
+        axis_taps t = { 0, 0, 0, 0 };
+
+        for (layer_size_t x = 0; x < out_length; x++) {
+            size_t n = 0;
+            for (layer_size_t dx = 0; dx < window_size_; dx++) {
+                if (x + dx < pad_ || x + dx - pad_ >= in_length) continue;
+                per_in[x + dx - pad_]++;
+                per_offset[dx]++;
+                n++;
             }
+            t.max_per_out = std::max(t.max_per_out, n);
+            t.total += n;
         }
+        t.max_per_in = *std::max_element(per_in.begin(), per_in.end());
+        t.used = window_size_ - std::count(per_offset.begin(), per_offset.end(), size_t(0));
+        return t;
+    }
 
-        for (layer_size_t outc = 0; outc < out_.depth_; ++outc)
-            for (layer_size_t y = 0; y < out_.height_; ++y)
-                for (layer_size_t x = 0; x < out_.width_; ++x)
-                    this->connect_bias(outc, out_.get_index(x, y, outc));
+    size_t num_kernels() const {
+        size_t n = 0;
+        for (auto& kernels : in_kernels_) n += kernels.size();
+        return n;
     }
 
-    void connect_kernel(layer_size_t inc, layer_size_t outc, layer_size_t x, layer_size_t y, layer_size_t pad) {
+    // col[(c*window + dy)*window + dx][y*out_width + x] = in(x + dx - pad, y + dy - pad, c), zero outside of input
+    // ld is the distance between rows of col (out_area, or batch * out_area in batch mode)
+    void im2col(const float_t* in, float_t* col, size_t ld) const {
+        tiny_cnn::im2col(in, in_, window_size_, window_size_, pad_, out_, col, ld);
+    }
 
-        for (layer_size_t dy = 0; dy < window_size_; ++dy) {
-            if (y + dy < pad) continue;
-            if (y + dy - pad >= in_.height_) continue;
+    // inverse of im2col: dst(x + dx - pad, y + dy - pad, c) = sum of corresponding col elements
+    void col2im(const float_t* col, size_t ld, float_t* dst) const {
+        const layer_size_t ow = out_.width_;
+        const layer_size_t oh = out_.height_;
+        const layer_size_t iw = in_.width_;
+        const layer_size_t ih = in_.height_;
+
+        std::fill(dst, dst + in_size_, float_t(0));
+
+        for_(parallelize_, 0, in_.depth_, [&](const blocked_range& r) {
+            for (int c = r.begin(); c < r.end(); c++) {
+                for (layer_size_t dy = 0; dy < window_size_; dy++) {
+                    for (layer_size_t dx = 0; dx < window_size_; dx++) {
+                        const layer_size_t x0 = std::min<layer_size_t>(ow, pad_ > dx ? pad_ - dx : 0);
+                        const layer_size_t x1 = std::max<layer_size_t>(x0, std::min<layer_size_t>(ow, iw + pad_ - dx));
+                        const float_t *src = &col[((c * window_size_ + dy) * window_size_ + dx) * ld];
+
+                        for (layer_size_t y = 0; y < oh; y++, src += ow) {
+                            const long iy = long(y + dy) - long(pad_);
+                            if (iy < 0 || iy >= long(ih)) continue;
+
+                            if (x1 <= x0) continue;
+
+                            float_t *d = &dst[in_.get_index(x0 + dx - pad_, iy, c)];
+                            for (layer_size_t x = x0; x < x1; x++)
+                                d[x - x0] += src[x];
+                        }
+                    }
+                }
+            }
+        }, 1);
+    }
 
-            for (layer_size_t dx = 0; dx < window_size_; ++dx) {
-                if (x + dx < pad) continue;
-                if (x + dx - pad >= in_.width_) continue;
+    layer_size_t out_length(layer_size_t in_length, layer_size_t window_size, padding pad_type) const {
+        return pad_type == padding::same ? in_length : (in_length - window_size + 1);
+    }
 
-                this->connect_weight(
-                    in_.get_index(x + dx - pad, y + dy - pad, inc), 
-                    out_.get_index(x, y, outc), 
-                    weight_.get_index(dx, dy, outc * in_.depth_ + inc));
+    layer_size_t out_size(layer_size_t in_width, layer_size_t in_height, layer_size_t window_size, padding pad_type) const {
+        return out_length(in_width, window_size, pad_type) * out_length(in_height, window_size, pad_type);
+    }
+
+    /**
+     * compile the table into runs of consecutive input channels of each output channel,
+     * and its transpose. kernels of connected pairs are packed into W_ in (outc, inc) order,
+     * and weights of unconnected pairs at the tail of W_ are left unused
+     **/
+    void init_connection(const connection_table& table) {
+        const layer_size_t ww = sqr(window_size_);
+        size_t weight = 0;
+
+        out_runs_.resize(out_.depth_);
+        in_kernels_.resize(in_.depth_);
+
+        for (layer_size_t outc = 0; outc < out_.depth_; ++outc) {
+            for (layer_size_t inc = 0; inc < in_.depth_; ++inc) {
+                if (!table.is_connected(outc, inc)) continue;
+
+                std::vector<kernel_run>& runs = out_runs_[outc];
+                if (!runs.empty() && runs.back().first + runs.back().count == inc) {
+                    runs.back().count++;
+                } else {
+                    kernel_run run = { inc, 1, weight };
+                    runs.push_back(run);
+                }
+                in_kernels_[inc].emplace_back(outc, weight);
+                weight += ww;
             }
         }
     }
@@ -215,8 +608,21 @@ private:
     index3d<layer_size_t> in_;
     index3d<layer_size_t> out_;
     index3d<layer_size_t> weight_;
-    connection_table connection_;
-    size_t window_size_;
+    layer_size_t window_size_;
+    layer_size_t pad_;
+    bool dense_; // all in/out channels are connected, so single gemm covers all channels
+
+    struct kernel_run { // input channels [first, first + count) connected to an output channel
+        layer_size_t first;
+        layer_size_t count;
+        size_t weight; // offset of their kernels in W_
+    };
+    std::vector<std::vector<kernel_run>> out_runs_;                          // outc -> runs of connected input channels
+    std::vector<std::vector<std::pair<layer_size_t, size_t>>> in_kernels_;  // inc -> [(outc, offset of kernel)]
+    vec_t col_[CNN_TASK_SIZE]; // im2col buffer for each worker
+    vec_t batch_col_; // im2col buffer of whole batch
+    vec_t W2_;        // squared weights used by back_propagation_2nd
+    vec_t batch_a_;   // w * x of whole batch, [out_channels][batch][out_area]
 };
 
 } // namespace tiny_cnn
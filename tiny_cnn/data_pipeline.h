@@ -0,0 +1,273 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <functional>
+#include <random>
+#include <exception>
+#include "util.h"
+
+#ifndef CNN_SINGLE_THREAD
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+namespace tiny_cnn {
+
+/**
+ * prefetches mini-batches of a dataset (e.g. image_dataset) in background threads.
+ *
+ * while network::train trains current mini-batch, producer threads load, convert and transform
+ * (e.g. augment) the following mini-batches into a ring of `depth` batch buffers.
+ * producers wait when the ring is full, and buffers are swapped with the caller's vectors,
+ * so that no allocation happens once buffers have grown to the batch size.
+ *
+ * batches are predicted to be requested sequentially along the order (first, first+n, ..., wrapping to 0
+ * at the end), which is how network::train enumerates. any other request (e.g. first batch of an epoch
+ * whose order is reshuffled by sampler) is loaded synchronously, and prefetching restarts from there.
+ *
+ * transform is applied to each sample with random engine seeded by (seed, batch number), so that
+ * the result doesn't depend on number of threads or timing.
+ * in CNN_SINGLE_THREAD build, batches are loaded synchronously.
+ *
+ * [example]
+ * async_dataset<image_dataset> pipeline(train_data);
+ * pipeline.set_transform([](vec_t& image, label_t&, std::mt19937& rng) { corrupt(image, 0.1, -1.0, rng); });
+ * nn.train(pipeline, minibatch_size, num_epochs, on_batch, on_epoch);
+ **/
+template <typename Dataset>
+class async_dataset {
+public:
+    typedef typename Dataset::label_type label_type;
+    typedef std::function<void(vec_t& in, label_type& t, std::mt19937& rng)> transform_func;
+
+    /**
+     * @param data        source dataset, which must outlive this object
+     * @param depth       number of mini-batches prefetched ahead
+     * @param num_threads number of producer threads (0: load synchronously)
+     **/
+    explicit async_dataset(const Dataset& data, size_t depth = 2, size_t num_threads = 1)
+        : data_(data), seed_(0), slots_(std::max<size_t>(depth, 1)), batch_size_(0), next_seq_(0),
+          scheduled_seq_(0), schedule_first_(0), active_(false), stop_(false) {
+#ifndef CNN_SINGLE_THREAD
+        for (size_t i = 0; i < num_threads; i++)
+            producers_.emplace_back([this] { produce(); });
+#else
+        CNN_UNREFERENCED_PARAMETER(num_threads);
+#endif
+    }
+
+    ~async_dataset() {
+#ifndef CNN_SINGLE_THREAD
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto& t : producers_) t.join();
+#endif
+    }
+
+    ///< set function applied to each sample after loading. must not be called while training
+    void set_transform(transform_func f, unsigned seed = 0) {
+        restart();
+        transform_ = f;
+        seed_ = seed;
+    }
+
+    size_t size() const { return data_.size(); }
+    size_t sample_size() const { return data_.sample_size(); }
+
+    /**
+     * same as Dataset::get_batch, except that images/labels are swapped with internal buffers.
+     * must be called from one thread at a time.
+     **/
+    void get_batch(const std::vector<size_t>& order, size_t first, size_t n,
+                   std::vector<vec_t>* images, std::vector<label_type>* labels) const {
+        if (first + n > order.size()) throw nn_error("index out of range");
+#ifndef CNN_SINGLE_THREAD
+        std::unique_lock<std::mutex> lock(mtx_);
+        slot* s = find(next_seq_);
+
+        if (active_ && s && s->indices.size() == n && std::equal(s->indices.begin(), s->indices.end(), order.begin() + first)) {
+            cond_.wait(lock, [&] { return s->state == slot::ready; });
+            take(*s, images, labels);
+            return;
+        }
+
+        // not prefetched: discard pending batches, load this one here and restart prefetching after it
+        cond_.wait(lock, [&] { return !loading(); });
+        for (auto& e : slots_) e.state = slot::free;
+        order_ = order;
+        batch_size_ = n;
+        schedule_first_ = first;
+        scheduled_seq_ = next_seq_;
+        s = &slots_[0];
+        schedule(*s);
+        active_ = true; // producers prefetch following batches while this one is loaded
+        cond_.notify_all();
+        lock.unlock();
+
+        load(*s);
+
+        lock.lock();
+        take(*s, images, labels);
+#else
+        slot& s = slots_[0];
+        s.indices.assign(order.begin() + first, order.begin() + first + n);
+        s.seq = next_seq_;
+        load(s);
+        take(s, images, labels);
+#endif
+    }
+
+private:
+    struct slot {
+        enum state_t { free, loading, ready };
+
+        slot() : state(free), seq(0) {}
+
+        state_t state;
+        std::vector<size_t> indices; // samples of the batch
+        uint64_t seq; // number of batch since restart, which determines seed of transform
+        std::vector<vec_t> images;
+        std::vector<label_type> labels;
+        std::exception_ptr error;
+    };
+
+    // stop prefetching, so that next get_batch restarts from batch number 0
+    void restart() {
+#ifndef CNN_SINGLE_THREAD
+        std::unique_lock<std::mutex> lock(mtx_);
+        cond_.wait(lock, [&] { return !loading(); });
+        for (auto& e : slots_) e.state = slot::free;
+        active_ = false;
+#endif
+        next_seq_ = 0;
+    }
+
+    void load(slot& s) const {
+        try {
+            data_.get_batch(s.indices, 0, s.indices.size(), &s.images, &s.labels);
+            if (transform_) {
+                std::mt19937 rng(static_cast<std::mt19937::result_type>(seed_ + s.seq * 2654435761u));
+                for (size_t i = 0; i < s.indices.size(); i++)
+                    transform_(s.images[i], s.labels[i], rng);
+            }
+            s.error = std::exception_ptr();
+        } catch (...) {
+            s.error = std::current_exception();
+        }
+    }
+
+    void take(slot& s, std::vector<vec_t>* images, std::vector<label_type>* labels) const {
+        s.state = slot::free;
+        next_seq_++;
+#ifndef CNN_SINGLE_THREAD
+        cond_.notify_all();
+#endif
+        if (s.error) {
+            std::exception_ptr e = s.error;
+            s.error = std::exception_ptr();
+            std::rethrow_exception(e);
+        }
+        images->swap(s.images);
+        labels->swap(s.labels);
+    }
+
+#ifndef CNN_SINGLE_THREAD
+    slot* find(uint64_t seq) const {
+        for (auto& s : slots_)
+            if (s.state != slot::free && s.seq == seq) return &s;
+        return nullptr;
+    }
+
+    bool loading() const {
+        for (auto& s : slots_)
+            if (s.state == slot::loading) return true;
+        return false;
+    }
+
+    slot* free_slot() const {
+        for (auto& s : slots_)
+            if (s.state == slot::free) return &s;
+        return nullptr;
+    }
+
+    // assign next batch of the schedule to s
+    void schedule(slot& s) const {
+        if (schedule_first_ >= order_.size()) schedule_first_ = 0; // next epoch (assuming same order)
+        const size_t n = std::min(batch_size_, order_.size() - schedule_first_);
+        s.indices.assign(order_.begin() + schedule_first_, order_.begin() + schedule_first_ + n);
+        s.seq = scheduled_seq_++;
+        s.state = slot::loading;
+        schedule_first_ += n;
+    }
+
+    void produce() {
+        std::unique_lock<std::mutex> lock(mtx_);
+
+        for (;;) {
+            slot* s = nullptr;
+            cond_.wait(lock, [&] { return stop_ || (active_ && batch_size_ > 0 && (s = free_slot()) != nullptr); });
+            if (stop_) return;
+
+            schedule(*s);
+            lock.unlock();
+            load(*s);
+            lock.lock();
+
+            s->state = slot::ready;
+            cond_.notify_all();
+        }
+    }
+#endif
+
+    async_dataset(const async_dataset&);
+    async_dataset& operator = (const async_dataset&);
+
+    const Dataset& data_;
+    transform_func transform_;
+    unsigned seed_;
+
+    // state is mutable, because get_batch is const as other datasets
+    mutable std::vector<slot> slots_;
+    mutable std::vector<size_t> order_; // order of the schedule
+    mutable size_t batch_size_;      // batch size of the schedule
+    mutable uint64_t next_seq_;      // batch number to be returned by next get_batch
+    mutable uint64_t scheduled_seq_; // batch number to be assigned to next scheduled slot
+    mutable size_t schedule_first_;  // first sample of next scheduled batch
+    mutable bool active_;            // producers can schedule batches
+    bool stop_;
+#ifndef CNN_SINGLE_THREAD
+    mutable std::mutex mtx_;
+    mutable std::condition_variable cond_;
+    std::vector<std::thread> producers_;
+#endif
+};
+
+} // namespace tiny_cnn
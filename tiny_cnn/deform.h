@@ -36,5 +36,14 @@ inline vec_t corrupt(vec_t&& in, float_t corruption_level, float_t min_value) {
     return in;
 }
 
+// same as above, with random engine of the caller (e.g. transform of async_dataset)
+template <typename Random>
+void corrupt(vec_t& in, float_t corruption_level, float_t min_value, Random& rng) {
+    std::bernoulli_distribution d(corruption_level);
+    for (size_t i = 0; i < in.size(); i++)
+        if (d(rng))
+            in[i] = min_value;
+}
+
 
 } // namespace tiny_cnn
@@ -42,10 +42,24 @@ namespace tiny_cnn {
             return out;
         }
 
+        const vec_t& filter_fprop(vec_t& out) const {
+            return out;
+        }
+
         const vec_t& filter_bprop(const vec_t& delta, int index) {
             CNN_UNREFERENCED_PARAMETER(index);
             return delta;
         }
+
+        size_t state_size() const { return 0; }
+        void save_state(int index, uint8_t* dst) const {
+            CNN_UNREFERENCED_PARAMETER(index);
+            CNN_UNREFERENCED_PARAMETER(dst);
+        }
+        void restore_state(int index, const uint8_t* src) {
+            CNN_UNREFERENCED_PARAMETER(index);
+            CNN_UNREFERENCED_PARAMETER(src);
+        }
     };
 
     class dropout {
@@ -61,8 +75,9 @@ namespace tiny_cnn {
         };
 
         explicit dropout(int out_dim)
-            : out_dim_(out_dim), mask_(out_dim), ctx_(train_phase), mode_(per_data), dropout_rate_(0.5) {
+            : out_dim_(out_dim), ctx_(train_phase), mode_(per_data), dropout_rate_(0.5) {
             for (int i = 0; i < CNN_TASK_SIZE; i++) {
+                mask_[i].resize(out_dim);
                 masked_out_[i].resize(out_dim);
                 masked_delta_[i].resize(out_dim);
             }
@@ -83,11 +98,13 @@ namespace tiny_cnn {
             ctx_ = ctx;
         }
 
-        // mask output vector
+        // mask output vector (a new mask is drawn for each sample in per-data mode, and kept until filter_bprop)
+        // called concurrently for different index, so per-data masks are drawn by the engine of the worker
         const vec_t& filter_fprop(const vec_t& out, int index) {
             if (ctx_ == train_phase) {
+                if (mode_ == per_data) shuffle(index);
                 for (int i = 0; i < out_dim_; i++)
-                    masked_out_[index][i] = out[i] * mask_[i];
+                    masked_out_[index][i] = out[i] * mask_[index][i];
             }
             else if (ctx_ == test_phase) {
                 for (int i = 0; i < out_dim_; i++)
@@ -99,19 +116,61 @@ namespace tiny_cnn {
             return masked_out_[index];
         }
 
-        // mask delta
+        // mask output vector in-place (used by concurrent forward, so mask is never changed here)
+        const vec_t& filter_fprop(vec_t& out) const {
+            if (ctx_ == train_phase) {
+                for (int i = 0; i < out_dim_; i++)
+                    out[i] = out[i] * mask_[0][i];
+            }
+            else if (ctx_ == test_phase) {
+                for (int i = 0; i < out_dim_; i++)
+                    out[i] = out[i] * (1.0 - dropout_rate_);
+            }
+            else {
+                throw nn_error("invalid context");
+            }
+            return out;
+        }
+
+        // mask delta with the mask used by the last filter_fprop
         const vec_t& filter_bprop(const vec_t& delta, int index) {
             for (int i = 0; i < out_dim_; i++)
-                masked_delta_[index][i] = delta[i] * mask_[i];
-
-            if (mode_ == per_data) shuffle();
+                masked_delta_[index][i] = delta[i] * mask_[index][i];
 
             return masked_delta_[index];
         }
 
+        // mask of the worker is the per-sample state which filter_bprop depends on (see layer_base::sample_state_size)
+        size_t state_size() const { return out_dim_; }
+
+        void save_state(int index, uint8_t* dst) const {
+            std::copy(mask_[index].begin(), mask_[index].end(), dst);
+        }
+
+        void restore_state(int index, const uint8_t* src) {
+            std::copy(src, src + out_dim_, mask_[index].begin());
+        }
+
+        // draw the same mask for all workers
         void shuffle() {
-            for (auto& m : mask_)
+            for (auto& m : mask_[0])
                 m = bernoulli(1.0 - dropout_rate_);
+            for (int i = 1; i < CNN_TASK_SIZE; i++)
+                mask_[i] = mask_[0];
+        }
+
+        void shuffle(int index) {
+            std::uniform_real_distribution<double> dst(0.0, 1.0);
+            for (auto& m : mask_[index])
+                m = dst(rng_[index]) <= 1.0 - dropout_rate_;
+        }
+
+        // seed engines of workers from the global one, so that masks depend only on its state
+        // (saved by checkpoint) and on which worker handles the sample, not on timing of threads
+        void begin_batch() {
+            if (ctx_ != train_phase || mode_ != per_data) return;
+            for (int i = 0; i < CNN_TASK_SIZE; i++)
+                rng_[i].seed(detail::random_engine<double>()());
         }
 
         void end_batch() {
@@ -120,7 +179,8 @@ namespace tiny_cnn {
 
     private:
         int out_dim_;
-        std::vector<uint8_t> mask_;
+        std::vector<uint8_t> mask_[CNN_TASK_SIZE]; // mask for each worker
+        std::minstd_rand rng_[CNN_TASK_SIZE]; // engine for each worker (see begin_batch)
         vec_t masked_out_[CNN_TASK_SIZE];
         vec_t masked_delta_[CNN_TASK_SIZE];
         context ctx_;
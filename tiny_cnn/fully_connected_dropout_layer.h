@@ -54,6 +54,10 @@ public:
     std::string layer_type() const override { return "dropout"; }
 
 private:
+    void pre_batch() override {
+        this->filter_.begin_batch();
+    }
+
     void post_update() override {
         this->filter_.end_batch();
     }
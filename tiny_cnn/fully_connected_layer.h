@@ -53,24 +53,76 @@ public:
     }
 
     const vec_t& forward_propagation(const vec_t& in, size_t index) override {
-        vec_t &a = a_[index];
         vec_t &out = output_[index];
 
-        for_i(parallelize_, out_size_, [&](int i) {
-            a[i] = 0.0;
-            for (int c = 0; c < in_size_; c++)
-                a[i] += W_[c*out_size_ + i] * in[c];
+        fprop(in, a_[index], out);
 
-            a[i] += b_[i];
-        });
+        auto& this_out = filter_.filter_fprop(out, index);
+
+        return forward_next(this_out, index);
+    }
+
+    bool supports_forward() const override { return true; }
+
+    const vec_t& forward(const vec_t& in, layer_workspace& ws) const override {
+        ws.a.resize(out_size_);
+        ws.output.resize(out_size_);
+
+        fprop(in, ws.a, ws.output);
+
+        return filter_.filter_fprop(ws.output);
+    }
+
+    /**
+     * applied as a convolution whose window is the output map of the previous layer at training
+     * (or 1x1 after another fully-connected layer), so the map of scores is produced in one pass.
+     * a[M x N] = W^T[M x K] * col[K x N], where K = in_dim is laid out the same as a patch
+     **/
+    const vec_t& forward_dense(const vec_t& in, index3d<layer_size_t>& shape, layer_workspace& ws) const override {
+        index3d<layer_size_t> window(1, 1, shape.depth_);
+
+        if (prev_ && prev_->out_shape().depth_ == shape.depth_ && prev_->out_shape().size() == in_size_)
+            window = prev_->out_shape();
+
+        if (window.size() != in_size_ || shape.width_ < window.width_ || shape.height_ < window.height_)
+            dense_shape_mismatch(*this, shape);
 
-        for_i(parallelize_, out_size_, [&](int i) {
-            out[i] = h_.f(a, i);
+        const index3d<layer_size_t> out(shape.width_ - window.width_ + 1, shape.height_ - window.height_ + 1, out_size_);
+        const layer_size_t M = out_size_;
+        const layer_size_t N = out.width_ * out.height_;
+        const layer_size_t K = in_size_;
+        const float_t* col = &in[0];
+
+        if (N > 1 && window.width_ * window.height_ > 1) {
+            ws.scratch.resize(size_t(K) * N);
+            im2col(&in[0], shape, window.width_, window.height_, 0, out, &ws.scratch[0], N);
+            col = &ws.scratch[0];
+        }
+
+        ws.a.resize(out.size());
+        ws.output.resize(out.size());
+
+        for_blocks(parallelize_, M, block_size, [&](const blocked_range& r) {
+            for (int o = r.begin(); o < r.end(); o++)
+                std::fill(&ws.a[o * N], &ws.a[0] + (o + 1) * N, b_[o]);
+
+            vectorize::gemm_tn<float_t>(r.end() - r.begin(), N, K, &W_[r.begin()], M, col, N, &ws.a[r.begin() * N], N);
         });
 
-        auto& this_out = filter_.filter_fprop(out, index);
+        this->activate_map(ws.a, ws.output, out, ws);
 
-        return next_ ? next_->forward_propagation(this_out, index) : this_out;
+        if (!std::is_same<Filter, filter_none>::value) {
+            vec_t& y = ws.channels;
+            y.resize(M);
+            for (layer_size_t i = 0; i < N; i++) {
+                for (layer_size_t o = 0; o < M; o++) y[o] = ws.output[o * N + i];
+                filter_.filter_fprop(y);
+                for (layer_size_t o = 0; o < M; o++) ws.output[o * N + i] = y[o];
+            }
+        }
+
+        shape = out;
+        return ws.output;
     }
 
     const vec_t& back_propagation(const vec_t& current_delta, size_t index) override {
@@ -85,10 +137,10 @@ public:
             // propagate delta to previous layer
             // prev_delta[c] += current_delta[r] * W_[c * out_size_ + r]
             prev_delta[c] = vectorize::dot(&curr_delta[0], &W_[c*out_size_], out_size_);
-            prev_delta[c] *= prev_h.df(prev_out[c]);
         }
+        prev_h.df_vec(&prev_out[0], &prev_delta[0], in_size_);
 
-        for_(parallelize_, 0, out_size_, [&](const blocked_range& r) {
+        for_blocks(parallelize_, out_size_, block_size, [&](const blocked_range& r) {
             // accumulate weight-step using delta
             // dW[c * out_size + i] += current_delta[i] * prev_out[c]
             for (int c = 0; c < in_size_; c++)
@@ -98,7 +150,60 @@ public:
                 db[i] += curr_delta[i];
         });
 
-        return prev_->back_propagation(prev_delta_[index], index);
+        return backward_prev(prev_delta_[index], index);
+    }
+
+    /**
+     * out[batch x out_dim] = h(in[batch x in_dim] * W[in_dim x out_dim] + b)
+     * layers with dropout-filter use per-sample implementation of layer_base
+     **/
+    const vec_t& forward_batch(const vec_t& in, size_t batch_size) override {
+        if (!std::is_same<Filter, filter_none>::value) return Base::forward_batch(in, batch_size);
+
+        vec_t& out = batch_output_;
+        out.resize(batch_size * out_size_);
+
+        for (size_t n = 0; n < batch_size; n++)
+            std::copy(b_.begin(), b_.end(), &out[n * out_size_]);
+
+        for_blocks(parallelize_, out_size_, block_size, [&](const blocked_range& r) {
+            vectorize::gemm_nn<float_t>(batch_size, r.end() - r.begin(), in_size_,
+                                        &in[0], in_size_, &W_[r.begin()], out_size_, &out[r.begin()], out_size_);
+        });
+
+        this->activate_batch(&out[0], &out[0], batch_size, out_size_);
+        return out;
+    }
+
+    const vec_t& backward_batch(const vec_t& current_delta, size_t batch_size) override {
+        if (!std::is_same<Filter, filter_none>::value) return Base::backward_batch(current_delta, batch_size);
+
+        const vec_t& prev_out = prev_->batch_output();
+        const activation::function& prev_h = prev_->activation_function();
+        vec_t& prev_delta = batch_prev_delta_;
+        vec_t& dW = dW_[0];
+        vec_t& db = db_[0];
+
+        prev_delta.assign(batch_size * in_size_, float_t(0));
+
+        for_blocks(parallelize_, in_size_, block_size, [&](const blocked_range& r) {
+            const layer_size_t rows = r.end() - r.begin();
+
+            // prev_delta[batch x in_dim] = current_delta[batch x out_dim] * W^T
+            vectorize::gemm_nt<float_t>(batch_size, rows, out_size_,
+                                        &current_delta[0], out_size_, &W_[r.begin() * out_size_], out_size_, &prev_delta[r.begin()], in_size_);
+
+            // dW[in_dim x out_dim] += prev_out^T * current_delta
+            vectorize::gemm_tn<float_t>(rows, out_size_, batch_size,
+                                        &prev_out[r.begin()], in_size_, &current_delta[0], out_size_, &dW[r.begin() * out_size_], out_size_);
+        });
+
+        for (size_t n = 0; n < batch_size; n++)
+            vectorize::reduce<float_t>(&current_delta[n * out_size_], out_size_, &db[0]);
+
+        this->apply_df(prev_h, &prev_out[0], &prev_delta[0], batch_size * in_size_);
+
+        return prev_delta;
     }
 
     const vec_t& back_propagation_2nd(const vec_t& current_delta2) override {
@@ -121,12 +226,39 @@ public:
             prev_delta2_[c] *= sqr(prev_h.df(prev_out[c]));
         }
 
-        return prev_->back_propagation_2nd(prev_delta2_);
+        return backward_prev_2nd(prev_delta2_);
+    }
+
+    size_t sample_state_size() const override { return filter_.state_size(); }
+
+    void save_sample_state(size_t worker_index, uint8_t* dst) const override {
+        filter_.save_state(static_cast<int>(worker_index), dst);
+    }
+
+    void restore_sample_state(size_t worker_index, const uint8_t* src) override {
+        filter_.restore_state(static_cast<int>(worker_index), src);
     }
 
     std::string layer_type() const override { return "fully-connected"; }
 
 protected:
+    enum { block_size = 64 }; // number of units processed by one task in fprop/bprop
+
+    void fprop(const vec_t& in, vec_t& a, vec_t& out) const {
+        const bool elementwise = h_.elementwise();
+
+        // a = b + sum_c in[c] * (row c of W_), out = h(a)
+        // each block of output units streams its columns of W_ row by row, keeping a in registers,
+        // and activates them while they are still in cache
+        for_blocks(parallelize_, out_size_, block_size, [&](const blocked_range& r) {
+            std::copy(&b_[r.begin()], &b_[0] + r.end(), &a[r.begin()]);
+            vectorize::gemm_nn<float_t>(1, r.end() - r.begin(), in_size_, &in[0], in_size_, &W_[r.begin()], out_size_, &a[r.begin()], out_size_);
+            if (elementwise) h_.f_vec(&a[r.begin()], &out[r.begin()], r.end() - r.begin());
+        });
+
+        if (!elementwise) h_.f_vec(&a[0], &out[0], out_size_);
+    }
+
     Filter filter_;
 };
 
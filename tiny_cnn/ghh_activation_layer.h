@@ -34,12 +34,19 @@
  */
 
 #pragma once
+#include <cstdint>
 #include "layer.h"
 #include "product.h"
 #include "dropout.h"
 
 namespace tiny_cnn {
 
+/**
+ * out[i] = sum_n (-1)^n * max_m in[(n * num_in_max + m) * out_dim + i]
+ *
+ * every (n, m) group of the input is a contiguous slice of out_dim values, so the max runs
+ * element-wise over whole slices (branch-free, vectorizable) instead of walking the input with a stride of out_dim
+ **/
 template<typename Activation, typename Filter = filter_none>
 class ghh_activation_layer : public layer<Activation> {
 public:
@@ -47,235 +54,178 @@ public:
     CNN_USE_LAYER_MEMBERS;
 
     ghh_activation_layer(layer_size_t out_dim, size_t num_in_sum, size_t num_in_max)
-        : Base(size_t(out_dim) * num_in_sum * num_in_max, out_dim, 0, 0), filter_(out_dim) {
-		m_num_in_sum = num_in_sum;
-		m_num_in_max = num_in_max;
-	}
+        : Base(size_t(out_dim) * num_in_sum * num_in_max, out_dim, 0, 0), filter_(out_dim),
+          num_in_sum_(num_in_sum), num_in_max_(num_in_max) {
+        if (num_in_max > 256)
+            throw nn_error("num_in_max must be 256 or less (argmax is kept as 8-bit index in group)");
 
-	// Stupid dummies to be compatible
+        for (auto& m : argmax_) m.resize(num_in_sum * out_dim);
+    }
+
+    // Stupid dummies to be compatible
     size_t connection_size() const override {
         return size_t(in_size_) * out_size_ + out_size_;
     }
 
-	// Stupid dummies to be compatible
+    // Stupid dummies to be compatible
     size_t fan_in_size() const override {
         return in_size_;
     }
 
-	// Stupid dummies to be compatible
+    // Stupid dummies to be compatible
     size_t fan_out_size() const override {
         return out_size_;
     }
 
     const vec_t& forward_propagation(const vec_t& in, size_t index) override {
-        vec_t &a = a_[index];
         vec_t &out = output_[index];
 
-		int step_size = out_size_; // we move channel-wise to be compatible (might break cache!)
-		
-		// simple implementation with for loops for now
-        for_i(parallelize_, out_size_, [&](int i) {
-		    int idx = i; // set base for i
-			float_t sum_out = static_cast<float_t>(0.0);
-			float_t sum_sign = static_cast<float_t>(1.0);
-			for(int n=0; n < m_num_in_sum; ++n){
-				assert(idx < in.size());
-				float_t max_out = in[idx]; // start with first as max
-				idx += step_size;		   // move index to next
-				for(int m=1; m < m_num_in_max; ++m){
-					assert(idx < in.size());
-					max_out = std::max(max_out,in[idx]); // do the max operation for others
-					idx += step_size;					 // move index to next
-				}
-				sum_out += sum_sign * max_out; // add with sign
-				sum_sign = -sum_sign; // flip sign
-			}
-			a[i] = sum_out;	// final activated output
-		});
-
-        for_i(parallelize_, out_size_, [&](int i) {
-            out[i] = h_.f(a, i);
-        });
-		
+        fprop(&in[0], &a_[index][0], &out[0], &argmax_[index][0]);
+
         auto& this_out = filter_.filter_fprop(out, index);
 
-        return next_ ? next_->forward_propagation(this_out, index) : this_out;
+        return forward_next(this_out, index);
+    }
+
+    bool supports_forward() const override { return true; }
+
+    const vec_t& forward(const vec_t& in, layer_workspace& ws) const override {
+        ws.a.resize(out_size_);
+        ws.output.resize(out_size_);
+
+        fprop(&in[0], &ws.a[0], &ws.output[0], nullptr);
+
+        return filter_.filter_fprop(ws.output);
     }
 
-	// We use the fully connected implementation for now (TODO: Fixme)
+    // delta goes to the max of each group with the sign of the group, using argmax kept by forward_propagation
     const vec_t& back_propagation(const vec_t& current_delta, size_t index) override {
         const vec_t& curr_delta = filter_.filter_bprop(current_delta, index);
         const vec_t& prev_out = prev_->output(index);
-        const vec_t& in = prev_->output(index); // note that this works only with identity!
         const activation::function& prev_h = prev_->activation_function();
         vec_t& prev_delta = prev_delta_[index];
-        vec_t& dW = dW_[index];
-        vec_t& db = db_[index];
-
-		// if (W_.size() > 0)
-		// 	throw nn_error("Weights not empty for GHH!");
-
-		int step_size = out_size_; // we move channel-wise to be compatible (might break cache!)
-		
-		// Compute the coefficients to be multiplied to delta (basically picking the things for max)
-		vec_t bp_coeff(this->in_size_,0);
-        for_i(parallelize_, out_size_, [&](int i) {
-		    int idx = i; // set base for i
-			float_t sum_sign = static_cast<float_t>(1.0);
-			for(int n=0; n < m_num_in_sum; ++n){
-				// start with first as max
-				float_t max_out = in[idx]; 
-				assert(idx < in.size());
-				int max_idx = idx;
-				idx += step_size;
-				// find max_idx for assigning bp_coeff
-				for(int m=1; m < m_num_in_max; ++m){
-					assert(idx < in.size());
-					if (max_out < in[idx]){
-						max_out = in[idx];
-						max_idx = idx;
-					}
-					idx += step_size;
-				}
-				bp_coeff[max_idx] = sum_sign; // save the coefficient to be multiplied
-				sum_sign = -sum_sign; // flip sign
-			}
-		});
-
-        for (int c = 0; c < this->in_size_; c++) {
-            // propagate delta to previous layer
-
-			// Use bp_coeff to see if we propagate the curr_delta
-			int r = c % this->out_size_;
-			prev_delta[c] = curr_delta[r] * bp_coeff[c]; // TODO: this is wrong
-			
-            // // prev_delta[c] += current_delta[r] * W_[c * out_size_ + r]
-            // prev_delta[c] = vectorize::dot(&curr_delta[0], &W_[c*out_size_], out_size_);
-
-			prev_delta[c] *= prev_h.df(prev_out[c]);
-        }
-
-        // for (int c = 0; c < this->in_size_; c++) {
-        //     // propagate delta to previous layer
-        //     // prev_delta[c] += current_delta[r] * W_[c * out_size_ + r]
-        //     prev_delta[c] = vectorize::dot(&curr_delta[0], &W_[c*out_size_], out_size_);
-        //     prev_delta[c] *= prev_h.df(prev_out[c]);
-        // }
-
-		
-		// No need to prepare weight updates for this layer
-        // for_(parallelize_, 0, out_size_, [&](const blocked_range& r) {
-        //     // accumulate weight-step using delta
-        //     // dW[c * out_size + i] += current_delta[i] * prev_out[c]
-        //     for (int c = 0; c < in_size_; c++)
-        //         vectorize::muladd(&curr_delta[0], prev_out[c], r.end() - r.begin(), &dW[c*out_size_ + r.begin()]);
-
-        //     for (int i = r.begin(); i < r.end(); i++) 
-        //         db[i] += curr_delta[i];
-        // });
-
-        return prev_->back_propagation(prev_delta_[index], index);
+
+        bprop(&curr_delta[0], &argmax_[index][0], false, &prev_delta[0]);
+
+        prev_h.df_vec(&prev_out[0], &prev_delta[0], in_size_);
+
+        return backward_prev(prev_delta_[index], index);
     }
 
-	// We use the fully connected implementation for now (TODO: Fixme)
+    // the same routing as back_propagation, where signs vanish by squaring
     const vec_t& back_propagation_2nd(const vec_t& current_delta2) override {
         const vec_t& prev_out = prev_->output(0);
-        const vec_t& in = prev_->output(0); // note that this works only with identity!
         const activation::function& prev_h = prev_->activation_function();
 
-		printf("I should not have been called\n");
-		
-		// No need to prepare weight updates for this layer
-        // for (int c = 0; c < in_size_; c++) 
-        //     for (int r = 0; r < out_size_; r++)
-        //         Whessian_[c*out_size_ + r] += current_delta2[r] * sqr(prev_out[c]);
-
-        // for (int r = 0; r < out_size_; r++)
-        //     bhessian_[r] += current_delta2[r];
-
-
-		int step_size = out_size_; // we move channel-wise to be compatible (might break cache!)
-
-        // Compute the coefficients to be multiplied to delta (basically picking the things for max)
-		vec_t bp_coeff(this->in_size_,0);
-        for_i(parallelize_, out_size_, [&](int i) {
-		    int idx = i; // set base for i
-			float_t sum_sign = static_cast<float_t>(1.0);
-			for(int n=0; n < m_num_in_sum; ++n){
-				// start with first as max
-				float_t max_out = in[idx]; 
-				assert(idx < in.size());
-				int max_idx = idx;
-				idx += step_size;
-				// find max_idx for assigning bp_coeff
-				for(int m=1; m < m_num_in_max; ++m){
-					assert(idx < in.size());
-					if (max_out < in[idx]){
-						max_out = in[idx];
-						max_idx = idx;
-					}
-					idx += step_size;
-				}
-				bp_coeff[max_idx] = sum_sign; // save the coefficient to be multiplied
-				sum_sign = -sum_sign; // flip sign
-			}
-		});
-		
-        for (int c = 0; c < in_size_; c++) { 
-            prev_delta2_[c] = 0.0;
-
-            for (int r = 0; r < out_size_; r++) 
-                prev_delta2_[c] += current_delta2[r];
-
-            prev_delta2_[c] *= sqr(bp_coeff[c]);
+        bprop(&current_delta2[0], &argmax_[0][0], true, &prev_delta2_[0]);
+
+        for (layer_size_t c = 0; c < in_size_; c++)
             prev_delta2_[c] *= sqr(prev_h.df(prev_out[c]));
-        }
 
-        return prev_->back_propagation_2nd(prev_delta2_);
+        return backward_prev_2nd(prev_delta2_);
     }
 
+    // argmax of each group followed by the state of the filter (e.g. dropout mask)
+    size_t sample_state_size() const override { return argmax_[0].size() + filter_.state_size(); }
 
-	// // We override the weight initialization for this guy
-    // void init_weight() override {
+    void save_sample_state(size_t worker_index, uint8_t* dst) const override {
+        const std::vector<uint8_t>& argmax = argmax_[worker_index];
+        std::copy(argmax.begin(), argmax.end(), dst);
+        filter_.save_state(static_cast<int>(worker_index), dst + argmax.size());
+    }
 
-	// 	printf("OVERRIDED INIT for GHH\n");
+    void restore_sample_state(size_t worker_index, const uint8_t* src) override {
+        std::vector<uint8_t>& argmax = argmax_[worker_index];
+        std::copy(src, src + argmax.size(), argmax.begin());
+        filter_.restore_state(static_cast<int>(worker_index), src + argmax.size());
+    }
 
-	// 	W_.clear();
-	// 	b_.clear();
-		
-    //     // weight_init_->fill(&W_, fan_in_size(), fan_out_size());
-    //     // bias_init_->fill(&b_, fan_in_size(), fan_out_size());
+    void freeze() override {
+        Base::freeze();
+        for (auto& m : argmax_) release(m);
+    }
 
-    //     // std::fill(Whessian_.begin(), Whessian_.end(), 0.0);
-    //     // std::fill(bhessian_.begin(), bhessian_.end(), 0.0);
-    //     // clear_diff(CNN_TASK_SIZE);
-    // }
-	
-	// // Optimizer should do nothing for this guy. So we override
-    // template <typename Optimizer>
-    // void update_weight(Optimizer *o, int worker_size, size_t batch_size) override {
+    size_t memory_usage() const override {
+        size_t size = Base::memory_usage();
+        for (auto& m : argmax_) size += memory_size(m);
+        return size;
+    }
 
-	// 	printf("OVERRIDED Optimizer for GHH\n");
-		
-    //     if (W_.empty()) return;
+    std::string layer_type() const override { return "ghh-activation"; }
 
-    //     // merge(worker_size, batch_size);
+protected:
+    /**
+     * a = signed sum of the max of each group, and argmax = index of the max in each group if argmax is not null.
+     * out holds the running max of the current group before it is overwritten by the activation
+     **/
+    void fprop(const float_t* in, float_t* a, float_t* out, uint8_t* argmax) const {
+        const size_t dim = out_size_;
+
+        for_(parallelize_, 0, out_size_, [&](const blocked_range& r) {
+            const size_t first = r.begin(), n = r.end() - r.begin();
+            float_t* peak = out + first;
+
+            std::fill(a + first, a + first + n, float_t(0));
+
+            for (size_t g = 0; g < num_in_sum_; g++) {
+                const float_t* src = in + g * num_in_max_ * dim + first;
+                const float_t sign = (g % 2) ? float_t(-1) : float_t(1);
+
+                std::copy(src, src + n, peak);
+
+                if (argmax) {
+                    uint8_t* arg = argmax + g * dim + first;
+                    std::fill(arg, arg + n, uint8_t(0));
+
+                    for (size_t m = 1; m < num_in_max_; m++) {
+                        const float_t* v = src + m * dim;
+                        for (size_t i = 0; i < n; i++) {
+                            arg[i] = v[i] > peak[i] ? static_cast<uint8_t>(m) : arg[i];
+                            peak[i] = v[i] > peak[i] ? v[i] : peak[i];
+                        }
+                    }
+                } else {
+                    for (size_t m = 1; m < num_in_max_; m++) {
+                        const float_t* v = src + m * dim;
+                        for (size_t i = 0; i < n; i++)
+                            peak[i] = std::max(peak[i], v[i]);
+                    }
+                }
+
+                for (size_t i = 0; i < n; i++)
+                    a[first + i] += sign * peak[i];
+            }
+        });
 
-    //     // o->update(dW_[0], Whessian_, W_);
-    //     // o->update(db_[0], bhessian_, b_);
+        h_.f_vec(a, out, out_size_);
+    }
 
-    //     // clear_diff(worker_size);
-    //     // post_update();
-    // }
-	
+    // prev = delta at the max of each group (negated for odd groups unless squared), 0 elsewhere.
+    // every element of prev is written exactly once, so no clearing pass is needed
+    void bprop(const float_t* delta, const uint8_t* argmax, bool squared, float_t* prev) const {
+        const size_t dim = out_size_;
 
-    std::string layer_type() const override { return "ghh-activation"; }
+        for_(parallelize_, 0, out_size_, [&](const blocked_range& r) {
+            const size_t first = r.begin(), n = r.end() - r.begin();
+
+            for (size_t g = 0; g < num_in_sum_; g++) {
+                const uint8_t* arg = argmax + g * dim + first;
+                const float_t sign = (g % 2 && !squared) ? float_t(-1) : float_t(1);
+
+                for (size_t m = 0; m < num_in_max_; m++) {
+                    float_t* dst = prev + (g * num_in_max_ + m) * dim + first;
+                    for (size_t i = 0; i < n; i++)
+                        dst[i] = arg[i] == m ? sign * delta[first + i] : float_t(0);
+                }
+            }
+        });
+    }
 
-protected:
     Filter filter_;
 
-	int m_num_in_sum;
-	int m_num_in_max;
+    size_t num_in_sum_;
+    size_t num_in_max_;
+    std::vector<uint8_t> argmax_[CNN_TASK_SIZE]; // index of the max in each group (n * out_dim + i), for each worker
 };
 
 } // namespace tiny_cnn
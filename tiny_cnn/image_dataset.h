@@ -0,0 +1,299 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <memory>
+#include <cstdint>
+#include "util.h"
+#include "mapped_file.h"
+#include "cifar10_parser.h"
+
+namespace tiny_cnn {
+
+/**
+ * image dataset backed by memory-mapped MNIST/CIFAR-10 files.
+ *
+ * pixels stay in the files as raw uint8 (1 byte per pixel instead of sizeof(float_t), and pages are
+ * loaded by OS on demand), and are converted into normalized and padded vec_t only when requested.
+ * conversion is same as parse_mnist_images/parse_cifar10, so that results are identical.
+ *
+ * network::train accepts image_dataset directly, and converts one mini-batch at a time.
+ *
+ * [example]
+ * image_dataset train_data = image_dataset::mnist("train-images.idx3-ubyte", "train-labels.idx1-ubyte", -1.0, 1.0, 2, 2);
+ * nn.train(train_data, minibatch_size, num_epochs);
+ **/
+class image_dataset {
+public:
+    typedef label_t label_type;
+
+    image_dataset() : size_(0), width_(0), height_(0), depth_(0), x_padding_(0), y_padding_(0) {}
+
+    /**
+     * MNIST images and labels (http://yann.lecun.com/exdb/mnist/)
+     * see parse_mnist_images for scale_min, scale_max, x_padding and y_padding.
+     **/
+    static image_dataset mnist(const std::string& image_file,
+                               const std::string& label_file,
+                               float_t scale_min,
+                               float_t scale_max,
+                               int x_padding,
+                               int y_padding) {
+        image_dataset d;
+        d.add_mnist(image_file, label_file, scale_min, scale_max, x_padding, y_padding);
+        return d;
+    }
+
+    /**
+     * CIFAR-10 binary version (https://www.cs.toronto.edu/~kriz/cifar.html).
+     * more files (e.g. data_batch_2.bin...) can be appended by add_cifar10.
+     * see parse_cifar10 for scale_min, scale_max, x_padding and y_padding.
+     **/
+    static image_dataset cifar10(const std::string& file,
+                                 float_t scale_min,
+                                 float_t scale_max,
+                                 int x_padding,
+                                 int y_padding) {
+        image_dataset d;
+        d.add_cifar10(file, scale_min, scale_max, x_padding, y_padding);
+        return d;
+    }
+
+    void add_mnist(const std::string& image_file,
+                   const std::string& label_file,
+                   float_t scale_min,
+                   float_t scale_max,
+                   int x_padding,
+                   int y_padding) {
+        check_scale(scale_min, scale_max, x_padding, y_padding);
+
+        std::shared_ptr<mapped_file> images = std::make_shared<mapped_file>(image_file);
+        std::shared_ptr<mapped_file> labels = std::make_shared<mapped_file>(label_file);
+
+        if (images->size() < 16 || read_be32(images->data()) != 0x00000803)
+            throw nn_error("MNIST image-file format error:" + image_file);
+        if (labels->size() < 8 || read_be32(labels->data()) != 0x00000801)
+            throw nn_error("MNIST label-file format error:" + label_file);
+
+        const size_t num = read_be32(images->data() + 4);
+        const size_t rows = read_be32(images->data() + 8);
+        const size_t cols = read_be32(images->data() + 12);
+
+        if (read_be32(labels->data() + 4) != num)
+            throw nn_error("number of MNIST images must be equal to labels");
+        if (images->size() < 16 + num * rows * cols || labels->size() < 8 + num)
+            throw nn_error("MNIST file is truncated");
+
+        // same arithmetic as detail::parse_mnist_image
+        float_t table[256];
+        for (int c = 0; c < 256; c++)
+            table[c] = (c / 255.0) * (scale_max - scale_min) + scale_min;
+
+        part p;
+        p.images = images;
+        p.labels = labels;
+        p.first_pixel = images->data() + 16;
+        p.first_label = labels->data() + 8;
+        p.pixel_stride = rows * cols;
+        p.label_stride = 1;
+        p.size = num;
+        add_part(p, cols, rows, 1, scale_min, x_padding, y_padding, table);
+    }
+
+    void add_cifar10(const std::string& file,
+                     float_t scale_min,
+                     float_t scale_max,
+                     int x_padding,
+                     int y_padding) {
+        check_scale(scale_min, scale_max, x_padding, y_padding);
+
+        std::shared_ptr<mapped_file> records = std::make_shared<mapped_file>(file);
+        const size_t record_size = CIFAR10_IMAGE_SIZE + 1; // label + pixels
+
+        // same arithmetic as parse_cifar10
+        float_t table[256];
+        for (int c = 0; c < 256; c++)
+            table[c] = scale_min + (scale_max - scale_min) * c / 255;
+
+        part p;
+        p.images = records;
+        p.first_pixel = records->data() + 1;
+        p.first_label = records->data();
+        p.pixel_stride = record_size;
+        p.label_stride = record_size;
+        p.size = records->size() / record_size;
+        add_part(p, CIFAR10_IMAGE_WIDTH, CIFAR10_IMAGE_HEIGHT, CIFAR10_IMAGE_DEPTH, scale_min, x_padding, y_padding, table);
+    }
+
+    ///< number of samples
+    size_t size() const { return size_; }
+
+    ///< dimension of each sample (including padding)
+    size_t sample_size() const { return (width_ + 2 * x_padding_) * (height_ + 2 * y_padding_) * depth_; }
+
+    label_t label(size_t index) const {
+        const part& p = find_part(index);
+        return static_cast<label_t>(p.first_label[(index - p.offset) * p.label_stride]);
+    }
+
+    ///< normalized and padded image of the sample
+    void image(size_t index, vec_t& dst) const {
+        const part& p = find_part(index);
+        const uint8_t* src = reinterpret_cast<const uint8_t*>(p.first_pixel + (index - p.offset) * p.pixel_stride);
+        const size_t w = width_ + 2 * x_padding_;
+        const size_t h = height_ + 2 * y_padding_;
+
+        dst.resize(w * h * depth_);
+        if (x_padding_ || y_padding_)
+            std::fill(dst.begin(), dst.end(), padding_value_);
+
+        for (size_t c = 0; c < depth_; c++)
+            for (size_t y = 0; y < height_; y++) {
+                const uint8_t* s = src + (c * height_ + y) * width_;
+                float_t* d = &dst[c * w * h + (y + y_padding_) * w + x_padding_];
+                for (size_t x = 0; x < width_; x++)
+                    d[x] = table_[s[x]];
+            }
+    }
+
+    /**
+     * convert samples order[first], ..., order[first+n-1] in parallel.
+     * images and labels are grown to at least n elements (never shrunk, so that buffers can be reused
+     * over mini-batches), and only the first n elements are overwritten.
+     **/
+    void get_batch(const std::vector<size_t>& order, size_t first, size_t n,
+                   std::vector<vec_t>* images, std::vector<label_t>* labels) const {
+        if (first + n > order.size()) throw nn_error("index out of range");
+        if (images->size() < n) images->resize(n);
+        if (labels->size() < n) labels->resize(n);
+
+        for_i(static_cast<int>(n), [&](int i) {
+            image(order[first + i], (*images)[i]);
+            (*labels)[i] = label(order[first + i]);
+        });
+    }
+
+private:
+    struct part {
+        part() : first_pixel(nullptr), first_label(nullptr), pixel_stride(0), label_stride(0), size(0), offset(0) {}
+
+        std::shared_ptr<mapped_file> images;
+        std::shared_ptr<mapped_file> labels; // empty if labels are stored with images
+        const char* first_pixel;
+        const char* first_label;
+        size_t pixel_stride; // bytes between images
+        size_t label_stride; // bytes between labels
+        size_t size;         // number of samples
+        size_t offset;       // index of the first sample in the dataset
+    };
+
+    static uint32_t read_be32(const char* p) {
+        const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+        return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+    }
+
+    static void check_scale(float_t scale_min, float_t scale_max, int x_padding, int y_padding) {
+        if (x_padding < 0 || y_padding < 0)
+            throw nn_error("padding size must not be negative");
+        if (scale_min >= scale_max)
+            throw nn_error("scale_max must be greater than scale_min");
+    }
+
+    void add_part(part p, size_t width, size_t height, size_t depth,
+                  float_t padding_value, int x_padding, int y_padding, const float_t* table) {
+        if (parts_.empty()) {
+            width_ = width;
+            height_ = height;
+            depth_ = depth;
+            x_padding_ = x_padding;
+            y_padding_ = y_padding;
+            padding_value_ = padding_value;
+            std::copy(table, table + 256, table_);
+        } else if (width_ != width || height_ != height || depth_ != depth ||
+                   x_padding_ != static_cast<size_t>(x_padding) || y_padding_ != static_cast<size_t>(y_padding) ||
+                   padding_value_ != padding_value || !std::equal(table, table + 256, table_)) {
+            throw nn_error("all files of dataset must have same image size and normalization");
+        }
+        p.offset = size_;
+        size_ += p.size;
+        parts_.push_back(p);
+    }
+
+    const part& find_part(size_t index) const {
+        if (index >= size_) throw nn_error("index out of range");
+        size_t i = parts_.size() - 1;
+        while (parts_[i].offset > index) i--;
+        return parts_[i];
+    }
+
+    std::vector<part> parts_;
+    size_t size_;
+    size_t width_;
+    size_t height_;
+    size_t depth_;
+    size_t x_padding_;
+    size_t y_padding_;
+    float_t padding_value_;
+    float_t table_[256]; // pixel value -> normalized value
+};
+
+/**
+ * dataset over samples already in memory (e.g. to train through async_dataset).
+ * vectors are referenced, not copied, and must outlive the dataset.
+ **/
+template <typename T = label_t>
+class memory_dataset {
+public:
+    typedef T label_type;
+
+    memory_dataset(const std::vector<vec_t>& in, const std::vector<T>& t) : in_(in), t_(t) {
+        if (in.size() != t.size())
+            throw nn_error("number of training data must be equal to label data");
+    }
+
+    size_t size() const { return in_.size(); }
+    size_t sample_size() const { return in_.empty() ? 0 : in_[0].size(); }
+
+    void get_batch(const std::vector<size_t>& order, size_t first, size_t n,
+                   std::vector<vec_t>* images, std::vector<T>* labels) const {
+        if (first + n > order.size()) throw nn_error("index out of range");
+        if (images->size() < n) images->resize(n);
+        if (labels->size() < n) labels->resize(n);
+
+        for (size_t i = 0; i < n; i++) {
+            const size_t index = order[first + i];
+            if (index >= size()) throw nn_error("index out of range");
+            (*images)[i] = in_[index];
+            (*labels)[i] = t_[index];
+        }
+    }
+
+private:
+    const std::vector<vec_t>& in_;
+    const std::vector<T>& t_;
+};
+
+} // namespace tiny_cnn
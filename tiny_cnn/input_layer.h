@@ -43,9 +43,18 @@ public:
     index3d<layer_size_t> out_shape() const override { return next_ ? next_->out_shape() : index3d<layer_size_t>(0, 0, 0); }
     std::string layer_type() const override { return next_ ? next_->layer_type() : "input"; }
 
+    // assign doesn't allocate once output_ has the size of in
     const vec_t& forward_propagation(const vec_t& in, size_t index) override {
-        output_[index] = in;
-        return next_ ? next_->forward_propagation(in, index) : output_[index];
+        output_[index].assign(in.begin(), in.end());
+        return forward_next(output_[index], index);
+    }
+
+    const vec_t& forward(const vec_t& in, layer_workspace& /*ws*/) const override {
+        return in;
+    }
+
+    const vec_t& forward_dense(const vec_t& in, index3d<layer_size_t>& /*shape*/, layer_workspace& /*ws*/) const override {
+        return in;
     }
 
     const vec_t& back_propagation(const vec_t& current_delta, size_t /*index*/) override {
@@ -56,6 +65,15 @@ public:
         return current_delta2;
     }
 
+    const vec_t& forward_batch(const vec_t& in, size_t /*batch_size*/) override {
+        batch_output_ = in;
+        return batch_output_;
+    }
+
+    const vec_t& backward_batch(const vec_t& current_delta, size_t /*batch_size*/) override {
+        return current_delta;
+    }
+
     size_t connection_size() const override {
         return in_size_;
     }
@@ -30,12 +30,28 @@
 #include <memory>
 #include "util.h"
 #include "product.h"
+#include "optimizer.h"
 #include "image.h"
 #include "activation_function.h"
 #include "weight_init.h"
+#include "profiler.h"
 
 namespace tiny_cnn {
 
+/**
+ * buffers of forward pass for one caller of layer_base::forward.
+ * layer itself is not modified by forward, so that one layer can be shared by many threads.
+ **/
+struct layer_workspace {
+    vec_t a;       // w * x
+    vec_t output;  // output of the layer
+    vec_t scratch; // layer specific buffer (e.g. im2col of convolutional layer)
+    vec_t channels; // channels at each position, used by activation which is not elementwise (see activate_map)
+};
+
+namespace detail {
+class batch_proxy_layer;
+} // namespace detail
 
 // base class of all kind of NN layers
 class layer_base {
@@ -45,7 +61,7 @@ public:
     virtual ~layer_base() {}
 
     layer_base(layer_size_t in_dim, layer_size_t out_dim, size_t weight_dim, size_t bias_dim)
-        : parallelize_(true), next_(nullptr), prev_(nullptr),
+        : parallelize_(true), frozen_(false), worker_size_(1), next_(nullptr), prev_(nullptr),
           weight_init_(std::make_shared<weight_init::xavier>()),
           bias_init_(std::make_shared<weight_init::constant>(0.0)) {
         set_size(in_dim, out_dim, weight_dim, bias_dim);
@@ -62,6 +78,35 @@ public:
         parallelize_ = parallelize;
     }
 
+    /**
+     * number of gradient replicas this layer can afford, i.e. max number of workers which can
+     * back-propagate concurrently. replicas of large layers are limited by CNN_GRADIENT_MEMORY.
+     **/
+    size_t max_worker_size() const {
+        const size_t bytes = (W_.size() + b_.size()) * sizeof(float_t);
+        if (bytes == 0) return CNN_TASK_SIZE;
+        return std::max<size_t>(1, std::min<size_t>(CNN_TASK_SIZE, CNN_GRADIENT_MEMORY / bytes));
+    }
+
+    /**
+     * allocate gradient replicas dW_/db_[0, worker_size), and release the others.
+     * back_propagation/backward_batch must be called with worker index less than worker_size.
+     **/
+    void set_worker_size(size_t worker_size) {
+        assert(worker_size >= 1 && worker_size <= CNN_TASK_SIZE);
+        worker_size_ = worker_size;
+
+        for (size_t i = 0; i < CNN_TASK_SIZE; i++) {
+            if (i < worker_size) {
+                dW_[i].resize(W_.size());
+                db_[i].resize(b_.size());
+            } else {
+                release(dW_[i]);
+                release(db_[i]);
+            }
+        }
+    }
+
     // cannot call from ctor because of pure virtual function call fan_in_size().
     // so should call this function explicitly after ctor
     void init_weight() {
@@ -85,9 +130,20 @@ public:
     const vec_t& delta(int worker_index) const { return prev_delta_[worker_index]; }
     vec_t& weight() { return W_; }
     vec_t& bias() { return b_; }
+    const vec_t& weight() const { return W_; }
+    const vec_t& bias() const { return b_; }
+    vec_t& weight_hessian() { return Whessian_; }
+    vec_t& bias_hessian() { return bhessian_; }
+    const vec_t& weight_hessian() const { return Whessian_; }
+    const vec_t& bias_hessian() const { return bhessian_; }
+    std::vector<vec_t>& weight_slots() { return Wslots_; }
+    std::vector<vec_t>& bias_slots() { return bslots_; }
+    const std::vector<vec_t>& weight_slots() const { return Wslots_; }
+    const std::vector<vec_t>& bias_slots() const { return bslots_; }
     vec_t& weight_diff(int index) { return dW_[index]; }
     vec_t& bias_diff(int index) { return db_[index]; }
     bool is_exploded() const { return has_infinite(W_) || has_infinite(b_); }
+    bool is_frozen() const { return frozen_; }
     layer_base* next() { return next_; }
     layer_base* prev() { return prev_; }
 
@@ -144,6 +200,19 @@ public:
         // for (auto bh : bhessian_) os << bh << " "; 
     }
 
+    /**
+     * let W_/b_ use external memory (e.g. memory-mapped model file) instead of own copy.
+     * w and b must hold weight().size() and bias().size() values, and owner keeps them alive while this layer exists.
+     **/
+    void attach_weights(float_t* w, float_t* b, std::shared_ptr<void> owner) {
+        vec_t W(W_.size(), aligned_allocator<float_t>(w, W_.size()));
+        vec_t B(b_.size(), aligned_allocator<float_t>(b, b_.size()));
+
+        W_.swap(W);
+        b_.swap(B);
+        weight_owner_ = owner;
+    }
+
     virtual void load(std::istream& is) {
         for (auto& w : W_) is >> w;
         for (auto& b : b_) is >> b;
@@ -184,6 +253,76 @@ public:
      **/
     virtual const vec_t& back_propagation_2nd(const vec_t& current_delta2) = 0;
 
+    /**
+     * forward pass of this layer only, for inference.
+     * unlike forward_propagation, all intermediate values are stored to ws instead of members,
+     * so it can be called concurrently. result is identical to forward_propagation.
+     **/
+    virtual const vec_t& forward(const vec_t& in, layer_workspace& ws) const {
+        CNN_UNREFERENCED_PARAMETER(in);
+        CNN_UNREFERENCED_PARAMETER(ws);
+        throw nn_error(layer_type() + " layer doesn't support concurrent forward");
+    }
+
+    ///< true if forward is implemented. otherwise network::test falls back to forward_propagation of each worker
+    virtual bool supports_forward() const { return false; }
+
+    /**
+     * dense (fully convolutional) inference of this layer only, used by network::predict_dense.
+     * in is a feature map of the given shape, which can be larger than in_shape(). the layer is slid
+     * over it as if applied to every patch, and shape is updated to the shape of the returned map.
+     * like forward, it can be called concurrently.
+     **/
+    virtual const vec_t& forward_dense(const vec_t& in, index3d<layer_size_t>& shape, layer_workspace& ws) const {
+        CNN_UNREFERENCED_PARAMETER(in);
+        CNN_UNREFERENCED_PARAMETER(shape);
+        CNN_UNREFERENCED_PARAMETER(ws);
+        throw nn_error(layer_type() + " layer doesn't support dense inference");
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // batched fprop/bprop
+    // unlike forward_propagation/back_propagation, these don't call next/prev layer.
+    // network calls them layer by layer with the whole mini-batch.
+
+    /**
+     * in holds batch_size input vectors back to back (batch_size x in_size()).
+     * return outputs of whole batch (batch_size x out_size()), which must be stored to batch_output_.
+     * default implementation calls forward_propagation for each sample.
+     **/
+    virtual const vec_t& forward_batch(const vec_t& in, size_t batch_size);
+
+    /**
+     * current_delta holds deltas of whole batch (batch_size x out_size()).
+     * return deltas of previous layer (batch_size x in_size()), which must be stored to batch_prev_delta_.
+     * gradients are accumulated to dW_/db_, and merged by update_weight as same as per-sample training.
+     * default implementation calls back_propagation for each sample, after restoring the state saved by forward_batch.
+     **/
+    virtual const vec_t& backward_batch(const vec_t& current_delta, size_t batch_size);
+
+    /**
+     * size (in bytes) of the per-sample state which back_propagation depends on besides the input
+     * (e.g. argmax of max-pooling, dropout mask). default forward_batch saves it for each sample,
+     * and default backward_batch restores it instead of running forward_propagation again.
+     **/
+    virtual size_t sample_state_size() const { return 0; }
+
+    virtual void save_sample_state(size_t worker_index, uint8_t* dst) const {
+        CNN_UNREFERENCED_PARAMETER(worker_index);
+        CNN_UNREFERENCED_PARAMETER(dst);
+    }
+
+    virtual void restore_sample_state(size_t worker_index, const uint8_t* src) {
+        CNN_UNREFERENCED_PARAMETER(worker_index);
+        CNN_UNREFERENCED_PARAMETER(src);
+    }
+
+    ///< outputs of the latest forward_batch
+    const vec_t& batch_output() const { return batch_output_; }
+
+    // called before forward_propagation of each training mini-batch, before workers are dispatched
+    virtual void pre_batch() {}
+
     // called afrer updating weight
     virtual void post_update() {}
 
@@ -191,15 +330,96 @@ public:
     void update_weight(Optimizer *o, int worker_size, size_t batch_size) {
         if (W_.empty()) return;
 
-        merge(worker_size, batch_size);
+        merge(dW_, worker_size, batch_size);
+        merge(db_, worker_size, batch_size);
 
-        o->update(dW_[0], Whessian_, W_);
-        o->update(db_[0], bhessian_, b_);
+        detail::update_weight(*o, dW_[0], Whessian_, W_, Wslots_, 0);
+        detail::update_weight(*o, db_[0], bhessian_, b_, bslots_, 0);
 
-        clear_diff(worker_size);
+        clear_diff(1); // other replicas are cleared by merge
         post_update();
     }
 
+    /**
+     * move W_/b_, their hessians, gradient replicas and optimizer slots into the arena at offset,
+     * keeping their values. offset is advanced past them (see layers::pack).
+     * owner keeps the arena alive while this layer views it
+     **/
+    void attach_arena(detail::parameter_arena& arena, size_t& offset, std::shared_ptr<void> owner) {
+        if (W_.empty()) return;
+
+        attach_tensor(arena, offset, W_, dW_, Whessian_, Wslots_);
+        attach_tensor(arena, offset, b_, db_, bhessian_, bslots_);
+        arena_ = owner;
+    }
+
+    // true if all tensors of this layer are views into the arena at offset. offset is advanced past them
+    bool is_attached(const detail::parameter_arena& arena, size_t& offset) const {
+        if (W_.empty()) return true;
+
+        return is_attached_tensor(arena, offset, W_, dW_, Whessian_, Wslots_) &&
+               is_attached_tensor(arena, offset, b_, db_, bhessian_, bslots_);
+    }
+
+    // number of elements this layer occupies in an arena
+    size_t arena_size() const {
+        if (W_.empty()) return 0;
+        return detail::parameter_arena::aligned_size(W_.size()) + detail::parameter_arena::aligned_size(b_.size());
+    }
+
+    size_t worker_size() const { return worker_size_; }
+
+    /**
+     * release all buffers used only for training (gradients, hessians, deltas and per-worker outputs).
+     * frozen layer keeps its weights, and can be used by forward(in, ws) only.
+     * layers holding their own training buffers should override this and call layer_base::freeze().
+     **/
+    virtual void freeze() {
+        for (auto& a : a_)          release(a);
+        for (auto& o : output_)     release(o);
+        for (auto& p : prev_delta_) release(p);
+        for (auto& dw : dW_)        release(dw);
+        for (auto& db : db_)        release(db);
+        release(Whessian_);
+        release(bhessian_);
+        release(Wslots_);
+        release(bslots_);
+        release(prev_delta2_);
+        release(batch_output_);
+        release(batch_prev_delta_);
+        release(batch_state_);
+        batch_proxy_.reset();
+        if (arena_) {
+            // own copy of weights, so that training buffers in the arena are freed with it
+            vec_t W(W_.begin(), W_.end()), b(b_.begin(), b_.end());
+            W_.swap(W);
+            b_.swap(b);
+            arena_.reset();
+        }
+        frozen_ = true;
+    }
+
+    ///< bytes of heap memory held by this layer
+    virtual size_t memory_usage() const {
+        size_t size = memory_size(W_) + memory_size(b_) + memory_size(Whessian_) + memory_size(bhessian_) +
+                      memory_size(prev_delta2_) + memory_size(batch_output_) + memory_size(batch_prev_delta_) +
+                      memory_size(batch_state_) + memory_size(Wslots_) + memory_size(bslots_);
+
+        for (int i = 0; i < CNN_TASK_SIZE; i++)
+            size += memory_size(a_[i]) + memory_size(output_[i]) + memory_size(prev_delta_[i]) +
+                    memory_size(dW_[i]) + memory_size(db_[i]);
+        return size;
+    }
+
+    /**
+     * reset state of optimizer to zero, as if it were re-initialized by next update_weight.
+     * memory is kept (slots may be views into the arena), so that next update doesn't repack layers
+     **/
+    void clear_slots() {
+        for (auto& s : Wslots_) std::fill(s.begin(), s.end(), float_t(0));
+        for (auto& s : bslots_) std::fill(s.begin(), s.end(), float_t(0));
+    }
+
     bool has_same_weights(const layer_base& rhs, float_t eps) const {
         if (W_.size() != rhs.W_.size() || b_.size() != rhs.b_.size())
             return false;
@@ -212,10 +432,41 @@ public:
         return true;
     }
 
+#ifdef CNN_USE_PROFILER
+    ///< timings recorded while training (see network::print_profile)
+    layer_profile& profile() { return profile_; }
+    const layer_profile& profile() const { return profile_; }
+
+    ///< estimated floating point operations per sample (per call for update)
+    double estimated_flops(profile_phase phase) const {
+        const double connections = static_cast<double>(connection_size());
+        switch (phase) {
+        case profile_phase::forward:      return 2.0 * connections;
+        case profile_phase::backward:     return 4.0 * connections; // delta of previous layer and dW
+        case profile_phase::backward_2nd: return 4.0 * connections;
+        default:                          return 2.0 * param_size();
+        }
+    }
+
+    ///< estimated bytes read or written per sample (per call for update)
+    double estimated_bytes(profile_phase phase) const {
+        const double io = static_cast<double>(in_size()) + out_size();
+        const double params = static_cast<double>(param_size());
+        switch (phase) {
+        case profile_phase::forward:      return sizeof(float_t) * (io + params);
+        case profile_phase::backward:     return sizeof(float_t) * (io + in_size() + 2.0 * params);
+        case profile_phase::backward_2nd: return sizeof(float_t) * (io + in_size() + 2.0 * params);
+        default:                          return sizeof(float_t) * 3.0 * params;
+        }
+    }
+#endif
+
 protected:
     layer_size_t in_size_;
     layer_size_t out_size_;
     bool parallelize_;
+    bool frozen_;
+    size_t worker_size_; // number of gradient replicas (see set_worker_size)
 
     layer_base* next_;
     layer_base* prev_;
@@ -224,24 +475,147 @@ protected:
     vec_t prev_delta_[CNN_TASK_SIZE]; // last delta of previous layer, set by bprop
     vec_t W_;          // weight vector
     vec_t b_;          // bias vector
-    vec_t dW_[CNN_TASK_SIZE];
+    vec_t dW_[CNN_TASK_SIZE]; // gradient replica for each worker. only [0, worker_size_) are allocated
     vec_t db_[CNN_TASK_SIZE];
 
     vec_t Whessian_; // diagonal terms of hessian matrix
     vec_t bhessian_;
+    std::vector<vec_t> Wslots_; // per-weight state of optimizer (see stateful_optimizer), allocated by first update
+    std::vector<vec_t> bslots_;
     vec_t prev_delta2_; // d^2E/da^2
     std::shared_ptr<weight_init::function> weight_init_;
     std::shared_ptr<weight_init::function> bias_init_;
+    std::shared_ptr<void> weight_owner_; // keeps external memory of W_/b_ alive (see attach_weights)
+    std::shared_ptr<void> arena_;        // keeps parameter arena alive (see attach_arena)
+
+    vec_t batch_output_;     // outputs of whole batch, set by forward_batch
+    vec_t batch_prev_delta_; // deltas of previous layer for whole batch, set by backward_batch
+    std::vector<uint8_t> batch_state_; // per-sample state of whole batch (see sample_state_size), set by forward_batch
+    std::shared_ptr<detail::batch_proxy_layer> batch_proxy_; // sample buffers of default forward_batch/backward_batch
+#ifdef CNN_USE_PROFILER
+    layer_profile profile_;
+#endif
+
+    // pass output of this layer to the next layer (or return it if this is the last layer)
+    const vec_t& forward_next(const vec_t& out, size_t index) {
+#ifdef CNN_USE_PROFILER
+        hand_over(profile_phase::forward, next_, index);
+#endif
+        return next_ ? next_->forward_propagation(out, index) : out;
+    }
+
+    // pass delta of previous layer to the previous layer
+    const vec_t& backward_prev(const vec_t& prev_delta, size_t index) {
+#ifdef CNN_USE_PROFILER
+        hand_over(profile_phase::backward, prev_, index);
+#endif
+        return prev_->back_propagation(prev_delta, index);
+    }
+
+    const vec_t& backward_prev_2nd(const vec_t& prev_delta2) {
+#ifdef CNN_USE_PROFILER
+        hand_over(profile_phase::backward_2nd, prev_, 0);
+#endif
+        return prev_->back_propagation_2nd(prev_delta2);
+    }
+
+    // delta[i] *= h.df(y[i]) for i in [0, size), where h is activation of previous layer
+    void apply_df(const activation::function& h, const float_t* y, float_t* delta, size_t size) const {
+        for_blocks(parallelize_, size, 4096, [&](const blocked_range& r) {
+            h.df_vec(y + r.begin(), delta + r.begin(), r.end() - r.begin());
+        });
+    }
+
+    detail::batch_proxy_layer& batch_proxy();
+
+    // call f(sample, worker_index) for all samples, each worker takes contiguous range of the batch
+    template <typename Func>
+    void for_each_sample(size_t batch_size, Func f) {
+        const int num_tasks = static_cast<int>(std::min(batch_size, worker_size_));
+        task_group g;
+
+        for (int i = 0; i < num_tasks; i++) {
+            const size_t begin = batch_size * i / num_tasks;
+            const size_t end = batch_size * (i + 1) / num_tasks;
+
+            // f outlives the tasks (g.wait), so it is captured by reference to keep the task small
+            g.run([&f, begin, end, i] {
+                for (size_t n = begin; n < end; n++) f(n, i);
+            });
+        }
+        g.wait();
+    }
 
 private:
-    void merge(size_t worker_size, size_t batch_size) {
-        for (size_t i = 1; i < worker_size; i++)
-            vectorize::reduce<float_t>(&dW_[i][0], dW_[i].size(), &dW_[0][0]);
-        for (size_t i = 1; i < worker_size; i++)
-            vectorize::reduce<float_t>(&db_[i][0], db_[i].size(), &db_[0][0]);
+#ifdef CNN_USE_PROFILER
+    // one clock read per layer boundary: stops this layer and starts the neighbour
+    void hand_over(profile_phase phase, layer_base* to, size_t index) {
+        const layer_profile::clock::time_point now = layer_profile::clock::now();
+        profile_.stop(phase, index, now);
+        if (to) to->profile_.start(index, now);
+    }
+#endif
+
+    enum { merge_block_size = 4096 }; // number of gradients reduced by one task in merge
+
+    /**
+     * diff[0] = sum(diff[0, worker_size)) / batch_size, and clear diff[1, worker_size).
+     * each task owns a range of gradients and reduces all replicas of the range,
+     * so the reduction runs in parallel without synchronization.
+     **/
+    static void merge(vec_t* diff, size_t worker_size, size_t batch_size) {
+        for_blocks(true, diff[0].size(), merge_block_size, [&](const blocked_range& r) {
+            const size_t size = r.end() - r.begin();
+            float_t* dst = &diff[0][r.begin()];
+
+            for (size_t i = 1; i < worker_size; i++) {
+                vectorize::reduce<float_t>(&diff[i][r.begin()], size, dst);
+                std::fill(&diff[i][r.begin()], &diff[i][r.begin()] + size, float_t(0));
+            }
+            for (size_t j = 0; j < size; j++)
+                dst[j] /= batch_size;
+        });
+    }
+
+    // let v view [dst, dst + v.size()), keeping its values
+    static void move_to(vec_t& v, float_t* dst) {
+        std::copy(v.begin(), v.end(), dst);
+        vec_t view(v.size(), aligned_allocator<float_t>(dst, v.size()));
+        v.swap(view);
+    }
+
+    static bool is_view(const vec_t& v, const vec_t& arena, size_t offset) {
+        return v.empty() || (offset + v.size() <= arena.size() && v.data() == &arena[offset]);
+    }
 
-        std::transform(dW_[0].begin(), dW_[0].end(), dW_[0].begin(), [&](float_t x) { return x / batch_size; });
-        std::transform(db_[0].begin(), db_[0].end(), db_[0].begin(), [&](float_t x) { return x / batch_size; });
+    void attach_tensor(detail::parameter_arena& arena, size_t& offset, vec_t& W, vec_t* dW, vec_t& H, std::vector<vec_t>& slots) {
+        if (W.empty()) return;
+
+        detail::prepare_slots(slots, arena.num_slots, W.size());
+
+        move_to(W, &arena.params[offset]);
+        if (H.size() == W.size()) move_to(H, &arena.hessian[offset]);
+        for (size_t i = 0; i < arena.worker_size; i++)
+            if (dW[i].size() == W.size()) move_to(dW[i], &arena.grads[i][offset]);
+        for (int k = 0; k < arena.num_slots; k++)
+            move_to(slots[k], &arena.slots[k][offset]);
+
+        offset += detail::parameter_arena::aligned_size(W.size());
+    }
+
+    bool is_attached_tensor(const detail::parameter_arena& arena, size_t& offset,
+                            const vec_t& W, const vec_t* dW, const vec_t& H, const std::vector<vec_t>& slots) const {
+        if (W.empty()) return true;
+
+        bool attached = is_view(W, arena.params, offset) && is_view(H, arena.hessian, offset) &&
+                        slots.size() == static_cast<size_t>(arena.num_slots);
+        for (size_t i = 0; i < worker_size_; i++)
+            attached = attached && i < arena.worker_size && is_view(dW[i], arena.grads[i], offset);
+        for (size_t k = 0; k < slots.size(); k++)
+            attached = attached && slots[k].size() == W.size() && is_view(slots[k], arena.slots[k], offset);
+
+        offset += detail::parameter_arena::aligned_size(W.size());
+        return attached;
     }
 
     void clear_diff(size_t worker_size) {
@@ -265,8 +639,8 @@ private:
             for (auto& o : output_)     o.resize(out_dim);
             for (auto& a : a_)          a.resize(out_dim);
             for (auto& p : prev_delta_) p.resize(in_dim);
-            for (auto& dw : dW_) dw.resize(weight_dim);
-            for (auto& db : db_) db.resize(bias_dim);
+            dW_[0].resize(weight_dim); // other replicas are allocated by set_worker_size
+            db_[0].resize(bias_dim);
         } catch (const std::bad_alloc&) {
             throw nn_error(
                 format_str("memory allocation failed: layer size too large!\nin:%d,out:%d,weights:%d,biases:%d",
@@ -283,9 +657,143 @@ public:
 
     activation::function& activation_function() override { return h_; }
 protected:
+    // out[n] = h(a[n]) for each of batch_size vectors of dim elements (a and out can be the same buffer)
+    void activate_batch(const float_t* a, float_t* out, size_t batch_size, size_t dim) {
+        for_(parallelize_, 0, batch_size, [&](const blocked_range& r) {
+            for (int n = r.begin(); n < r.end(); n++)
+                h_.f_vec(a + n * dim, out + n * dim, dim);
+        }, 1);
+    }
+
+    // out = h(a) for feature map of the given shape ([channel][y][x]).
+    // activation which is not elementwise (e.g. softmax) is applied across channels at each position
+    void activate_map(const vec_t& a, vec_t& out, const index3d<layer_size_t>& shape, layer_workspace& ws) const {
+        const size_t area = size_t(shape.width_) * shape.height_;
+        const size_t depth = shape.depth_;
+
+        if (h_.elementwise() || area == 1) {
+            for_blocks(parallelize_, a.size(), 4096, [&](const blocked_range& r) {
+                h_.f_vec(&a[r.begin()], &out[r.begin()], r.end() - r.begin());
+            });
+            return;
+        }
+
+        // each task gathers channels of a position to its own slice of ws.channels
+        const size_t block = 64;
+        ws.channels.resize(2 * depth * ((area + block - 1) / block));
+
+        for_blocks(parallelize_, area, block, [&](const blocked_range& r) {
+            float_t* x = &ws.channels[2 * depth * (r.begin() / block)];
+            float_t* y = x + depth;
+            for (int i = r.begin(); i < r.end(); i++) {
+                for (size_t c = 0; c < depth; c++) x[c] = a[c * area + i];
+                h_.f_vec(x, y, depth);
+                for (size_t c = 0; c < depth; c++) out[c * area + i] = y[c];
+            }
+        });
+    }
+
     Activation h_;
 };
 
+namespace detail {
+
+// stands in for the previous layer while a layer is processed sample by sample in batch mode:
+// output(i) is one sample of the previous layer's batch output, and back_propagation stops here.
+// it also holds the delta of the sample, so that buffers of each worker are reused across batches
+class batch_proxy_layer : public layer_base {
+public:
+    explicit batch_proxy_layer(layer_base* target)
+        : layer_base(0, 0, 0, 0), target_(target) {}
+
+    layer_base* target() const { return target_; }
+
+    const vec_t& set_output(size_t worker_index, const float_t* first, size_t size) {
+        output_[worker_index].assign(first, first + size);
+        return output_[worker_index];
+    }
+
+    const vec_t& set_delta(size_t worker_index, const float_t* first, size_t size) {
+        delta_[worker_index].assign(first, first + size);
+        return delta_[worker_index];
+    }
+
+    layer_size_t in_size() const override { return target_->in_size(); }
+    layer_size_t out_size() const override { return target_->out_size(); }
+    index3d<layer_size_t> in_shape() const override { return target_->in_shape(); }
+    index3d<layer_size_t> out_shape() const override { return target_->out_shape(); }
+    std::string layer_type() const override { return target_->layer_type(); }
+    activation::function& activation_function() override { return target_->activation_function(); }
+
+    size_t fan_in_size() const override { return 1; }
+    size_t fan_out_size() const override { return 1; }
+    size_t connection_size() const override { return 0; }
+
+    const vec_t& forward_propagation(const vec_t& in, size_t /*index*/) override { return in; }
+    const vec_t& back_propagation(const vec_t& current_delta, size_t /*index*/) override { return current_delta; }
+    const vec_t& back_propagation_2nd(const vec_t& current_delta2) override { return current_delta2; }
+
+private:
+    layer_base* target_;
+    vec_t delta_[CNN_TASK_SIZE];
+};
+
+} // namespace detail
+
+// proxy of prev_ owned by this layer (re-created if this layer is connected to another layer)
+inline detail::batch_proxy_layer& layer_base::batch_proxy() {
+    if (!batch_proxy_ || batch_proxy_->target() != prev_)
+        batch_proxy_ = std::make_shared<detail::batch_proxy_layer>(prev_);
+    return *batch_proxy_;
+}
+
+inline const vec_t& layer_base::forward_batch(const vec_t& in, size_t batch_size) {
+    const size_t in_dim = in_size(), out_dim = out_size();
+    const size_t state_size = sample_state_size();
+    detail::batch_proxy_layer& proxy = batch_proxy();
+    layer_base* next = next_;
+
+    batch_output_.resize(batch_size * out_dim);
+    batch_state_.resize(batch_size * state_size);
+    next_ = nullptr; // stop forward_propagation at this layer
+
+    for_each_sample(batch_size, [&](size_t n, int worker) {
+        const vec_t& x = proxy.set_output(worker, &in[n * in_dim], in_dim);
+        const vec_t& out = forward_propagation(x, worker);
+        std::copy(out.begin(), out.end(), &batch_output_[n * out_dim]);
+        if (state_size) save_sample_state(worker, &batch_state_[n * state_size]);
+    });
+
+    next_ = next;
+    return batch_output_;
+}
+
+inline const vec_t& layer_base::backward_batch(const vec_t& current_delta, size_t batch_size) {
+    const size_t in_dim = in_size(), out_dim = out_size();
+    const size_t state_size = sample_state_size();
+    const vec_t& prev_out = prev_->batch_output();
+    detail::batch_proxy_layer& proxy = batch_proxy();
+    layer_base* prev = prev_;
+    layer_base* next = next_;
+
+    batch_prev_delta_.resize(batch_size * in_dim);
+    prev_ = &proxy;
+    next_ = nullptr;
+
+    for_each_sample(batch_size, [&](size_t n, int worker) {
+        proxy.set_output(worker, &prev_out[n * in_dim], in_dim);
+        if (state_size) restore_sample_state(worker, &batch_state_[n * state_size]);
+
+        const vec_t& delta = proxy.set_delta(worker, &current_delta[n * out_dim], out_dim);
+        const vec_t& d = back_propagation(delta, worker);
+        std::copy(d.begin(), d.end(), &batch_prev_delta_[n * in_dim]);
+    });
+
+    prev_ = prev;
+    next_ = next;
+    return batch_prev_delta_;
+}
+
 template <typename Char, typename CharTraits>
 std::basic_ostream<Char, CharTraits>& operator << (std::basic_ostream<Char, CharTraits>& os, const layer_base& v) {
     v.save(os);
@@ -327,6 +835,18 @@ inline void data_mismatch(const layer_base& layer, const vec_t& data) {
     throw nn_error("input dimension mismath!" + detail_info);
 }
 
+inline void dense_shape_mismatch(const layer_base& layer, const index3d<layer_size_t>& shape) {
+    std::ostringstream os;
+
+    os << std::endl;
+    os << "feature map:   " << shape << std::endl;
+    os << "layer input:   " << layer.in_size() << "(" << layer.layer_type() << ":" << layer.in_shape() << ")" << std::endl;
+
+    std::string detail_info = os.str();
+
+    throw nn_error("feature map is smaller than the window of layer, or has different channels" + detail_info);
+}
+
 inline void pooling_size_mismatch(layer_size_t in_width, layer_size_t in_height, layer_size_t pooling_size) {
     std::ostringstream os;
 
@@ -339,4 +859,34 @@ inline void pooling_size_mismatch(layer_size_t in_width, layer_size_t in_height,
     throw nn_error("width/height must be multiples of pooling size" + detail_info);
 }
 
+// number of pooling windows along an axis, or 0 if the window doesn't fit
+inline layer_size_t pooled_length(layer_size_t in_length, layer_size_t pooling_size, layer_size_t stride) {
+    return (stride == 0 || in_length < pooling_size) ? 0 : (in_length - pooling_size) / stride + 1;
+}
+
+// max number of windows along an axis which share an input
+inline layer_size_t pooling_overlap(layer_size_t pooling_size, layer_size_t stride, layer_size_t out_length) {
+    return std::min((pooling_size + stride - 1) / stride, out_length);
+}
+
+// windows of pooling_size at stride must cover width/height without remainders
+inline void check_pooling_size(layer_size_t in_width, layer_size_t in_height, layer_size_t pooling_size, layer_size_t stride) {
+    auto fits = [&](layer_size_t length) {
+        return stride > 0 && length >= pooling_size && (length - pooling_size) % stride == 0;
+    };
+    if (fits(in_width) && fits(in_height)) return;
+    if (stride == pooling_size) pooling_size_mismatch(in_width, in_height, pooling_size);
+
+    std::ostringstream os;
+
+    os << std::endl;
+    os << "WxH:" << in_width << "x" << in_height << std::endl;
+    os << "pooling-size:" << pooling_size << std::endl;
+    os << "stride:" << stride << std::endl;
+
+    std::string detail_info = os.str();
+
+    throw nn_error("width/height minus pooling size must be multiples of stride" + detail_info);
+}
+
 } // namespace tiny_cnn
@@ -38,6 +38,7 @@ public:
 
     layers& operator = (const layers& rhs) {
         layers_.clear();
+        arena_.reset();
         construct(rhs);
         return *this;
     }
@@ -74,6 +75,7 @@ public:
     }
 
     bool is_exploded() const {
+        if (packed()) return has_infinite(arena_->params);
         for (auto pl : layers_)
             if (pl->is_exploded()) return true;
         return false;
@@ -84,10 +86,14 @@ public:
             pl->divide_hessian(denominator);
     }
 
+    /**
+     * merge gradients of workers and update weights of all layers.
+     * if the optimizer provides its kernel (see stateful_optimizer), all weights are updated
+     * by a single parallel sweep over the flattened parameter view. otherwise layer by layer
+     **/
     template <typename Optimizer>
     void update_weights(Optimizer *o, size_t worker_size, size_t batch_size) {
-        for (auto pl : layers_)
-            pl->update_weight(o, worker_size, batch_size);
+        update_weights(o, worker_size, batch_size, 0);
     }
     
     void set_parallelize(bool parallelize) {
@@ -95,12 +101,127 @@ public:
             pl->set_parallelize(parallelize);
     }
 
+    // max number of workers all layers can afford (see layer_base::max_worker_size)
+    size_t max_worker_size() const {
+        size_t size = CNN_TASK_SIZE;
+        for (auto pl : layers_)
+            size = std::min(size, pl->max_worker_size());
+        return size;
+    }
+
+    void set_worker_size(size_t worker_size) {
+        for (auto pl : layers_)
+            pl->set_worker_size(worker_size);
+    }
+
+    void freeze() {
+        for (auto pl : layers_)
+            pl->freeze();
+    }
+
+    void pre_batch() {
+        for (auto pl : layers_)
+            pl->pre_batch();
+    }
+
+    void clear_slots() {
+        for (auto pl : layers_)
+            pl->clear_slots();
+    }
+
+    size_t memory_usage() const {
+        size_t size = 0;
+        for (auto pl : layers_)
+            size += pl->memory_usage();
+        return size;
+    }
+
+    /**
+     * move parameters of all layers into one aligned arena per kind (see detail::parameter_arena),
+     * with num_slots optimizer slots for each weight.
+     * called by update_weights whenever layers are not packed yet (e.g. before first update,
+     * or after set_worker_size, load of a checkpoint or reset of optimizer)
+     **/
+    void pack(int num_slots) {
+        size_t size = 0, worker_size = 1;
+        for (auto pl : layers_) {
+            size += pl->arena_size();
+            worker_size = std::max(worker_size, pl->worker_size());
+        }
+
+        auto arena = std::make_shared<detail::parameter_arena>();
+        arena->worker_size = worker_size;
+        arena->num_slots = num_slots;
+        arena->params.resize(size);
+        arena->hessian.resize(size);
+        for (size_t i = 0; i < worker_size; i++) arena->grads[i].resize(size);
+        for (int k = 0; k < num_slots; k++) arena->slots[k].resize(size);
+
+        size_t offset = 0;
+        for (auto pl : layers_)
+            pl->attach_arena(*arena, offset, arena);
+        arena_ = arena;
+    }
+
+    // true if all layers are views into the arena of the last pack
+    bool packed() const {
+        if (!arena_) return false;
+
+        size_t offset = 0;
+        for (auto pl : layers_)
+            if (!pl->is_attached(*arena_, offset)) return false;
+        return offset == arena_->params.size();
+    }
+
     // get depth(number of layers) of networks
     size_t depth() const {
         return layers_.size() - 1; // except input-layer
     }
 
 private:
+    template <typename Optimizer>
+    auto update_weights(Optimizer *o, size_t worker_size, size_t batch_size, int)
+        -> decltype(o->bind(nullptr, nullptr, nullptr), void()) {
+        if (!packed() || arena_->num_slots != o->num_slots() || arena_->worker_size < worker_size)
+            pack(o->num_slots());
+
+        // whole network is a single segment of the arena
+        params_.resize(1);
+        detail::param_segment& seg = params_[0];
+        seg.offset = 0;
+        seg.size = arena_->params.size();
+        seg.W = arena_->params.data();
+        for (size_t i = 0; i < CNN_TASK_SIZE; i++)
+            seg.dW[i] = i < arena_->worker_size ? arena_->grads[i].data() : nullptr;
+        seg.slots = arena_->slots;
+        if (seg.size == 0) params_.clear();
+
+#ifdef CNN_USE_PROFILER
+        const auto started = layer_profile::clock::now();
+#endif
+        detail::fused_update(*o, params_, worker_size, batch_size);
+
+#ifdef CNN_USE_PROFILER
+        // time of the sweep is shared by layers in proportion to their number of parameters
+        const double seconds = std::chrono::duration<double>(layer_profile::clock::now() - started).count();
+        for (auto pl : layers_) {
+            const size_t size = pl->arena_size();
+            if (size > 0) pl->profile().add(profile_phase::update, 0, seconds * size / arena_->params.size(), 1);
+        }
+#endif
+        for (auto pl : layers_)
+            if (!pl->weight().empty()) pl->post_update();
+    }
+
+    template <typename Optimizer>
+    void update_weights(Optimizer *o, size_t worker_size, size_t batch_size, long) {
+        o->begin_step(); // once per mini-batch, as fused_update does
+        for (auto pl : layers_) {
+            CNN_PROFILE_SCOPE(pl, profile_phase::update, 1);
+            pl->update_weight(o, worker_size, batch_size);
+        }
+    }
+
     void construct(const layers& rhs) {
         add(std::make_shared<input_layer>());
         for (size_t i = 1; i < rhs.layers_.size(); i++)
@@ -108,6 +229,8 @@ private:
     }
 
     std::vector<std::shared_ptr<layer_base>> layers_;
+    std::shared_ptr<detail::parameter_arena> arena_; // see pack
+    std::vector<detail::param_segment> params_;      // view of arena_ passed to fused_update
 };
 
 } // namespace tiny_cnn
@@ -0,0 +1,119 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <string>
+#include "util.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace tiny_cnn {
+
+/**
+ * read-only file mapped into memory.
+ * pages are mapped copy-on-write: they are shared with other processes through the page cache,
+ * and become private only if written (e.g. training a network which uses mapped weights).
+ **/
+class mapped_file {
+public:
+    explicit mapped_file(const std::string& path) : data_(nullptr), size_(0) {
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_ == INVALID_HANDLE_VALUE) throw nn_error("failed to open " + path);
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size)) {
+            CloseHandle(file_);
+            throw nn_error("failed to get size of " + path);
+        }
+        size_ = static_cast<size_t>(size.QuadPart);
+
+        mapping_ = CreateFileMappingA(file_, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping_ == NULL) {
+            CloseHandle(file_);
+            throw nn_error("failed to map " + path);
+        }
+        data_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0));
+        if (data_ == NULL) {
+            CloseHandle(mapping_);
+            CloseHandle(file_);
+            throw nn_error("failed to map " + path);
+        }
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw nn_error("failed to open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw nn_error("failed to get size of " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+
+        void* p = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd); // mapping stays valid after closing descriptor
+        if (p == MAP_FAILED) throw nn_error("failed to map " + path);
+        data_ = static_cast<char*>(p);
+#endif
+    }
+
+    ~mapped_file() {
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+        CloseHandle(file_);
+#else
+        munmap(data_, size_);
+#endif
+    }
+
+    char* data() { return data_; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    mapped_file(const mapped_file&);
+    mapped_file& operator = (const mapped_file&);
+
+    char* data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
+
+} // namespace tiny_cnn
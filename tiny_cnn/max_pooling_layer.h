@@ -25,8 +25,9 @@
     SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #pragma once
+#include <cstdint>
 #include "util.h"
-#include "partial_connected_layer.h"
+#include "layer.h"
 #include "activation_function.h"
 #include "image.h"
 
@@ -39,47 +40,86 @@ public:
     typedef layer<Activation> Base;
 
     max_pooling_layer(layer_size_t in_width, layer_size_t in_height, layer_size_t in_channels, layer_size_t pooling_size)
+        : max_pooling_layer(in_width, in_height, in_channels, pooling_size, pooling_size) {}
+
+    /**
+     * @param stride [in] distance between windows. windows overlap if stride < pooling_size
+     **/
+    max_pooling_layer(layer_size_t in_width, layer_size_t in_height, layer_size_t in_channels, layer_size_t pooling_size, layer_size_t stride)
         : Base(in_width * in_height * in_channels,
-        in_width * in_height * in_channels / sqr(pooling_size),
+        pooled_length(in_width, pooling_size, stride) * pooled_length(in_height, pooling_size, stride) * in_channels,
         0, 0),
         pool_size_(pooling_size),
+        stride_(stride),
         in_(in_width, in_height, in_channels),
-        out_(in_width / pooling_size, in_height / pooling_size, in_channels)
+        out_(pooled_length(in_width, pooling_size, stride), pooled_length(in_height, pooling_size, stride), in_channels)
     {
-        if ((in_width % pooling_size) || (in_height % pooling_size))
-            pooling_size_mismatch(in_width, in_height, pooling_size);
+        check_pooling_size(in_width, in_height, pooling_size, stride);
+        if (sqr(pooling_size) > 256)
+            throw nn_error("pooling size must be 16 or less (argmax is kept as 8-bit offset in window)");
 
-        init_connection(pooling_size);
+        for (auto& m : argmax_) m.resize(out_.size());
     }
 
     size_t fan_in_size() const override {
-        return out2in_[0].size();
+        return sqr(pool_size_);
     }
 
     size_t fan_out_size() const override {
-        return 1;
+        return pooling_overlap(pool_size_, stride_, out_.width_) * pooling_overlap(pool_size_, stride_, out_.height_);
     }
 
     size_t connection_size() const override {
-        return out2in_[0].size() * out2in_.size();
+        return sqr(pool_size_) * out_.size();
     }
 
     virtual const vec_t& forward_propagation(const vec_t& in, size_t index) override {
-        for_(parallelize_, 0, out_size_, [&](const blocked_range& r) {
-            for (int i = r.begin(); i < r.end(); i++) {
-                const auto& in_index = out2in_[i];
-                float_t max_value = std::numeric_limits<float_t>::lowest();
-                
-                for (auto j : in_index) {
-                    if (in[j] > max_value) {
-                        max_value = in[j];
-                        out2inmax_[i] = j;
-                    }
-                }
-                output_[index][i] = max_value;
-            }
-        });
-        return next_ ? next_->forward_propagation(output_[index], index) : output_[index];
+        fprop(&in[0], in_, out_, &output_[index][0], &argmax_[index][0]);
+        return forward_next(output_[index], index);
+    }
+
+    bool supports_forward() const override { return true; }
+
+    const vec_t& forward(const vec_t& in, layer_workspace& ws) const override {
+        ws.output.resize(out_size_);
+        fprop(&in[0], in_, out_, &ws.output[0], nullptr);
+        return ws.output;
+    }
+
+    // the map is pooled at the same stride as patches; remainders are dropped
+    const vec_t& forward_dense(const vec_t& in, index3d<layer_size_t>& shape, layer_workspace& ws) const override {
+        if (shape.depth_ != in_.depth_ || shape.width_ < pool_size_ || shape.height_ < pool_size_)
+            dense_shape_mismatch(*this, shape);
+
+        const index3d<layer_size_t> out(pooled_length(shape.width_, pool_size_, stride_),
+                                        pooled_length(shape.height_, pool_size_, stride_), shape.depth_);
+        ws.output.resize(out.size());
+
+        fprop(&in[0], shape, out, &ws.output[0], nullptr);
+
+        shape = out;
+        return ws.output;
+    }
+
+    size_t sample_state_size() const override { return out_.size(); }
+
+    void save_sample_state(size_t worker_index, uint8_t* dst) const override {
+        std::copy(argmax_[worker_index].begin(), argmax_[worker_index].end(), dst);
+    }
+
+    void restore_sample_state(size_t worker_index, const uint8_t* src) override {
+        std::copy(src, src + out_.size(), argmax_[worker_index].begin());
+    }
+
+    void freeze() override {
+        Base::freeze();
+        for (auto& m : argmax_) release(m);
+    }
+
+    size_t memory_usage() const override {
+        size_t size = Base::memory_usage();
+        for (auto& m : argmax_) size += memory_size(m);
+        return size;
     }
 
     virtual const vec_t& back_propagation(const vec_t& current_delta, size_t index) override {
@@ -87,24 +127,21 @@ public:
         const activation::function& prev_h = prev_->activation_function();
         vec_t& prev_delta = prev_delta_[index];
 
-        for_(parallelize_, 0, in_size_, [&](const blocked_range& r) {
-            for (int i = r.begin(); i != r.end(); i++) {
-                int outi = in2out_[i];
-                prev_delta[i] = (out2inmax_[outi] == i) ? current_delta[outi] * prev_h.df(prev_out[i]) : 0.0;
-            }
-        });
-        return prev_->back_propagation(prev_delta_[index], index);
+        bprop(&current_delta[0], &argmax_[index][0], &prev_delta[0]);
+
+        prev_h.df_vec(&prev_out[0], &prev_delta[0], in_size_);
+        return backward_prev(prev_delta_[index], index);
     }
 
     const vec_t& back_propagation_2nd(const vec_t& current_delta2) override {
         const vec_t& prev_out = prev_->output(0);
         const activation::function& prev_h = prev_->activation_function();
 
-        for (int i = 0; i < in_size_; i++) {
-            int outi = in2out_[i];
-            prev_delta2_[i] = (out2inmax_[outi] == i) ? current_delta2[outi] * sqr(prev_h.df(prev_out[i])) : 0.0;
-        }
-        return prev_->back_propagation_2nd(prev_delta2_);
+        bprop(&current_delta2[0], &argmax_[0][0], &prev_delta2_[0]);
+
+        for (layer_size_t i = 0; i < in_size_; i++)
+            prev_delta2_[i] *= sqr(prev_h.df(prev_out[i]));
+        return backward_prev_2nd(prev_delta2_);
     }
 
     image<> output_to_image(size_t worker_index = 0) const override {
@@ -115,43 +152,74 @@ public:
     index3d<layer_size_t> out_shape() const override { return out_; }
     std::string layer_type() const override { return "max-pool"; }
     size_t pool_size() const {return pool_size_;}
+    size_t stride() const { return stride_; }
 
 private:
-    size_t pool_size_;
-    std::vector<std::vector<int> > out2in_; // mapping out => in (1:N)
-    std::vector<int> in2out_; // mapping in => out (N:1)
-    std::vector<int> out2inmax_; // mapping out => max_index(in) (1:1)
+    layer_size_t pool_size_;
+    layer_size_t stride_;
     index3d<layer_size_t> in_;
     index3d<layer_size_t> out_;
-
-    void connect_kernel(layer_size_t pooling_size, layer_size_t outx, layer_size_t outy, layer_size_t  c)
-    {
-        for (layer_size_t dy = 0; dy < pooling_size; dy++) {
-            for (layer_size_t dx = 0; dx < pooling_size; dx++) {
-                layer_size_t in_index = in_.get_index(outx * pooling_size + dx, outy * pooling_size + dy, c);
-                layer_size_t out_index = out_.get_index(outx, outy, c);
-
-                if (in_index >= in2out_.size())
-                    throw nn_error("index overflow");
-                if (out_index >= out2in_.size())
-                    throw nn_error("index overflow");
-                in2out_[in_index] = out_index;
-                out2in_[out_index].push_back(in_index);
+    std::vector<uint8_t> argmax_[CNN_TASK_SIZE]; // offset of the max in each window (dy * pool_size + dx), for each worker
+
+    /**
+     * out = max of each window of in, and argmax = offset of the max in the window if argmax is not null.
+     * rows of windows run in parallel, and each tap of the window is applied to the whole row,
+     * so that the inner loop is a branch-free max over the row
+     **/
+    void fprop(const float_t* in, const index3d<layer_size_t>& in_shape, const index3d<layer_size_t>& out_shape,
+               float_t* out, uint8_t* argmax) const {
+        const layer_size_t p = pool_size_, s = stride_, w = out_shape.width_;
+
+        for_(parallelize_, 0, out_shape.depth_ * out_shape.height_, [&](const blocked_range& r) {
+            for (int i = r.begin(); i < r.end(); i++) {
+                const layer_size_t c = i / out_shape.height_, y = i % out_shape.height_;
+                float_t* dst = &out[out_shape.get_index(0, y, c)];
+
+                std::fill(dst, dst + w, std::numeric_limits<float_t>::lowest());
+                if (argmax) std::fill(&argmax[out_shape.get_index(0, y, c)], &argmax[out_shape.get_index(0, y, c)] + w, uint8_t(0));
+
+                for (layer_size_t dy = 0; dy < p; dy++) {
+                    for (layer_size_t dx = 0; dx < p; dx++) {
+                        const float_t* src = &in[in_shape.get_index(dx, y * s + dy, c)];
+
+                        if (argmax) {
+                            uint8_t* arg = &argmax[out_shape.get_index(0, y, c)];
+                            const uint8_t k = static_cast<uint8_t>(dy * p + dx);
+                            for (layer_size_t x = 0; x < w; x++) {
+                                const float_t v = src[x * s];
+                                arg[x] = v > dst[x] ? k : arg[x];
+                                dst[x] = v > dst[x] ? v : dst[x];
+                            }
+                        } else {
+                            for (layer_size_t x = 0; x < w; x++)
+                                dst[x] = std::max(dst[x], src[x * s]);
+                        }
+                    }
+                }
             }
-        }
+        });
     }
 
-    void init_connection(layer_size_t pooling_size)
-    {
-        in2out_.resize(in_.size());
-        out2in_.resize(out_.size());
-        out2inmax_.resize(out_.size());
-        for (layer_size_t c = 0; c < in_.depth_; ++c)
-            for (layer_size_t y = 0; y < out_.height_; ++y)
-                for (layer_size_t x = 0; x < out_.width_; ++x)
-                    connect_kernel(pooling_size, x, y, c);
+    // prev = delta routed to the max of each window. windows of different channels never share inputs,
+    // so channels run in parallel even if windows overlap
+    void bprop(const float_t* delta, const uint8_t* argmax, float_t* prev) const {
+        const layer_size_t p = pool_size_, s = stride_;
+        const layer_size_t area = in_.width_ * in_.height_;
+
+        for_(parallelize_, 0, in_.depth_, [&](const blocked_range& r) {
+            for (int c = r.begin(); c < r.end(); c++) {
+                std::fill(prev + c * area, prev + (c + 1) * area, float_t(0));
+
+                for (layer_size_t y = 0; y < out_.height_; y++) {
+                    for (layer_size_t x = 0; x < out_.width_; x++) {
+                        const layer_size_t o = out_.get_index(x, y, c);
+                        const layer_size_t k = argmax[o];
+                        prev[in_.get_index(x * s + k % p, y * s + k / p, c)] += delta[o];
+                    }
+                }
+            }
+        }, 1);
     }
-
 };
 
 } // namespace tiny_cnn
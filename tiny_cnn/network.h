@@ -26,12 +26,15 @@
 */
 #pragma once
 #include <iostream>
+#include <fstream>
 #include <stdexcept>
 #include <algorithm>
 #include <iterator>
 #include <iomanip>
 #include <map>
 #include <set>
+#include <chrono>
+#include <numeric>
 
 #include "util.h"
 #include "activation_function.h"
@@ -39,24 +42,49 @@
 #include "optimizer.h"
 #include "layer.h"
 #include "layers.h"
+#include "binary_format.h"
+#include "sampler.h"
+#include "checkpoint.h"
 #include "fully_connected_layer.h"
 
 namespace tiny_cnn {
 
 struct result {
-    result() : num_success(0), num_total(0) {}
+    result() : num_success(0), num_total(0), num_top_k_success(0), top_k(1), loss(0.0), elapsed(0.0) {}
+
+    result(size_t num_classes, size_t k)
+        : num_success(0), num_total(0), num_top_k_success(0), top_k(k), loss(0.0), elapsed(0.0),
+          confusion_matrix(num_classes, std::vector<int>(num_classes, 0)) {}
 
     double accuracy() const {
         return num_success * 100.0 / num_total;
     }
 
+    ///< percentage of samples whose label is within top_k highest outputs
+    double top_k_accuracy() const {
+        return num_top_k_success * 100.0 / num_total;
+    }
+
+    ///< loss per sample against one-hot target (the same target as training)
+    double average_loss() const {
+        return num_total ? loss / num_total : 0.0;
+    }
+
+    ///< evaluated samples per second
+    double throughput() const {
+        return elapsed > 0.0 ? num_total / elapsed : 0.0;
+    }
+
     template <typename Char, typename CharTraits>
     void print_summary(std::basic_ostream<Char, CharTraits>& os) const {
         os << "accuracy:" << accuracy() << "% (" << num_success << "/" << num_total << ")" << std::endl;
+        if (top_k > 1)
+            os << "top-" << top_k << " accuracy:" << top_k_accuracy() << "% ";
+        os << "loss:" << average_loss() << " (" << throughput() << " samples/sec)" << std::endl;
     }
 
     template <typename Char, typename CharTraits>
-    void print_detail(std::basic_ostream<Char, CharTraits>& os) {
+    void print_detail(std::basic_ostream<Char, CharTraits>& os) const {
         print_summary(os);
         auto all_labels = labels();
 
@@ -68,24 +96,73 @@ struct result {
         for (auto r : all_labels) {
             os << std::setw(5) << r << " ";           
             for (auto c : all_labels) 
-                os << std::setw(5) << confusion_matrix[r][c] << " ";
+                os << std::setw(5) << count(r, c) << " ";
             os << std::endl;
         }
     }
 
+    ///< labels which appear in predictions or actual labels
     std::set<label_t> labels() const {
         std::set<label_t> all_labels;
-        for (auto r : confusion_matrix) {
-            all_labels.insert(r.first);
-            for (auto c : r.second)
-                all_labels.insert(c.first);
+        for (label_t r = 0; r < confusion_matrix.size(); r++) {
+            for (label_t c = 0; c < confusion_matrix[r].size(); c++) {
+                if (confusion_matrix[r][c] == 0) continue;
+                all_labels.insert(r);
+                all_labels.insert(c);
+            }
         }
         return all_labels;
     }
 
+    ///< number of samples predicted as predicted, whose actual label is actual
+    int count(label_t predicted, label_t actual) const {
+        return predicted < confusion_matrix.size() && actual < confusion_matrix.size() ? confusion_matrix[predicted][actual] : 0;
+    }
+
+    void add(label_t predicted, label_t actual) {
+        const size_t n = std::max(predicted, actual) + size_t(1);
+        if (n > confusion_matrix.size()) resize(n);
+
+        confusion_matrix[predicted][actual]++;
+        if (predicted == actual) num_success++;
+        num_total++;
+    }
+
+    void merge(const result& rhs) {
+        if (rhs.confusion_matrix.size() > confusion_matrix.size()) resize(rhs.confusion_matrix.size());
+
+        for (size_t r = 0; r < rhs.confusion_matrix.size(); r++)
+            for (size_t c = 0; c < rhs.confusion_matrix.size(); c++)
+                confusion_matrix[r][c] += rhs.confusion_matrix[r][c];
+
+        num_success += rhs.num_success;
+        num_total += rhs.num_total;
+        num_top_k_success += rhs.num_top_k_success;
+        loss += rhs.loss;
+    }
+
     int num_success;
     int num_total;
-    std::map<label_t, std::map<label_t, int> > confusion_matrix;
+    int num_top_k_success;
+    size_t top_k;
+    double loss;    // sum of loss of all samples
+    double elapsed; // seconds
+    std::vector<std::vector<int> > confusion_matrix; // [predicted][actual], num_classes x num_classes
+
+private:
+    void resize(size_t n) {
+        for (auto& row : confusion_matrix) row.resize(n, 0);
+        confusion_matrix.resize(n, std::vector<int>(n, 0));
+    }
+};
+
+/**
+ * activation buffers of one caller of network::predict(in, ctx).
+ * predict with context doesn't modify the network, so any number of threads can share
+ * one network for inference as long as each thread uses its own context.
+ **/
+struct predict_context {
+    std::vector<layer_workspace> workspaces; // one for each layer, allocated by first predict
 };
 
 enum grad_check_mode {
@@ -99,7 +176,7 @@ class network
 public:
     typedef LossFunction E;
 
-    explicit network(const std::string& name = "") : name_(name) {}
+    explicit network(const std::string& name = "") : name_(name), batch_mode_(false), frozen_(false), resume_(false) {}
 
     // getter
     layer_size_t in_dim() const         { return layers_.head()->in_size(); }
@@ -109,7 +186,166 @@ public:
 
     void         init_weight()          { layers_.init_weight(); }
     void         add(std::shared_ptr<layer_base> layer) { layers_.add(layer); }
-    vec_t        predict(const vec_t& in) { return fprop(in); }
+    vec_t        predict(const vec_t& in) { return frozen_ ? predict(in, predict_ctx_) : fprop(in); }
+
+    /**
+     * thread-safe version of predict. result is identical to predict(in).
+     * returned vector is owned by ctx and valid until next predict with ctx, so that
+     * repeated predictions with the same context allocate nothing
+     **/
+    const vec_t& predict(const vec_t& in, predict_context& ctx) const {
+        if (in.size() != (size_t)in_dim())
+            data_mismatch(*layers_[0], in);
+
+        ctx.workspaces.resize(depth());
+
+        const vec_t* out = &in;
+        for (size_t i = 0; i < depth(); i++)
+            out = &layers_[i]->forward(*out, ctx.workspaces[i]);
+        return *out;
+    }
+
+    /**
+     * dense (fully convolutional) inference over an image larger than the input of the network.
+     * convolution/pooling layers run once over the whole image, and fully-connected layers are
+     * applied as convolutions, so the result is a map of scores of every in_shape()-sized patch
+     * at a step of the total pooling stride, without recomputing overlapped windows.
+     * score at (x, y) equals predict() of the patch whose top-left corner is (x * stride, y * stride).
+     *
+     * @param in     image of width x height x in_shape().depth_, laid out the same as input of the network
+     * @param width  width of the image
+     * @param height height of the image
+     * @param shape  [out] shape of returned map, (map-width x map-height x out_dim) laid out as [channel][y][x]
+     **/
+    vec_t predict_dense(const vec_t& in, layer_size_t width, layer_size_t height, index3d<layer_size_t>* shape, predict_context& ctx) const {
+        index3d<layer_size_t> map(width, height, layers_[0]->in_shape().depth_);
+
+        if (in.size() != map.size())
+            data_mismatch(*layers_[0], in);
+
+        ctx.workspaces.resize(depth());
+
+        const vec_t* out = &in;
+        for (size_t i = 0; i < depth(); i++)
+            out = &layers_[i]->forward_dense(*out, map, ctx.workspaces[i]);
+
+        if (shape) *shape = map;
+        return *out;
+    }
+
+    vec_t predict_dense(const vec_t& in, layer_size_t width, layer_size_t height, index3d<layer_size_t>* shape = nullptr) const {
+        predict_context ctx;
+        return predict_dense(in, width, height, shape, ctx);
+    }
+
+    /**
+     * switch to inference-only mode.
+     * gradients, hessians, deltas and optimizer state are released, and only weights and
+     * buffers needed by predict are kept. frozen network cannot be trained.
+     * all layers must implement forward, because the per-worker buffers of forward_propagation are released too.
+     **/
+    void freeze() {
+        for (size_t i = 0; i < depth(); i++)
+            if (!layers_[i]->supports_forward())
+                throw nn_error(layers_[i]->layer_type() + " layer doesn't support concurrent forward, and cannot be frozen");
+        layers_.freeze();
+        optimizer_.reset();
+        release(batch_in_);
+        release(batch_delta_);
+        for (auto& d : delta_) release(d);
+        release(label_vecs_);
+        release(label_ptrs_);
+        frozen_ = true;
+    }
+
+    bool frozen() const { return frozen_; }
+
+    ///< bytes of heap memory held by layers and optimizer
+    size_t memory_usage() const {
+        size_t size = layers_.memory_usage() + optimizer_.memory_usage() +
+                      memory_size(batch_in_) + memory_size(batch_delta_) + memory_size(label_vecs_) + memory_size(label_ptrs_);
+        for (auto& d : delta_)
+            size += memory_size(d);
+        for (auto& ws : predict_ctx_.workspaces)
+            size += memory_size(ws.a) + memory_size(ws.output) + memory_size(ws.scratch) + memory_size(ws.channels);
+        return size;
+    }
+
+#ifdef CNN_USE_PROFILER
+    void reset_profile() {
+        for (size_t i = 0; i < depth(); i++)
+            layers_[i]->profile().reset();
+    }
+
+    /**
+     * print per-layer timings recorded while training (requires CNN_USE_PROFILER).
+     * GFLOP/s and GB/s are estimated from connection_size and number of parameters.
+     **/
+    template <typename Char, typename CharTraits>
+    void print_profile(std::basic_ostream<Char, CharTraits>& os) const {
+        const std::ios_base::fmtflags flags = os.flags();
+        const std::streamsize precision = os.precision();
+
+        os << std::setw(5) << "layer" << std::setw(22) << "type" << std::setw(14) << "phase"
+           << std::setw(10) << "calls" << std::setw(12) << "samples" << std::setw(12) << "total[ms]"
+           << std::setw(12) << "us/sample" << std::setw(10) << "GFLOP/s" << std::setw(10) << "GB/s" << std::endl;
+
+        for (size_t i = 0; i < depth(); i++) {
+            for (int p = 0; p < profile_phase_size; p++) {
+                const profile_phase phase = static_cast<profile_phase>(p);
+                const profile_stats s = layers_[i]->profile().total(phase);
+                if (s.calls == 0) continue;
+
+                os << std::setw(5) << i << std::setw(22) << layers_[i]->layer_type() << std::setw(14) << to_string(phase)
+                   << std::setw(10) << s.calls << std::setw(12) << s.samples
+                   << std::fixed << std::setprecision(3)
+                   << std::setw(12) << s.seconds * 1e3
+                   << std::setw(12) << s.seconds * 1e6 / s.samples
+                   << std::setw(10) << layers_[i]->estimated_flops(phase) * s.samples / s.seconds * 1e-9
+                   << std::setw(10) << layers_[i]->estimated_bytes(phase) * s.samples / s.seconds * 1e-9 << std::endl;
+                os.flags(flags);
+            }
+        }
+        os.precision(precision);
+    }
+
+    ///< same as print_profile, in JSON
+    template <typename Char, typename CharTraits>
+    void save_profile_json(std::basic_ostream<Char, CharTraits>& os) const {
+        os << "{\"layers\": [";
+        for (size_t i = 0; i < depth(); i++) {
+            os << (i ? ",\n  " : "\n  ") << "{\"index\": " << i << ", \"type\": \"" << layers_[i]->layer_type() << "\"";
+            for (int p = 0; p < profile_phase_size; p++) {
+                const profile_phase phase = static_cast<profile_phase>(p);
+                const profile_stats s = layers_[i]->profile().total(phase);
+
+                os << ", \"" << to_string(phase) << "\": {\"calls\": " << s.calls << ", \"samples\": " << s.samples
+                   << ", \"seconds\": " << s.seconds
+                   << ", \"flops\": " << layers_[i]->estimated_flops(phase) * s.samples
+                   << ", \"bytes\": " << layers_[i]->estimated_bytes(phase) * s.samples << "}";
+            }
+            os << "}";
+        }
+        os << "\n]}" << std::endl;
+    }
+#endif
+
+    /**
+     * train each mini-batch as a whole(layer by layer with forward_batch/backward_batch)
+     * instead of propagating samples one by one.
+     * fully-connected and convolutional layers compute whole batch by matrix-matrix product.
+     **/
+    void         set_batch_mode(bool batch_mode) { batch_mode_ = batch_mode; }
+
+    /**
+     * use fast approximation of exp in activation functions of all layers (see activation::detail::fast_exp).
+     * off by default, so that results are same as activation::function::f
+     **/
+    void set_approximate_activation(bool approximate) {
+        for (size_t i = 0; i < depth(); i++)
+            layers_[i]->activation_function().set_approximate(approximate);
+    }
+    bool         batch_mode() const     { return batch_mode_; }
 
     /**
      * training conv-net
@@ -132,32 +368,56 @@ public:
                const int                 nbTasks = CNN_TASK_SIZE
                )
     {
+        check_not_frozen();
         check_training_data(in, t);
-        if (_init_weight) init_weight();
-        layers_.set_parallelize(batch_size < CNN_TASK_SIZE);
-        optimizer_.reset();
 
-
-        for (int iter = 0; iter < epoch; iter++) 
-        {
-            if (optimizer_.requires_hessian())
-            {
-                calc_hessian(in);
+        // samples are referenced in place, whatever order the sampler chooses
+        return train_epochs<T>(in.size(), batch_size, epoch,
+                               [&](const std::vector<size_t>& order, size_t first, size_t n, const vec_t** pin, const T** pt) {
+            for (size_t i = 0; i < n; i++) {
+                pin[i] = &in[order[first + i]];
+                pt[i] = &t[order[first + i]];
             }
-            for (size_t i = 0; i < in.size(); i+=batch_size) {
-
-                train_once(&in[i],&t[i], std::min(batch_size, in.size() - i), nbTasks);
-
-                on_batch_enumerate();
+        }, on_batch_enumerate, on_epoch_enumerate, _init_weight, nbTasks);
+    }
 
-                if (i % 100 == 0 && layers_.is_exploded()) {
-                    std::cout << "[Warning]Detected infinite value in weight. stop learning." << std::endl;
-                    return false;
-                }
+    /**
+     * training conv-net with dataset which provides samples on demand (e.g. image_dataset).
+     * only one mini-batch of samples is held as vec_t at a time.
+     *
+     * Dataset must provide label_type, size(), sample_size() and
+     * get_batch(order, first, n, std::vector<vec_t>*, std::vector<label_type>*) (see image_dataset, async_dataset)
+     */
+    template <typename Dataset, typename OnBatchEnumerate, typename OnEpochEnumerate>
+    bool train(const Dataset&   data,
+               size_t           batch_size,
+               int              epoch,
+               OnBatchEnumerate on_batch_enumerate,
+               OnEpochEnumerate on_epoch_enumerate,
+               const bool       _init_weight = true,
+               const int        nbTasks = CNN_TASK_SIZE)
+    {
+        check_not_frozen();
+        if (data.size() > 0 && data.sample_size() != in_dim())
+            throw nn_error(format_str("input dimension mismatch!\n dim(data)=%u, dim(network input)=%u", data.sample_size(), in_dim()));
+
+        typedef typename Dataset::label_type T;
+        std::vector<vec_t> in;
+        std::vector<T> t;
+
+        return train_epochs<T>(data.size(), batch_size, epoch,
+                               [&](const std::vector<size_t>& order, size_t first, size_t n, const vec_t** pin, const T** pt) {
+            data.get_batch(order, first, n, &in, &t);
+            for (size_t i = 0; i < n; i++) {
+                pin[i] = &in[i];
+                pt[i] = &t[i];
             }
-            on_epoch_enumerate();
-        }
-        return true;
+        }, on_batch_enumerate, on_epoch_enumerate, _init_weight, nbTasks);
+    }
+
+    template <typename Dataset>
+    bool train(const Dataset& data, size_t batch_size = 1, int epoch = 1) {
+        return train(data, batch_size, epoch, nop, nop);
     }
 
     /**
@@ -169,30 +429,61 @@ public:
     }
 
     /**
-     * test and generate confusion-matrix for classification task
+     * test and generate confusion-matrix for classification task.
+     * samples are evaluated in parallel; each task accumulates its own dense confusion-matrix, top-k hits
+     * and loss from one forward pass per sample, and partial results are merged at the end.
+     *
+     * @param top_k sample is counted in num_top_k_success if its label is within top_k highest outputs
      **/
-    result test(const std::vector<vec_t>& in, const std::vector<label_t>& t) {
-        result test_result;
+    result test(const std::vector<vec_t>& in, const std::vector<label_t>& t, size_t top_k = 5) const {
+        if (in.size() != t.size())
+            throw nn_error("number of input and label mismatch");
 
-        for (size_t i = 0; i < in.size(); i++) {
-            const label_t predicted = max_index(predict(in[i]));
-            const label_t actual = t[i];
+        result res(out_dim(), top_k);
+        if (in.empty()) return res;
 
-            if (predicted == actual) test_result.num_success++;
-            test_result.num_total++;
-            test_result.confusion_matrix[predicted][actual]++;
-        }
-        return test_result;
+        const auto start = std::chrono::steady_clock::now();
+
+        evaluate(in.size(), [&](size_t i) -> const vec_t& { return in[i]; }, &t[0], &res);
+
+        res.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return res;
     }
 
+    /**
+     * test with a classification dataset (see train(const Dataset&, ...)),
+     * which is loaded by get_batch in chunks of batch_size samples
+     **/
+    template <typename Dataset>
+    result test(const Dataset& data, size_t top_k = 5, size_t batch_size = 1024) const {
+        static_assert(std::is_same<typename Dataset::label_type, label_t>::value, "test requires labels of classification");
+
+        const auto start = std::chrono::steady_clock::now();
+        result res(out_dim(), top_k);
+        std::vector<size_t> order(data.size());
+        std::vector<vec_t> in;
+        std::vector<label_t> t;
+
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+
+        for (size_t first = 0; first < data.size(); first += batch_size) {
+            const size_t n = std::min(batch_size, data.size() - first);
+            data.get_batch(order, first, n, &in, &t);
+            evaluate(n, [&](size_t i) -> const vec_t& { return in[i]; }, &t[0], &res);
+        }
 
-    std::vector<vec_t> test(const std::vector<vec_t>& in)
+        res.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return res;
+    }
+
+    std::vector<vec_t> test(const std::vector<vec_t>& in) const
      {
             std::vector<vec_t> test_result(in.size());
 
-            for_i(in.size(), [&](int i)
+            for_each_sample(in.size(), [&](size_t i) -> const vec_t& { return in[i]; },
+                            [&](size_t i, int /*task*/, const vec_t& out)
             {
-                test_result[i] = predict(in[i]);
+                test_result[i] = out;
             });
             return test_result;
     }
@@ -205,9 +496,10 @@ public:
             for (int batch = 0;batch < ceil(in.size()/batch_size);batch++)
             {
                 nbSamples = std::min(in.size() - batch*batch_size, batch_size);
-                for_i(nbSamples, [&](int i)
+                for_each_sample(nbSamples, [&](size_t i) -> const vec_t& { return in[i+batch*batch_size]; },
+                                [&](size_t i, int /*task*/, const vec_t& out)
                 {
-                    test_result[i+batch*batch_size] = predict(in[i+batch*batch_size])[0];
+                    test_result[i+batch*batch_size] = out[0];
                     //
                 });
                 on_batch_enumerate();
@@ -226,9 +518,10 @@ public:
             for (int batch = 0;batch < ceil(in.size()/batch_size);batch++)
             {
                 nbSamples = std::min(in.size() - batch*batch_size, batch_size);
-                for_i(nbSamples, [&](int i)
+                for_each_sample(nbSamples, [&](size_t i) -> const vec_t& { return in[i+batch*batch_size]; },
+                                [&](size_t i, int /*task*/, const vec_t& out)
                 {
-                    (*test_result)[i+batch*batch_size] = predict(in[i+batch*batch_size]);
+                    (*test_result)[i+batch*batch_size] = out;
                     
                 });
                 on_batch_enumerate();
@@ -238,15 +531,13 @@ public:
     /**
      * calculate loss value (the smaller, the better) for regression task
      **/
-    float_t get_loss(const std::vector<vec_t>& in, const std::vector<vec_t>& t)
-    {
-        float_t sum_loss = (float_t)0.0;
+    float_t get_loss(const std::vector<vec_t>& in, const std::vector<vec_t>& t) const {
+        std::vector<float_t> partial(num_sample_tasks(in.size()), float_t(0));
 
-        for (size_t i = 0; i < in.size(); i++) {
-            const vec_t predicted = predict(in[i]);
-            sum_loss += get_loss(predict(in[i]), t[i]);
-        }
-        return sum_loss;
+        for_each_sample(in.size(), [&](size_t i) -> const vec_t& { return in[i]; }, [&](size_t i, int task, const vec_t& out) {
+            partial[task] += get_loss(out, t[i]);
+        });
+        return std::accumulate(partial.begin(), partial.end(), float_t(0));
     }
 
     void save(std::ostream& os) const {
@@ -263,6 +554,72 @@ public:
         // layers_.update_weights(&optimizer_, 1, 1);
     }
 
+    /**
+     * save weights in binary format (see binary_format.h)
+     * the file contains layer types and shapes, which are checked when loading
+     **/
+    void save_binary(std::ostream& os) const {
+        binary_format::write(os, layers_);
+    }
+
+    void save_binary(const std::string& path) const {
+        std::ofstream ofs(path.c_str(), std::ios::binary);
+        if (!ofs) throw nn_error("failed to open " + path);
+        save_binary(ofs);
+    }
+
+    // copy weights from binary stream
+    void load_binary(std::istream& is) {
+        std::string buf((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        binary_format::read(buf.data(), buf.size(), layers_);
+    }
+
+    /**
+     * memory-map binary model file and use its weights directly without copying
+     * the mapping is copy-on-write, so training the network never modifies the file
+     **/
+    void map_binary(const std::string& path) {
+        binary_format::map(std::make_shared<mapped_file>(path), layers_);
+    }
+
+    /**
+     * save checkpoint to resume training: weights (in the binary format of save_binary, so that
+     * the file can also be used by load_binary/map_binary), hessians, optimizer state, random engines
+     * and position (epoch and next mini-batch) of training in progress.
+     * it is typically called from on_batch_enumerate/on_epoch_enumerate callback of train.
+     * state is copied to memory synchronously, and written to path by a background thread
+     * while training continues. path is replaced atomically when writing completes.
+     **/
+    void save_checkpoint(const std::string& path) {
+        check_not_frozen();
+        checkpoint_writer_.write(path, binary_format::write_checkpoint(layers_, optimizer_, sampler_.get(), position_));
+    }
+
+    /**
+     * wait until the latest save_checkpoint is written, and rethrow its error if any
+     **/
+    void wait_checkpoint() {
+        checkpoint_writer_.wait();
+    }
+
+    /**
+     * restore weights and training state saved by save_checkpoint.
+     * the network must have the same layers, optimizer and sampler as saved one.
+     * next call of train resumes from saved position without re-initializing weights and optimizer,
+     * and runs until its epoch argument (total number of epochs, not remaining ones)
+     **/
+    void load_checkpoint(const std::string& path) {
+        check_not_frozen();
+        wait_checkpoint();
+
+        std::ifstream ifs(path.c_str(), std::ios::binary);
+        if (!ifs) throw nn_error("failed to open " + path);
+
+        std::string buf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        binary_format::read_checkpoint(buf.data(), buf.size(), layers_, optimizer_, sampler_.get(), &position_);
+        resume_ = true;
+    }
+
     /**
      * checking gradients calculated by bprop
      * detail information:
@@ -270,6 +627,7 @@ public:
      **/
     bool gradient_check(const vec_t* in, const label_t* t, int data_size, float_t eps, grad_check_mode mode) {
         assert(!layers_.empty());
+        check_not_frozen();
         std::vector<vec_t> v;
         label2vector(t, data_size, &v);
 
@@ -342,6 +700,16 @@ public:
         return *this;
     }
 
+    /**
+     * set order of samples in each epoch of train (e.g. sampling::shuffle). storage order by default.
+     * samples are gathered by index, so that training data is never copied or permuted.
+     **/
+    template <typename Sampler>
+    network& sampler(const Sampler& s) {
+        sampler_ = std::make_shared<Sampler>(s);
+        return *this;
+    }
+
     template <typename BiasInit>
     network& bias_init(const BiasInit& f) { 
         auto ptr = std::make_shared<BiasInit>(f);
@@ -352,65 +720,265 @@ public:
 
 private:
 
-    void label2vector(const label_t* t, int num, std::vector<vec_t> *vec) const {
-        layer_size_t outdim = out_dim();
+    // accumulate results of n samples (in(i): i-th input, t[i]: its label) to *res.
+    // each task has its own partial result, merged in order of tasks
+    template <typename Input>
+    void evaluate(size_t n, Input in, const label_t* t, result* res) const {
+        const layer_size_t dim = out_dim();
+        const float_t tmin = target_value_min(), tmax = target_value_max();
+        std::vector<result> partial(num_sample_tasks(n), result(dim, res->top_k));
+
+        for_each_sample(n, in, [&](size_t i, int task, const vec_t& out) {
+            result& p = partial[task];
+            const label_t actual = t[i];
 
+            p.add(max_index(out), actual);
+
+            // label is within top-k <=> less than k outputs are greater than output of the label
+            if (actual < dim && size_t(std::count_if(out.begin(), out.end(), [&](float_t o) { return o > out[actual]; })) < p.top_k)
+                p.num_top_k_success++;
+
+            for (layer_size_t o = 0; o < dim; o++)
+                p.loss += E::f(out[o], o == actual ? tmax : tmin);
+        });
+
+        for (auto& p : partial) res->merge(p);
+    }
+
+    bool supports_forward() const {
+        for (size_t i = 0; i < depth(); i++)
+            if (!layers_[i]->supports_forward()) return false;
+        return true;
+    }
+
+    // forward_propagation with the slot of the given worker, which must not be shared with other tasks
+    const vec_t& fprop_worker(const vec_t& in, int worker) const {
+        if (in.size() != (size_t)in_dim())
+            data_mismatch(*layers_[0], in);
+        return layers_.head()->forward_propagation(in, worker);
+    }
+
+    // samples are split into contiguous blocks of this size, one for each task (at most CNN_TASK_SIZE tasks)
+    static size_t sample_block_size(size_t size) {
+        return std::max<size_t>(1, (size + CNN_TASK_SIZE - 1) / CNN_TASK_SIZE);
+    }
+
+    static size_t num_sample_tasks(size_t size) {
+        const size_t block = sample_block_size(size);
+        return (size + block - 1) / block;
+    }
+
+    /**
+     * call f(i, task, out) for all samples in parallel, where out is the output of the network for in(i),
+     * and task is the index of the task in [0, num_sample_tasks(size)).
+     * each task has its own predict_context, or runs forward_propagation with its own worker slot
+     * if some layer doesn't implement forward
+     **/
+    template <typename Input, typename Func>
+    void for_each_sample(size_t size, Input in, Func f) const {
+        const size_t block = sample_block_size(size);
+        const bool concurrent = supports_forward();
+
+        for_blocks(true, size, block, [&](const blocked_range& r) {
+            const int task = r.begin() / block;
+            predict_context ctx;
+
+            for (int i = r.begin(); i < r.end(); i++) {
+                const vec_t& x = in(i);
+                f(i, task, concurrent ? predict(x, ctx) : fprop_worker(x, task));
+            }
+        });
+    }
+
+    void label2vector(const label_t* t, int num, std::vector<vec_t> *vec) const {
         assert(num > 0);
+
+        vec->resize(vec->size() + num);
+        for (int i = 0; i < num; i++)
+            label2vector(t[i], &(*vec)[vec->size() - num + i]);
+    }
+
+    // reuses the memory of vec if it is already out_dim()
+    void label2vector(label_t t, vec_t* vec) const {
+        const layer_size_t outdim = out_dim();
+
         assert(outdim > 0);
+        assert(t < outdim);
 
-        vec->reserve(num);
-        for (int i = 0; i < num; i++) {
-            assert(t[i] < outdim);
-            vec->emplace_back(outdim, target_value_min());
-            vec->back()[t[i]] = target_value_max();
+        vec->assign(outdim, target_value_min());
+        (*vec)[t] = target_value_max();
+    }
+
+    // in[i], t[i]: pointers to i-th sample of mini-batch. target vectors are kept in label_vecs_ across batches
+    void train_once(const vec_t* const* in, const label_t* const* t, int size, const int nbThreads = CNN_TASK_SIZE) {
+        if (label_vecs_.size() < static_cast<size_t>(size)) {
+            label_vecs_.resize(size);
+            label_ptrs_.resize(size);
+        }
+
+        for (int i = 0; i < size; i++) {
+            label2vector(*t[i], &label_vecs_[i]);
+            label_ptrs_[i] = &label_vecs_[i];
         }
+        train_once(in, &label_ptrs_[0], size, nbThreads);
     }
 
-    void train_once(const vec_t* in, const label_t* t, int size, const int nbThreads = CNN_TASK_SIZE) {
-        std::vector<vec_t> v;
-        label2vector(t, size, &v);
-        train_once(in, &v[0], size, nbThreads );
+    /**
+     * number of tasks to train a mini-batch: limited by number of threads, and gradient replicas
+     * affordable for the largest layer. allocates gradient replicas for them
+     **/
+    int prepare_workers(int requested) {
+        const size_t size = std::max<size_t>(1, std::min(std::min<size_t>(requested, num_threads()), layers_.max_worker_size()));
+        layers_.set_worker_size(size);
+        return static_cast<int>(size);
     }
 
-    void train_once(const vec_t* in, const vec_t* t, int size, const int nbThreads = CNN_TASK_SIZE) {
-        if (size == 1) {
-            bprop(fprop(in[0]), t[0]);
+    void train_once(const vec_t* const* in, const vec_t* const* t, int size, const int nbThreads = CNN_TASK_SIZE) {
+        layers_.pre_batch();
+
+        if (batch_mode_) {
+            train_batch(in, t, size, nbThreads);
+        } else if (size == 1) {
+            bprop(fprop(*in[0]), *t[0]);
             layers_.update_weights(&optimizer_, 1, 1);
         } else {
             train_onebatch(in, t, size, nbThreads);
         }
     }   
 
-    void train_onebatch(const vec_t* in, const vec_t* t, int batch_size, const int num_tasks = CNN_TASK_SIZE) {
+    void train_onebatch(const vec_t* const* in, const vec_t* const* t, int batch_size, const int num_workers) {
+        const int num_tasks = std::min(batch_size, num_workers);
         task_group g;
-        //int num_tasks = batch_size < CNN_TASK_SIZE ? 1 : CNN_TASK_SIZE;
-        int data_per_thread = batch_size / num_tasks;
-        int remaining = batch_size;
 
-        // divide batch data and invoke [num_tasks] tasks
+        // divide batch data and invoke [num_tasks] tasks, each of them accumulates gradients into its own replica
         for (int i = 0; i < num_tasks; i++) {
-            int num = i == num_tasks - 1 ? remaining : data_per_thread;
+            const int begin = batch_size * i / num_tasks;
+            const int end = batch_size * (i + 1) / num_tasks;
 
             g.run([=]{
-                for (int j = 0; j < num; j++) bprop(fprop(in[j], i), t[j], i);
+                for (int j = begin; j < end; j++) bprop(fprop(*in[j], i), *t[j], i);
             });
-
-            remaining -= num;
-            in += num;
-            t += num;
         }
 
-        assert(remaining == 0);
         g.wait();
         // merge all dW and update W by optimizer
         layers_.update_weights(&optimizer_, num_tasks, batch_size);
     }
 
-    void calc_hessian(const std::vector<vec_t>& in, int size_initialize_hessian = 500) {
-        int size = std::min((int)in.size(), size_initialize_hessian);
+    void train_batch(const vec_t* const* in, const vec_t* const* t, int batch_size, const int num_workers) {
+        const layer_size_t dim_in = in_dim();
+        const layer_size_t dim_out = out_dim();
+
+        batch_in_.resize(batch_size * dim_in);
+        for (int n = 0; n < batch_size; n++)
+            std::copy(in[n]->begin(), in[n]->end(), &batch_in_[n * dim_in]);
+
+        const vec_t* out = &batch_in_;
+        for (layer_base* l = layers_.head(); l; l = l->next()) {
+            CNN_PROFILE_SCOPE(l, profile_phase::forward, batch_size);
+            out = &l->forward_batch(*out, batch_size);
+        }
+
+        batch_delta_.resize(batch_size * dim_out);
+        for_i(batch_size, [&](int n) {
+            output_delta(&(*out)[n * dim_out], *t[n], &batch_delta_[n * dim_out]);
+        });
+
+        const vec_t* delta = &batch_delta_;
+        for (layer_base* l = layers_.tail(); l != layers_.head(); l = l->prev()) {
+            CNN_PROFILE_SCOPE(l, profile_phase::backward, batch_size);
+            delta = &l->backward_batch(*delta, batch_size);
+        }
+
+        // layers without batch implementation accumulate gradients into per-worker slots
+        layers_.update_weights(&optimizer_, std::min(batch_size, num_workers), batch_size);
+    }
+
+    /**
+     * common part of train.
+     * get_batch(order, first, n, in, t) sets in[i]/t[i] to pointers to sample order[first + i] (i < n),
+     * which stay valid until next call.
+     **/
+    template <typename T, typename GetBatch, typename OnBatchEnumerate, typename OnEpochEnumerate>
+    bool train_epochs(size_t           size,
+                      size_t           batch_size,
+                      int              epoch,
+                      GetBatch         get_batch,
+                      OnBatchEnumerate on_batch_enumerate,
+                      OnEpochEnumerate on_epoch_enumerate,
+                      const bool       _init_weight,
+                      const int        nbTasks)
+    {
+        if (_init_weight && !resume_) init_weight();
+        const int num_tasks = prepare_workers(nbTasks);
+        // parallelize inside layers if tasks for samples can't occupy all threads
+        layers_.set_parallelize(batch_mode_ || std::min<size_t>(batch_size, num_tasks) < num_threads());
+        if (!resume_) {
+            optimizer_.reset();
+            layers_.clear_slots();
+            position_ = training_position();
+        }
+        resume_ = false;
+
+        std::vector<size_t>& order = position_.order;
+        std::vector<const vec_t*> in(batch_size);
+        std::vector<const T*> t(batch_size);
+
+        // position_ always points to the next mini-batch, so that checkpoint saved in callbacks resumes from there
+        while (position_.epoch < static_cast<size_t>(epoch))
+        {
+            if (position_.next_sample == 0) {
+                next_order(size, &order);
+
+                if (optimizer_.requires_hessian())
+                {
+                    calc_hessian<T>(order, get_batch);
+                }
+            }
+            while (position_.next_sample < order.size()) {
+                const size_t i = position_.next_sample;
+                const size_t n = std::min(batch_size, order.size() - i);
+                get_batch(order, i, n, &in[0], &t[0]);
+
+                train_once(&in[0], &t[0], static_cast<int>(n), num_tasks);
+                position_.next_sample += n;
+
+                on_batch_enumerate();
+
+                if (i % 100 == 0 && layers_.is_exploded()) {
+                    std::cout << "[Warning]Detected infinite value in weight. stop learning." << std::endl;
+                    return false;
+                }
+            }
+            position_.epoch++;
+            position_.next_sample = 0;
+            on_epoch_enumerate();
+        }
+        return true;
+    }
+
+    // indices of samples trained in next epoch
+    void next_order(size_t size, std::vector<size_t>* order) {
+        if (!sampler_) {
+            sampling::sequential().next_epoch(size, order);
+            return;
+        }
+        sampler_->next_epoch(size, order);
+        for (auto i : *order)
+            if (i >= size) throw nn_error("sampler returned index out of range");
+    }
+
+    template <typename T, typename GetBatch>
+    void calc_hessian(const std::vector<size_t>& order, GetBatch get_batch, int size_initialize_hessian = 500) {
+        int size = std::min((int)order.size(), size_initialize_hessian);
+        if (size == 0) return;
+
+        std::vector<const vec_t*> in(size);
+        std::vector<const T*> t(size);
+        get_batch(order, 0, size, &in[0], &t[0]);
 
         for (int i = 0; i < size; i++)
-            bprop_2nd(fprop(in[i]));
+            bprop_2nd(fprop(*in[i]));
 
         layers_.divide_hessian(size);
     }
@@ -424,49 +992,60 @@ private:
         return false;
     }
 
+    void check_not_frozen() const {
+        if (frozen_) throw nn_error("network is frozen for inference, and cannot be trained");
+    }
+
     const vec_t& fprop(const vec_t& in, int idx = 0) {
+        check_not_frozen();
         if (in.size() != (size_t)in_dim())
             data_mismatch(*layers_[0], in);
+        CNN_PROFILE_START(layers_.head(), idx);
         return layers_.head()->forward_propagation(in, idx);
     }
 
-    float_t get_loss(const vec_t& out, const vec_t& t) {
+    float_t get_loss(const vec_t& out, const vec_t& t) const {
         float_t e = 0.0;
         assert(out.size() == t.size());
-        for_i(out.size(), [&](int i){ e += E::f(out[i], t[i]); });
+        for (size_t i = 0; i < out.size(); i++) e += E::f(out[i], t[i]);
         return e;
     }
 
     void bprop_2nd(const vec_t& out) {
-        vec_t delta(out_dim());
+        vec_t& delta = delta_[0];
         const activation::function& h = layers_.tail()->activation_function();
 
+        delta.resize(out_dim());
         if (is_canonical_link(h)) {
             for_i(out_dim(), [&](int i){ delta[i] = target_value_max() * h.df(out[i]);});
         } else {
             for_i(out_dim(), [&](int i){ delta[i] = target_value_max() * h.df(out[i]) * h.df(out[i]);}); // FIXME
         }
 
+        CNN_PROFILE_START(layers_.tail(), 0);
         layers_.tail()->back_propagation_2nd(delta);
     }
 
     void bprop(const vec_t& out, const vec_t& t, int idx = 0) {
-        vec_t delta(out_dim());
+        vec_t& delta = delta_[idx];
+        delta.resize(out_dim());
+        output_delta(&out[0], t, &delta[0]);
+        CNN_PROFILE_START(layers_.tail(), idx);
+        layers_.tail()->back_propagation(delta, idx);
+    }
+
+    // delta of output layer: dE/da, written to delta[0, out_dim)
+    void output_delta(const float_t* out, const vec_t& t, float_t* delta) {
         const activation::function& h = layers_.tail()->activation_function();
+        const layer_size_t n = out_dim();
 
         if (is_canonical_link(h)) {
-            for_i(out_dim(), [&](int i){ delta[i] = out[i] - t[i]; });
+            for (layer_size_t i = 0; i < n; i++) delta[i] = out[i] - t[i];
         } else {
-            vec_t dE_dy = gradient<E>(out, t);
-
             // delta = dE/da = (dE/dy) * (dy/da)
-            for (size_t i = 0; i < out_dim(); i++) {
-                vec_t dy_da = h.df(out, i);
-                delta[i] = vectorize::dot(&dE_dy[0], &dy_da[0], out_dim());
-            }
+            for (layer_size_t i = 0; i < n; i++) delta[i] = E::df(out[i], t[i]);
+            h.df_chain(out, delta, n);
         }
-
-        layers_.tail()->back_propagation(delta, idx);
     }
 
     float_t calc_delta(const vec_t* in, const vec_t* v, int data_size, vec_t& w, vec_t& dw, int check_index) {
@@ -479,17 +1058,18 @@ private:
 
         w[check_index] = prev_w + delta;
         float_t f_p = 0.0;
-        for_i(data_size, [&](int i){ f_p += get_loss(fprop(in[i]), v[i]); });
+        for (int i = 0; i < data_size; i++) f_p += get_loss(fprop(in[i]), v[i]);
 
         float_t f_m = 0.0;
         w[check_index] = prev_w - delta;
-        for_i(data_size, [&](int i){ f_m += get_loss(fprop(in[i]), v[i]); });
+        for (int i = 0; i < data_size; i++) f_m += get_loss(fprop(in[i]), v[i]);
 
         float_t delta_by_numerical = (f_p - f_m) / (2.0 * delta);
         w[check_index] = prev_w;
 
         // calculate dw/dE by bprop
-        for_i(data_size, [&](int i){ bprop(fprop(in[i]), v[i]); });
+        // (samples share worker slot 0 and dw, so they must be processed one by one)
+        for (int i = 0; i < data_size; i++) bprop(fprop(in[i]), v[i]);
 
         float_t delta_by_bprop = dw[check_index];
 
@@ -537,11 +1117,24 @@ private:
     std::string name_;
     Optimizer optimizer_;
     layers layers_;
+    bool batch_mode_;
+    vec_t batch_in_;    // input of whole batch in batch-mode
+    vec_t batch_delta_; // delta of output layer for whole batch in batch-mode
+    vec_t delta_[CNN_TASK_SIZE];            // delta of output layer for each worker
+    std::vector<vec_t> label_vecs_;         // target vectors of labels in current mini-batch
+    std::vector<const vec_t*> label_ptrs_;  // pointers to label_vecs_
+    bool frozen_;
+    predict_context predict_ctx_; // used by predict(in) of frozen network
+    std::shared_ptr<sampling::function> sampler_; // null: storage order
+    training_position position_; // position of training in progress
+    bool resume_;                 // next train resumes from position_ (set by load_checkpoint)
+    detail::async_file_writer checkpoint_writer_;
 };
 
 /**
  * @brief [cut an image in samples to be tested (slow)]
- * @details [long description]
+ * @details [every patch is copied and predicted separately, so overlapped convolutions are recomputed.
+ *           network::predict_dense computes the same scores for the whole image in one pass]
  * 
  * @param data [pointer to the data]
  * @param rows [self explained]
@@ -25,8 +25,9 @@
     SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #pragma once
-#include "util.h"
 #include <unordered_map>
+#include "util.h"
+#include "product.h"
 
 namespace tiny_cnn {
 
@@ -38,26 +39,205 @@ template <bool usesHessian>
 struct optimizer {
     bool requires_hessian() const { return usesHessian; } // vc2012 doesn't support constexpr
     virtual void reset() {} // override to implement pre-learning action
+    virtual size_t memory_usage() const { return 0; } // bytes of heap memory held by optimizer
+
+    // number of values held for each weight (see stateful_optimizer)
+    virtual int num_slots() const { return 0; }
+
+    // called once per mini-batch before its update (see detail::fused_update)
+    virtual void begin_step() {}
+
+    // state which is not bound to weights (e.g. b1^t of adam), saved to checkpoint
+    virtual std::vector<float_t> scalars() const { return std::vector<float_t>(); }
+    virtual void set_scalars(const std::vector<float_t>& s) { CNN_UNREFERENCED_PARAMETER(s); }
 };
 
-// helper class to hold N values for each weight
+namespace detail {
+enum { max_slots = 4 }; // upper bound of stateful_optimizer's N
+} // namespace detail
+
+/**
+ * base class of optimizer which holds N values for each weight (e.g. momentum).
+ * the values are owned by layers next to their weights, registered once and never looked up:
+ * layer_base::update_weight calls update(dW, Hessian, W, slots) with slots[0..N) of W,
+ * zero-initialized on first update. optimizers without state implement update(dW, Hessian, W) instead.
+ * (deprecated) stateful optimizers implementing update(dW, Hessian, W) can still reach the slots by get<Index>(W).
+ *
+ * an optimizer which also provides bind(dW, W, slots), returning its element-wise kernel,
+ * is run by detail::fused_update over all layers at once
+ **/
 template <typename value_t, int N, bool usesHessian = false>
 struct stateful_optimizer : public optimizer<usesHessian> {
+    static_assert(std::is_same<value_t, float_t>::value, "slots are held in vec_t");
+    static_assert(N <= detail::max_slots, "too many slots");
+
+    int num_slots() const override { return N; }
+
     void reset() override {
         for (auto& e : E_) e.clear();
     }
 
+    // called by detail::update_weight around update(dW, Hessian, W), so that get<Index>(W) views the slots of W
+    void bind_slots(const vec_t* key, vec_t* slots) {
+        key_ = key;
+        slots_ = slots;
+    }
+
 protected:
+    /**
+     * (deprecated) Index-th value of each weight in key. use update(dW, Hessian, W, slots) instead.
+     * while the layer updates key, these are its slots. otherwise they are held by this optimizer
+     **/
     template <int Index>
-    std::vector<value_t>& get(const vec_t& key) {
+    vec_t& get(const vec_t& key) {
         static_assert(Index < N, "index out of range");
+        if (&key == key_) return slots_[Index];
         if (E_[Index][&key].empty())
             E_[Index][&key].resize(key.size(), value_t());
         return E_[Index][&key];
     }
-    std::unordered_map<const vec_t*, std::vector<value_t>> E_[N];
+
+private:
+    const vec_t* key_ = nullptr;
+    vec_t* slots_ = nullptr;
+    std::unordered_map<const vec_t*, vec_t> E_[N];
+};
+
+namespace detail {
+
+enum { update_block_size = 4096 }; // elements updated by one task, multiple of any unroll_size
+
+/**
+ * run k.run<Ops>(first, n) over [first, first + n).
+ * k is a fused update of one tensor: it reads dW and slots and writes W and slots in a single pass.
+ * body uses vector registers, and its tail uses scalar version of the same kernel
+ **/
+template <typename Kernel>
+void run_kernel(const Kernel& k, size_t first, size_t n) {
+    typedef typename vectorize::vector_ops<float_t>::type vector;
+    typedef vectorize::detail::generic<float_t> scalar;
+
+    const size_t nv = n / vector::unroll_size * vector::unroll_size;
+
+    k.template run<vector>(first, nv);
+    k.template run<scalar>(first + nv, n - nv);
+}
+
+// run kernel k over [0, size) in parallel blocks
+template <typename Kernel>
+void update_in_blocks(size_t size, const Kernel& k) {
+    for_blocks(true, size, update_block_size, [&](const blocked_range& r) {
+        run_kernel(k, r.begin(), r.end() - r.begin());
+    });
+}
+
+// (re)allocate num_slots zero-initialized slots for a tensor of given size
+inline void prepare_slots(std::vector<vec_t>& slots, int num_slots, size_t size) {
+    if (slots.size() != static_cast<size_t>(num_slots) || (num_slots > 0 && slots[0].size() != size))
+        slots.assign(num_slots, vec_t(size, float_t(0)));
+}
+
+// optimizer with state: slots of W are allocated by the caller on first update
+template <typename Optimizer>
+auto update_weight(Optimizer& o, const vec_t& dW, const vec_t& Hessian, vec_t& W, std::vector<vec_t>& slots, int)
+    -> decltype(o.update(dW, Hessian, W, &slots[0]), void()) {
+    if (W.empty()) return;
+    prepare_slots(slots, o.num_slots(), W.size());
+    o.update(dW, Hessian, W, &slots[0]);
+}
+
+// stateful optimizer implementing update(dW, Hessian, W): get<Index>(W) views slots of W while it's updated
+template <typename Optimizer>
+auto bind_slots(Optimizer& o, const vec_t* W, vec_t* slots, int) -> decltype(o.bind_slots(W, slots), void()) {
+    o.bind_slots(W, slots);
+}
+
+template <typename Optimizer>
+void bind_slots(Optimizer& /*o*/, const vec_t* /*W*/, vec_t* /*slots*/, long) {}
+
+// optimizer without state
+template <typename Optimizer>
+void update_weight(Optimizer& o, const vec_t& dW, const vec_t& Hessian, vec_t& W, std::vector<vec_t>& slots, long) {
+    if (W.empty()) return;
+    prepare_slots(slots, o.num_slots(), W.size());
+    bind_slots(o, &W, slots.empty() ? nullptr : &slots[0], 0);
+    o.update(dW, Hessian, W);
+    bind_slots(o, nullptr, nullptr, 0);
+}
+
+/**
+ * a tensor in the flattened parameter view of a network (see layer_base::append_parameters).
+ * the view is the concatenation of all tensors, and offset is the position of this one in the view
+ **/
+struct param_segment {
+    size_t offset;
+    size_t size;
+    float_t* W;
+    float_t* dW[CNN_TASK_SIZE]; // gradient replicas, only [0, worker_size) are valid
+    vec_t* slots;               // optimizer slots, or null if the optimizer has no state
 };
 
+/**
+ * one aligned buffer per kind of parameter of a whole network (see layers::pack).
+ * weights/biases, their hessians, gradient replicas of each worker and optimizer slots of all layers
+ * are views into these buffers at the same offsets, so the parameter view is a single segment.
+ * each tensor starts at a multiple of alignment elements. padding between tensors is zero,
+ * and stays zero under the element-wise kernels of built-in optimizers (zero gradient moves nothing)
+ **/
+struct parameter_arena {
+    enum { alignment = 16 }; // in elements, 64 bytes
+
+    static size_t aligned_size(size_t size) { return (size + alignment - 1) / alignment * alignment; }
+
+    vec_t params;
+    vec_t hessian;
+    vec_t grads[CNN_TASK_SIZE]; // only [0, worker_size) are allocated
+    vec_t slots[max_slots];     // only [0, num_slots) are allocated
+    size_t worker_size;
+    int num_slots;
+};
+
+/**
+ * one optimizer step over the whole parameter view in a single parallel sweep.
+ * each task owns a range of the view, and for each tensor overlapping it
+ * reduces gradient replicas of workers, divides by batch_size (as layer_base::merge), runs the optimizer kernel
+ * and clears the gradients, while the range stays in cache.
+ * params must be sorted by offset, without empty tensors.
+ **/
+template <typename Optimizer>
+void fused_update(Optimizer& o, const std::vector<param_segment>& params, size_t worker_size, size_t batch_size) {
+    if (params.empty()) return;
+
+    const size_t total = params.back().offset + params.back().size;
+
+    o.begin_step();
+
+    for_blocks(true, total, update_block_size, [&](const blocked_range& r) {
+        const size_t begin = r.begin(), end = r.end();
+        auto p = std::upper_bound(params.begin(), params.end(), begin,
+            [](size_t pos, const param_segment& seg) { return pos < seg.offset; }) - 1;
+
+        for (size_t pos = begin; pos < end; pos = p->offset + p->size, ++p) {
+            const size_t first = pos - p->offset;
+            const size_t n = std::min(end, p->offset + p->size) - pos;
+            float_t* dW = p->dW[0] + first;
+
+            for (size_t i = 1; i < worker_size; i++) {
+                vectorize::reduce<float_t>(p->dW[i] + first, n, dW);
+                std::fill(p->dW[i] + first, p->dW[i] + first + n, float_t(0));
+            }
+            for (size_t j = 0; j < n; j++)
+                dW[j] /= batch_size;
+
+            run_kernel(o.bind(p->dW[0], p->W, p->slots), first, n);
+
+            std::fill(dW, dW + n, float_t(0));
+        }
+    });
+}
+
+} // namespace detail
+
 /**
  * Stochastic Diagonal Levenberg-Marquardt
  *
@@ -89,16 +269,36 @@ public:
 struct adagrad : public stateful_optimizer<float_t, 1, false> {
     adagrad() : alpha(0.01), eps(1e-8) {}
 
-    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t &W) {
-        vec_t& g = get<0>(W);
-
-        for_i(W.size(), [&](int i) {
-            g[i] += dW[i] * dW[i];
-            W[i] -= alpha * dW[i] / (std::sqrt(g[i]) + eps);
-        });
+    // g += dW^2, W -= alpha * dW / (sqrt(g) + eps)
+    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t &W, vec_t* slots) {
+        detail::update_in_blocks(W.size(), bind(&dW[0], &W[0], slots));
     }
 
     float_t alpha; // learning rate
+
+    struct kernel {
+        const float_t* dW; float_t* W; float_t* g;
+        float_t alpha, eps;
+
+        template <typename Ops>
+        void run(size_t first, size_t n) const {
+            typedef typename Ops::register_type reg;
+            const reg a = Ops::set1(alpha), e = Ops::set1(eps);
+
+            for (size_t i = first; i < first + n; i += Ops::unroll_size) {
+                const reg d = Ops::loadu(&dW[i]);
+                const reg gi = Ops::add(Ops::loadu(&g[i]), Ops::mul(d, d));
+                Ops::storeu(&g[i], gi);
+                Ops::storeu(&W[i], Ops::sub(Ops::loadu(&W[i]), Ops::div(Ops::mul(a, d), Ops::add(Ops::sqrt(gi), e))));
+            }
+        }
+    };
+
+    kernel bind(const float_t* dW, float_t* W, vec_t* slots) const {
+        kernel k = { dW, W, &slots[0][0], alpha, eps };
+        return k;
+    }
+
 private:
     float_t eps;
 };
@@ -112,18 +312,37 @@ private:
 struct RMSprop : public stateful_optimizer<float_t, 1, false> {
     RMSprop() : alpha(0.0001), mu(0.99), eps(1e-8) {}
 
-    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W) {
-        vec_t& g = get<0>(W);
-
-        for_i(W.size(), [&](int i)
-        {
-            g[i] = mu * g[i] + (1 - mu) * dW[i] * dW[i];
-            W[i] -= alpha * dW[i] / std::sqrt(g[i] + eps);
-        });
+    // g = mu * g + (1 - mu) * dW^2, W -= alpha * dW / sqrt(g + eps)
+    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W, vec_t* slots) {
+        detail::update_in_blocks(W.size(), bind(&dW[0], &W[0], slots));
     }
 
     float_t alpha; // learning rate
     float_t mu; // decay term
+
+    struct kernel {
+        const float_t* dW; float_t* W; float_t* g;
+        float_t alpha, mu, eps;
+
+        template <typename Ops>
+        void run(size_t first, size_t n) const {
+            typedef typename Ops::register_type reg;
+            const reg a = Ops::set1(alpha), m = Ops::set1(mu), m1 = Ops::set1(1 - mu), e = Ops::set1(eps);
+
+            for (size_t i = first; i < first + n; i += Ops::unroll_size) {
+                const reg d = Ops::loadu(&dW[i]);
+                const reg gi = Ops::add(Ops::mul(m, Ops::loadu(&g[i])), Ops::mul(m1, Ops::mul(d, d)));
+                Ops::storeu(&g[i], gi);
+                Ops::storeu(&W[i], Ops::sub(Ops::loadu(&W[i]), Ops::div(Ops::mul(a, d), Ops::sqrt(Ops::add(gi, e)))));
+            }
+        }
+    };
+
+    kernel bind(const float_t* dW, float_t* W, vec_t* slots) const {
+        kernel k = { dW, W, &slots[0][0], alpha, mu, eps };
+        return k;
+    }
+
 private:
     float_t eps; // constant value to avoid zero-division
 };
@@ -138,18 +357,20 @@ private:
 struct adam : public stateful_optimizer<float_t, 2, false> {
     adam() : alpha(0.001), b1(0.9), b2(0.999) , b1_t(0.9), b2_t(0.999), eps(1e-8) {}
 
-    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W) {
-        vec_t& mt = get<0>(W);
-        vec_t& vt = get<1>(W);
-
-        b1_t*=b1;b2_t*=b2;
+    // slots: first moment mt and second moment vt. t is advanced by begin_step, not here
+    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W, vec_t* slots) {
+        detail::update_in_blocks(W.size(), bind(&dW[0], &W[0], slots));
+    }
 
-        for_i(W.size(), [&](int i){
-            mt[i] = b1 * mt[i] + (1 - b1) * dW[i];
-            vt[i] = b2 * vt[i] + (1 - b2) * dW[i] * dW[i];
+    void reset() override {
+        b1_t = b1;
+        b2_t = b2;
+    }
 
-            W[i] -= alpha * ( mt[i]/(1-b1_t) ) / std::sqrt( (vt[i]/(1-b2_t)) + eps);
-        });
+    // t is advanced once per mini-batch, shared by all weights of the network
+    void begin_step() override {
+        b1_t *= b1;
+        b2_t *= b2;
     }
 
     float_t alpha; // learning rate
@@ -157,6 +378,46 @@ struct adam : public stateful_optimizer<float_t, 2, false> {
     float_t b2; // decay term
     float_t b1_t; // decay term power t
     float_t b2_t; // decay term power t   
+
+    std::vector<float_t> scalars() const override {
+        return std::vector<float_t>{ b1_t, b2_t };
+    }
+
+    void set_scalars(const std::vector<float_t>& s) override {
+        b1_t = s[0];
+        b2_t = s[1];
+    }
+
+    // mt = b1 * mt + (1 - b1) * dW, vt = b2 * vt + (1 - b2) * dW^2,
+    // W -= alpha * (mt / (1 - b1^t)) / sqrt(vt / (1 - b2^t) + eps)
+    struct kernel {
+        const float_t* dW; float_t* W; float_t* mt; float_t* vt;
+        float_t alpha, b1, b2, c1, c2, eps; // c1 = 1 / (1 - b1^t), c2 = 1 / (1 - b2^t)
+
+        template <typename Ops>
+        void run(size_t first, size_t n) const {
+            typedef typename Ops::register_type reg;
+            const reg a = Ops::set1(alpha), e = Ops::set1(eps);
+            const reg m = Ops::set1(b1), m1 = Ops::set1(1 - b1), v = Ops::set1(b2), v1 = Ops::set1(1 - b2);
+            const reg k1 = Ops::set1(c1), k2 = Ops::set1(c2);
+
+            for (size_t i = first; i < first + n; i += Ops::unroll_size) {
+                const reg d = Ops::loadu(&dW[i]);
+                const reg mi = Ops::add(Ops::mul(m, Ops::loadu(&mt[i])), Ops::mul(m1, d));
+                const reg vi = Ops::add(Ops::mul(v, Ops::loadu(&vt[i])), Ops::mul(v1, Ops::mul(d, d)));
+                Ops::storeu(&mt[i], mi);
+                Ops::storeu(&vt[i], vi);
+                Ops::storeu(&W[i], Ops::sub(Ops::loadu(&W[i]),
+                                            Ops::div(Ops::mul(a, Ops::mul(mi, k1)), Ops::sqrt(Ops::add(Ops::mul(vi, k2), e)))));
+            }
+        }
+    };
+
+    kernel bind(const float_t* dW, float_t* W, vec_t* slots) const {
+        kernel k = { dW, W, &slots[0][0], &slots[1][0], alpha, b1, b2, 1 / (1 - b1_t), 1 / (1 - b2_t), eps };
+        return k;
+    }
+
 private:
     float_t eps; // constant value to avoid zero-division
 };
@@ -172,13 +433,33 @@ struct gradient_descent : public optimizer<false> {
     gradient_descent() : alpha(0.01), lambda(0.0) {}
 
     void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W) {
-        for_i(W.size(), [&](int i){
-            W[i] = W[i] - alpha * (dW[i] + lambda * W[i]);
-        });
+        detail::update_in_blocks(W.size(), bind(&dW[0], &W[0], nullptr));
     }
 
     float_t alpha; // learning rate
     float_t lambda; // weight decay
+
+    // W = W - alpha * (dW + lambda * W)
+    struct kernel {
+        const float_t* dW; float_t* W;
+        float_t alpha, lambda;
+
+        template <typename Ops>
+        void run(size_t first, size_t n) const {
+            typedef typename Ops::register_type reg;
+            const reg a = Ops::set1(alpha), l = Ops::set1(lambda);
+
+            for (size_t i = first; i < first + n; i += Ops::unroll_size) {
+                const reg w = Ops::loadu(&W[i]);
+                Ops::storeu(&W[i], Ops::sub(w, Ops::mul(a, Ops::add(Ops::loadu(&dW[i]), Ops::mul(l, w)))));
+            }
+        }
+    };
+
+    kernel bind(const float_t* dW, float_t* W, vec_t* /*slots*/) const {
+        kernel k = { dW, W, alpha, lambda };
+        return k;
+    }
 };
 
 /**
@@ -192,19 +473,38 @@ struct momentum : public stateful_optimizer<float_t, 1, false> {
 public:
     momentum() : alpha(0.01), lambda(0.0), mu(0.9) {}
 
-    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W) {
-        vec_t& dWprev = get<0>(W);
-
-        for_i(W.size(), [&](int i){
-            float_t V = mu * dWprev[i] - alpha * (dW[i] + W[i] * lambda);
-            W[i]      += V;
-            dWprev[i] =  V;
-        });
+    // slots: previous step V
+    void update(const vec_t& dW, const vec_t& /*Hessian*/, vec_t& W, vec_t* slots) {
+        detail::update_in_blocks(W.size(), bind(&dW[0], &W[0], slots));
     }
 
     float_t alpha; // learning rate
     float_t lambda; // weight decay
     float_t mu; // momentum
+
+    // V = mu * Vprev - alpha * (dW + lambda * W), W += V
+    struct kernel {
+        const float_t* dW; float_t* W; float_t* Vprev;
+        float_t alpha, lambda, mu;
+
+        template <typename Ops>
+        void run(size_t first, size_t n) const {
+            typedef typename Ops::register_type reg;
+            const reg a = Ops::set1(alpha), l = Ops::set1(lambda), m = Ops::set1(mu);
+
+            for (size_t i = first; i < first + n; i += Ops::unroll_size) {
+                const reg w = Ops::loadu(&W[i]);
+                const reg v = Ops::sub(Ops::mul(m, Ops::loadu(&Vprev[i])), Ops::mul(a, Ops::add(Ops::loadu(&dW[i]), Ops::mul(w, l))));
+                Ops::storeu(&W[i], Ops::add(w, v));
+                Ops::storeu(&Vprev[i], v);
+            }
+        }
+    };
+
+    kernel bind(const float_t* dW, float_t* W, vec_t* slots) const {
+        kernel k = { dW, W, &slots[0][0], alpha, lambda, mu };
+        return k;
+    }
 };
 
 } // namespace tiny_cnn
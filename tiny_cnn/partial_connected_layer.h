@@ -25,83 +25,185 @@
     SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #pragma once
+#include <cstdint>
 #include "util.h"
 #include "layer.h"
 
 namespace tiny_cnn {
 
+/**
+ * compressed sparse rows of (first, second) index pairs.
+ * pairs of row r are stored contiguously in [offsets_[r], offsets_[r + 1]), in the order they were added
+ **/
+class connection_graph {
+public:
+    struct connection {
+        uint32_t first;
+        uint32_t second;
+    };
+
+    class row {
+    public:
+        row(const connection* first, const connection* last) : first_(first), last_(last) {}
+        const connection* begin() const { return first_; }
+        const connection* end() const { return last_; }
+        size_t size() const { return last_ - first_; }
+        bool empty() const { return first_ == last_; }
+    private:
+        const connection* first_;
+        const connection* last_;
+    };
+
+    /**
+     * build rows from n pairs by counting sort (stable).
+     * row_of(i) is the row of i-th pair, and pair_of(i) the pair itself
+     **/
+    template <typename RowOf, typename PairOf>
+    void build(size_t rows, size_t n, RowOf row_of, PairOf pair_of) {
+        offsets_.assign(rows + 1, 0);
+        for (size_t i = 0; i < n; i++) offsets_[row_of(i) + 1]++;
+        for (size_t r = 0; r < rows; r++) offsets_[r + 1] += offsets_[r];
+
+        std::vector<uint32_t> next(offsets_.begin(), offsets_.end() - 1);
+        connections_.resize(n);
+        for (size_t i = 0; i < n; i++) connections_[next[row_of(i)]++] = pair_of(i);
+    }
+
+    row operator [] (size_t r) const {
+        const connection* p = connections_.data();
+        return row(p + offsets_[r], p + offsets_[r + 1]);
+    }
+
+    size_t rows() const { return offsets_.empty() ? 0 : offsets_.size() - 1; }
+    size_t size() const { return connections_.size(); }
+
+    size_t max_row_size() const {
+        size_t m = 0;
+        for (size_t r = 0; r < rows(); r++) m = std::max<size_t>(m, offsets_[r + 1] - offsets_[r]);
+        return m;
+    }
+
+    // replace first of every pair by map[first]
+    void map_first(const std::vector<uint32_t>& map) {
+        for (auto& c : connections_) c.first = map[c.first];
+    }
+
+    // drop empty rows, so that non-empty rows are renumbered in order
+    void remove_empty_rows() {
+        size_t n = 0;
+        for (size_t r = 0; r < rows(); r++)
+            if (offsets_[r + 1] != offsets_[r]) offsets_[++n] = offsets_[r + 1];
+        offsets_.resize(n + 1);
+    }
+
+    size_t memory_usage() const { return memory_size(offsets_) + memory_size(connections_); }
+
+private:
+    std::vector<uint32_t> offsets_;
+    std::vector<connection> connections_;
+};
+
+/**
+ * layer with arbitrary connections between inputs and outputs, where weights may be shared.
+ * derived class declares connections by connect_weight/connect_bias in its constructor,
+ * and then calls compile_connections, which builds compact indices used by fprop/bprop
+ **/
 template<typename Activation>
 class partial_connected_layer : public layer<Activation> {
 public:
     CNN_USE_LAYER_MEMBERS;
 
-    typedef std::vector<std::pair<layer_size_t, layer_size_t> > io_connections;
-    typedef std::vector<std::pair<layer_size_t, layer_size_t> > wi_connections;
-    typedef std::vector<std::pair<layer_size_t, layer_size_t> > wo_connections;
+    typedef connection_graph::row io_connections; // (in_id, out_id) of a weight
+    typedef connection_graph::row wi_connections; // (weight_id, in_id) of an output
+    typedef connection_graph::row wo_connections; // (weight_id, out_id) of an input
     typedef layer<Activation> Base;
 
     partial_connected_layer(layer_size_t in_dim, layer_size_t out_dim, size_t weight_dim, size_t bias_dim, float_t scale_factor = 1.0)
-        : Base(in_dim, out_dim, weight_dim, bias_dim), 
-          weight2io_(weight_dim), out2wi_(out_dim), in2wo_(in_dim), bias2out_(bias_dim), out2bias_(out_dim),
-          scale_factor_(scale_factor) {}
+        : Base(in_dim, out_dim, weight_dim, bias_dim), out2bias_(out_dim),
+          scale_factor_(scale_factor), compiled_(false) {}
 
     size_t param_size() const override {
+        check_compiled();
         size_t total_param = 0;
-        for (auto w : weight2io_)
-            if (w.size() > 0) total_param++;
-        for (auto b : bias2out_)
-            if (b.size() > 0) total_param++;
+        for (size_t i = 0; i < weight2io_.rows(); i++)
+            if (!weight2io_[i].empty()) total_param++;
+        for (size_t i = 0; i < bias2out_.rows(); i++)
+            if (!bias2out_[i].empty()) total_param++;
         return total_param;
     }
 
     size_t connection_size() const override {
-        size_t total_size = 0;
-        for (auto io : weight2io_)
-            total_size += io.size();
-        for (auto b : bias2out_)
-            total_size += b.size();
-        return total_size;
+        check_compiled();
+        return weight2io_.size() + bias2out_.size();
     }
 
     size_t fan_in_size() const override {
-        return max_size(out2wi_);
+        check_compiled();
+        return out2wi_.max_row_size();
     }
 
     size_t fan_out_size() const override {
-        return max_size(in2wo_);
+        check_compiled();
+        return in2wo_.max_row_size();
+    }
+
+    size_t memory_usage() const override {
+        return Base::memory_usage() + weight2io_.memory_usage() + out2wi_.memory_usage() + in2wo_.memory_usage() +
+               bias2out_.memory_usage() + memory_size(out2bias_) + memory_size(weights_) + memory_size(biases_);
     }
 
     void connect_weight(layer_size_t input_index, layer_size_t output_index, layer_size_t weight_index) {
-        weight2io_[weight_index].emplace_back(input_index, output_index);
-        out2wi_[output_index].emplace_back(weight_index, input_index);
-        in2wo_[input_index].emplace_back(weight_index, output_index);
+        if (compiled_) throw nn_error("connections are already compiled");
+        weight_connection c = { to_index(input_index), to_index(output_index), to_index(weight_index) };
+        weights_.push_back(c);
     }
 
     void connect_bias(layer_size_t bias_index, layer_size_t output_index) {
-        out2bias_[output_index] = bias_index;
-        bias2out_[bias_index].push_back(output_index);
+        if (compiled_) throw nn_error("connections are already compiled");
+        out2bias_[output_index] = to_index(bias_index);
+        biases_.push_back(to_index(bias_index));
+        biases_.push_back(to_index(output_index));
+    }
+
+    /**
+     * build indices of weight -> (in, out), out -> (weight, in), in -> (weight, out) and bias -> out
+     * from the connections declared so far, and release the declarations
+     **/
+    void compile_connections() {
+        if (compiled_) throw nn_error("connections are already compiled");
+
+        const std::vector<weight_connection>& w = weights_;
+        const std::vector<uint32_t>& b = biases_;
+        typedef connection_graph::connection pair;
+
+        weight2io_.build(W_.size(), w.size(), [&](size_t i) { return w[i].weight; },
+                         [&](size_t i) { pair p = { w[i].in, w[i].out }; return p; });
+        out2wi_.build(out_size_, w.size(), [&](size_t i) { return w[i].out; },
+                      [&](size_t i) { pair p = { w[i].weight, w[i].in }; return p; });
+        in2wo_.build(in_size_, w.size(), [&](size_t i) { return w[i].in; },
+                     [&](size_t i) { pair p = { w[i].weight, w[i].out }; return p; });
+        bias2out_.build(b_.size(), b.size() / 2, [&](size_t i) { return b[i * 2]; },
+                        [&](size_t i) { pair p = { b[i * 2 + 1], 0 }; return p; });
+
+        release(weights_);
+        release(biases_);
+        compiled_ = true;
     }
 
     const vec_t& forward_propagation(const vec_t& in, size_t index) override {
-        vec_t& a = a_[index];
-     
-        for_i(parallelize_, out_size_, [&](int i) {
-            const wi_connections& connections = out2wi_[i];
+        fprop(in, a_[index], output_[index]);
 
-            a[i] = 0.0;
+        return forward_next(output_[index], index); // 15.6%
+    }
 
-            for (auto connection : connections)// 13.1%
-                a[i] += W_[connection.first] * in[connection.second]; // 3.2%
+    bool supports_forward() const override { return true; }
 
-            a[i] *= scale_factor_;
-            a[i] += b_[out2bias_[i]];
-        });
+    const vec_t& forward(const vec_t& in, layer_workspace& ws) const override {
+        ws.a.resize(out_size_);
+        ws.output.resize(out_size_);
 
-        for_i(parallelize_, out_size_, [&](int i) {
-            output_[index][i] = h_.f(a, i);
-        });
-
-        return next_ ? next_->forward_propagation(output_[index], index) : output_[index]; // 15.6%
+        fprop(in, ws.a, ws.output);
+        return ws.output;
     }
 
     virtual const vec_t& back_propagation(const vec_t& current_delta, size_t index) override {
@@ -109,114 +211,142 @@ public:
         const activation::function& prev_h = prev_->activation_function();
         vec_t& prev_delta = prev_delta_[index];
 
+        check_compiled();
+
         for_(parallelize_, 0, in_size_, [&](const blocked_range& r) {
             for (int i = r.begin(); i != r.end(); i++) {
-                const wo_connections& connections = in2wo_[i];
                 float_t delta = 0.0;
 
-                for (auto connection : connections) 
+                for (auto connection : in2wo_[i]) 
                     delta += W_[connection.first] * current_delta[connection.second]; // 40.6%
 
-                prev_delta[i] = delta * scale_factor_ * prev_h.df(prev_out[i]); // 2.1%
+                prev_delta[i] = delta * scale_factor_;
             }
         });
+        prev_h.df_vec(&prev_out[0], &prev_delta[0], in_size_);
 
-        for_(parallelize_, 0, weight2io_.size(), [&](const blocked_range& r) {
+        for_(parallelize_, 0, weight2io_.rows(), [&](const blocked_range& r) {
             for (int i = r.begin(); i < r.end(); i++) {
-                const io_connections& connections = weight2io_[i];
                 float_t diff = 0.0;
 
-                for (auto connection : connections) // 11.9%
+                for (auto connection : weight2io_[i]) // 11.9%
                     diff += prev_out[connection.first] * current_delta[connection.second];
 
                 dW_[index][i] += diff * scale_factor_;
             }
         });
 
-        for (size_t i = 0; i < bias2out_.size(); i++) {
-            const std::vector<layer_size_t>& outs = bias2out_[i];
+        for (size_t i = 0; i < bias2out_.rows(); i++) {
             float_t diff = 0.0;
 
-            for (auto o : outs)
-                diff += current_delta[o];    
+            for (auto o : bias2out_[i])
+                diff += current_delta[o.first];    
 
             db_[index][i] += diff;
         } 
 
-        return prev_->back_propagation(prev_delta_[index], index);
+        return backward_prev(prev_delta_[index], index);
     }
 
     const vec_t& back_propagation_2nd(const vec_t& current_delta2) override {
         const vec_t& prev_out = prev_->output(0);
         const activation::function& prev_h = prev_->activation_function();
 
-        for (size_t i = 0; i < weight2io_.size(); i++) {
-            const io_connections& connections = weight2io_[i];
+        check_compiled();
+
+        for (size_t i = 0; i < weight2io_.rows(); i++) {
             float_t diff = 0.0;
 
-            for (auto connection : connections)
+            for (auto connection : weight2io_[i])
                 diff += sqr(prev_out[connection.first]) * current_delta2[connection.second];
 
             diff *= sqr(scale_factor_);
             Whessian_[i] += diff;
         }
 
-        for (size_t i = 0; i < bias2out_.size(); i++) {
-            const std::vector<layer_size_t>& outs = bias2out_[i];
+        for (size_t i = 0; i < bias2out_.rows(); i++) {
             float_t diff = 0.0;
 
-            for (auto o : outs)
-                diff += current_delta2[o];    
+            for (auto o : bias2out_[i])
+                diff += current_delta2[o.first];    
 
             bhessian_[i] += diff;
         }
 
         for (int i = 0; i < in_size_; i++) {
-            const wo_connections& connections = in2wo_[i];
             prev_delta2_[i] = 0.0;
 
-            for (auto connection : connections) 
+            for (auto connection : in2wo_[i]) 
                 prev_delta2_[i] += sqr(W_[connection.first]) * current_delta2[connection.second];
 
             prev_delta2_[i] *= sqr(scale_factor_ * prev_h.df(prev_out[i]));
         }
-        return prev_->back_propagation_2nd(prev_delta2_);
+        return backward_prev_2nd(prev_delta2_);
     }
 
     // remove unused weight to improve cache hits
     void remap() {
-        std::map<int, int> swaps;
-        size_t n = 0;
+        check_compiled();
 
-        for (size_t i = 0; i < weight2io_.size(); i++)
-            swaps[i] = weight2io_[i].empty() ? -1 : n++;
+        std::vector<uint32_t> swaps(weight2io_.rows());
+        uint32_t n = 0;
 
-        for (size_t i = 0; i < out_size_; i++) {
-            wi_connections& wi = out2wi_[i];
-            for (size_t j = 0; j < wi.size(); j++)
-                wi[j].first = static_cast<layer_size_t>(swaps[wi[j].first]);
-        }
+        for (size_t i = 0; i < weight2io_.rows(); i++)
+            swaps[i] = weight2io_[i].empty() ? 0 : n++;
 
-        for (size_t i = 0; i < in_size_; i++) {
-            wo_connections& wo = in2wo_[i];
-            for (size_t j = 0; j < wo.size(); j++)
-                wo[j].first = static_cast<layer_size_t>(swaps[wo[j].first]);
-        }
+        out2wi_.map_first(swaps);
+        in2wo_.map_first(swaps);
+        weight2io_.remove_empty_rows();
+    }
+
+protected:
+    void fprop(const vec_t& in, vec_t& a, vec_t& out) const {
+        const bool elementwise = h_.elementwise();
+
+        check_compiled();
+
+        for_(parallelize_, 0, out_size_, [&](const blocked_range& r) {
+            for (int i = r.begin(); i < r.end(); i++) {
+                a[i] = 0.0;
+
+                for (auto connection : out2wi_[i])// 13.1%
+                    a[i] += W_[connection.first] * in[connection.second]; // 3.2%
 
-        std::vector<io_connections> weight2io_new(n);
-        for (size_t i = 0; i < weight2io_.size(); i++)
-            if(swaps[i] >= 0) weight2io_new[swaps[i]] = weight2io_[i];
+                a[i] *= scale_factor_;
+                a[i] += b_[out2bias_[i]];
+            }
+            if (elementwise) h_.f_vec(&a[r.begin()], &out[r.begin()], r.end() - r.begin());
+        });
 
-        weight2io_.swap(weight2io_new);
+        if (!elementwise) h_.f_vec(&a[0], &out[0], out_size_);
     }
 
-protected:
-    std::vector<io_connections> weight2io_; // weight_id -> [(in_id, out_id)]
-    std::vector<wi_connections> out2wi_; // out_id -> [(weight_id, in_id)]
-    std::vector<wo_connections> in2wo_; // in_id -> [(weight_id, out_id)]
-    std::vector<std::vector<layer_size_t> > bias2out_;
-    std::vector<size_t> out2bias_;
+    connection_graph weight2io_; // weight_id -> [(in_id, out_id)]
+    connection_graph out2wi_; // out_id -> [(weight_id, in_id)]
+    connection_graph in2wo_; // in_id -> [(weight_id, out_id)]
+    connection_graph bias2out_; // bias_id -> [(out_id, -)]
+    std::vector<uint32_t> out2bias_;
     float_t scale_factor_;
+
+private:
+    struct weight_connection {
+        uint32_t in;
+        uint32_t out;
+        uint32_t weight;
+    };
+
+    static uint32_t to_index(layer_size_t index) {
+        if (index > std::numeric_limits<uint32_t>::max()) throw nn_error("connection index out of range");
+        return static_cast<uint32_t>(index);
+    }
+
+    void check_compiled() const {
+        if (!compiled_) throw nn_error("partial_connected_layer: compile_connections() must be called after connect_weight/connect_bias");
+    }
+
+    std::vector<weight_connection> weights_; // connections declared by connect_weight, until compiled
+    std::vector<uint32_t> biases_;           // (bias_id, out_id) declared by connect_bias, until compiled
+    bool compiled_;
 };
 
 } // namespace tiny_cnn
@@ -30,7 +30,9 @@
 #endif
 #include <cstdint>
 #include <cassert>
+#include <cmath>
 #include <numeric>
+#include <algorithm>
 
 #if defined(_MSC_VER)
 #define VECTORIZE_ALIGN(x) __declspec(align(x))
@@ -67,6 +69,9 @@ struct generic {
     static register_type zero() { return 0.0; }
     static register_type mul(const register_type& v1, const register_type& v2) { return v1 * v2; }
     static register_type add(const register_type& v1, const register_type& v2) { return v1 + v2; }
+    static register_type sub(const register_type& v1, const register_type& v2) { return v1 - v2; }
+    static register_type div(const register_type& v1, const register_type& v2) { return v1 / v2; }
+    static register_type sqrt(const register_type& v) { return std::sqrt(v); }
     static register_type load(const value_type* px) { return *px; }
     static register_type loadu(const value_type* px) { return *px; }
     static void store(value_type* px, const register_type& v) { *px = v; }
@@ -86,6 +91,9 @@ struct float_sse {
     static register_type zero() { register_type v = {}; return v; }
     static register_type mul(const register_type& v1, const register_type& v2) { return _mm_mul_ps(v1, v2); }
     static register_type add(const register_type& v1, const register_type& v2) { return _mm_add_ps(v1, v2); }
+    static register_type sub(const register_type& v1, const register_type& v2) { return _mm_sub_ps(v1, v2); }
+    static register_type div(const register_type& v1, const register_type& v2) { return _mm_div_ps(v1, v2); }
+    static register_type sqrt(const register_type& v) { return _mm_sqrt_ps(v); }
     static register_type load(const value_type* px) { return _mm_load_ps(px); }
     static register_type loadu(const value_type* px) { return _mm_loadu_ps(px); }
     static void store(value_type* px, const register_type& v) { _mm_store_ps(px, v); }
@@ -107,6 +115,9 @@ struct double_sse {
     static register_type zero() { register_type v = {}; return v; }
     static register_type mul(const register_type& v1, const register_type& v2) { return _mm_mul_pd(v1, v2); }
     static register_type add(const register_type& v1, const register_type& v2) { return _mm_add_pd(v1, v2); }
+    static register_type sub(const register_type& v1, const register_type& v2) { return _mm_sub_pd(v1, v2); }
+    static register_type div(const register_type& v1, const register_type& v2) { return _mm_div_pd(v1, v2); }
+    static register_type sqrt(const register_type& v) { return _mm_sqrt_pd(v); }
     static register_type load(const value_type* px) { return _mm_load_pd(px); }
     static register_type loadu(const value_type* px) { return _mm_loadu_pd(px); }
     static void store(value_type* px, const register_type& v) { _mm_store_pd(px, v); }
@@ -144,6 +155,9 @@ struct float_avx {
     static register_type zero() { register_type v = {}; return v; }
     static register_type mul(const register_type& v1, const register_type& v2) { return _mm256_mul_ps(v1, v2); }
     static register_type add(const register_type& v1, const register_type& v2) { return _mm256_add_ps(v1, v2); }
+    static register_type sub(const register_type& v1, const register_type& v2) { return _mm256_sub_ps(v1, v2); }
+    static register_type div(const register_type& v1, const register_type& v2) { return _mm256_div_ps(v1, v2); }
+    static register_type sqrt(const register_type& v) { return _mm256_sqrt_ps(v); }
     static register_type load(const value_type* px) { return _mm256_load_ps(px); }
     static register_type loadu(const value_type* px) { return _mm256_loadu_ps(px); }
     static void store(value_type* px, const register_type& v) { _mm256_store_ps(px, v); }
@@ -165,6 +179,9 @@ struct double_avx {
     static register_type zero() { register_type v = {}; return v; }
     static register_type mul(const register_type& v1, const register_type& v2) { return _mm256_mul_pd(v1, v2); }
     static register_type add(const register_type& v1, const register_type& v2) { return _mm256_add_pd(v1, v2); }
+    static register_type sub(const register_type& v1, const register_type& v2) { return _mm256_sub_pd(v1, v2); }
+    static register_type div(const register_type& v1, const register_type& v2) { return _mm256_div_pd(v1, v2); }
+    static register_type sqrt(const register_type& v) { return _mm256_sqrt_pd(v); }
     static register_type load(const value_type* px) { return _mm256_load_pd(px); }
     static register_type loadu(const value_type* px) { return _mm256_loadu_pd(px); }
     static void store(value_type* px, const register_type& v) { _mm256_store_pd(px, v); }
@@ -278,6 +295,75 @@ inline void reduce_aligned(const typename T::value_type* src, unsigned int size,
         dst[i] += src[i];
 }
 
+// block sizes of gemm: a (gemm_kc x gemm_nc) panel of B stays in L2 while rows of A are streamed
+enum {
+    gemm_kc = 128,
+    gemm_nc = 256
+};
+
+// C[0..n) += sum_k a[k*inc_a] * B[k*ldb + 0..n), k in [0, kb)
+// C is kept in registers during the whole k-loop (4 registers per iteration)
+template<typename T>
+inline void gemm_row_kernel(const typename T::value_type* a, unsigned int inc_a,
+                            const typename T::value_type* B, unsigned int ldb,
+                            unsigned int kb, unsigned int n, typename T::value_type* C) {
+    typedef typename T::register_type reg;
+    const unsigned int step = T::unroll_size;
+    unsigned int j = 0;
+
+    for (; j + 4 * step <= n; j += 4 * step) {
+        reg c0 = T::loadu(&C[j]);
+        reg c1 = T::loadu(&C[j + step]);
+        reg c2 = T::loadu(&C[j + 2 * step]);
+        reg c3 = T::loadu(&C[j + 3 * step]);
+
+        for (unsigned int k = 0; k < kb; k++) {
+            const reg f = T::set1(a[k * inc_a]);
+            const typename T::value_type* b = &B[k * ldb + j];
+            c0 = T::add(c0, T::mul(f, T::loadu(b)));
+            c1 = T::add(c1, T::mul(f, T::loadu(b + step)));
+            c2 = T::add(c2, T::mul(f, T::loadu(b + 2 * step)));
+            c3 = T::add(c3, T::mul(f, T::loadu(b + 3 * step)));
+        }
+        T::storeu(&C[j], c0);
+        T::storeu(&C[j + step], c1);
+        T::storeu(&C[j + 2 * step], c2);
+        T::storeu(&C[j + 3 * step], c3);
+    }
+
+    for (; j + step <= n; j += step) {
+        reg c = T::loadu(&C[j]);
+        for (unsigned int k = 0; k < kb; k++)
+            c = T::add(c, T::mul(T::set1(a[k * inc_a]), T::loadu(&B[k * ldb + j])));
+        T::storeu(&C[j], c);
+    }
+
+    for (; j < n; j++) {
+        typename T::value_type c = C[j];
+        for (unsigned int k = 0; k < kb; k++)
+            c += a[k * inc_a] * B[k * ldb + j];
+        C[j] = c;
+    }
+}
+
+// C[M x N] += A * B, where element (i,k) of A is A[i*rs_a + k*cs_a]
+template<typename T>
+inline void gemm_blocked(unsigned int M, unsigned int N, unsigned int K,
+                         const typename T::value_type* A, unsigned int rs_a, unsigned int cs_a,
+                         const typename T::value_type* B, unsigned int ldb,
+                         typename T::value_type* C, unsigned int ldc) {
+    for (unsigned int k0 = 0; k0 < K; k0 += gemm_kc) {
+        const unsigned int kb = std::min<unsigned int>(gemm_kc, K - k0);
+
+        for (unsigned int j0 = 0; j0 < N; j0 += gemm_nc) {
+            const unsigned int nb = std::min<unsigned int>(gemm_nc, N - j0);
+
+            for (unsigned int i = 0; i < M; i++)
+                gemm_row_kernel<T>(&A[i * rs_a + k0 * cs_a], cs_a, &B[k0 * ldb + j0], ldb, kb, nb, &C[i * ldc + j0]);
+        }
+    }
+}
+
 } // namespace detail
 
 #if defined(CNN_USE_AVX)
@@ -288,6 +374,12 @@ inline void reduce_aligned(const typename T::value_type* src, unsigned int size,
 #define VECTORIZE_TYPE detail::generic<T>
 #endif
 
+// register operations of the enabled instruction set (unroll_size elements at once)
+template<typename T>
+struct vector_ops {
+    typedef VECTORIZE_TYPE type;
+};
+
 // dst[i] += c * src[i]
 template<typename T>
 void muladd(const T* src, T c, unsigned int size, T* dst) {
@@ -315,4 +407,41 @@ void reduce(const T* src, unsigned int size, T* dst) {
         return detail::reduce_nonaligned<VECTORIZE_TYPE>(src, size, dst);
 }
 
+// matrix products (row-major, BLAS-like leading dimensions)
+
+/// C[M x N] += A[M x K] * B[K x N]
+template<typename T>
+void gemm_nn(unsigned int M, unsigned int N, unsigned int K,
+             const T* A, unsigned int lda, const T* B, unsigned int ldb, T* C, unsigned int ldc) {
+    if (N == 1 && ldb == 1) {
+        for (unsigned int i = 0; i < M; i++)
+            C[i * ldc] += dot(&A[i * lda], B, K);
+        return;
+    }
+    detail::gemm_blocked<VECTORIZE_TYPE>(M, N, K, A, lda, 1, B, ldb, C, ldc);
+}
+
+/// C[M x N] += A^T * B[K x N], where A is [K x M]
+template<typename T>
+void gemm_tn(unsigned int M, unsigned int N, unsigned int K,
+             const T* A, unsigned int lda, const T* B, unsigned int ldb, T* C, unsigned int ldc) {
+    detail::gemm_blocked<VECTORIZE_TYPE>(M, N, K, A, 1, lda, B, ldb, C, ldc);
+}
+
+/// C[M x N] += A[M x K] * B^T, where B is [N x K]
+template<typename T>
+void gemm_nt(unsigned int M, unsigned int N, unsigned int K,
+             const T* A, unsigned int lda, const T* B, unsigned int ldb, T* C, unsigned int ldc) {
+    // process rows of B in blocks which fit in L2, so that each block is reused by all rows of A
+    const unsigned int block = std::max<unsigned int>(1, (detail::gemm_kc * detail::gemm_nc) / std::max<unsigned int>(K, 1));
+
+    for (unsigned int j0 = 0; j0 < N; j0 += block) {
+        const unsigned int j1 = std::min(N, j0 + block);
+
+        for (unsigned int i = 0; i < M; i++)
+            for (unsigned int j = j0; j < j1; j++)
+                C[i * ldc + j] += dot(&A[i * lda], &B[j * ldb], K);
+    }
+}
+
 } // namespace vectorize
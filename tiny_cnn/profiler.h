@@ -0,0 +1,152 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include "config.h"
+
+namespace tiny_cnn {
+
+enum class profile_phase : int {
+    forward = 0,
+    backward,
+    backward_2nd,
+    update
+};
+
+const int profile_phase_size = 4;
+
+inline const char* to_string(profile_phase phase) {
+    static const char* names[] = { "forward", "backward", "backward_2nd", "update" };
+    return names[static_cast<int>(phase)];
+}
+
+struct profile_stats {
+    profile_stats() : calls(0), samples(0), seconds(0.0) {}
+
+    profile_stats& operator += (const profile_stats& rhs) {
+        calls += rhs.calls;
+        samples += rhs.samples;
+        seconds += rhs.seconds;
+        return *this;
+    }
+
+    uint64_t calls;
+    uint64_t samples; // number of samples processed by these calls
+    double seconds;
+};
+
+#ifdef CNN_USE_PROFILER
+
+/**
+ * timings of one layer.
+ * each worker (the index passed to forward_propagation/back_propagation) records into its own slot,
+ * so that no lock is needed while training. total() merges the slots.
+ **/
+class layer_profile {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    layer_profile() { reset(); }
+
+    void reset() {
+        for (auto& w : workers_) {
+            for (auto& s : w.stats) s = profile_stats();
+            w.running = false;
+        }
+    }
+
+    void start(size_t worker, clock::time_point now = clock::now()) {
+        workers_[worker].started = now;
+        workers_[worker].running = true;
+    }
+
+    // record the time since start(worker). ignored if the worker is not started
+    void stop(profile_phase phase, size_t worker, clock::time_point now = clock::now()) {
+        worker_slot& w = workers_[worker];
+        if (!w.running) return;
+        add(phase, worker, std::chrono::duration<double>(now - w.started).count(), 1);
+        w.running = false;
+    }
+
+    void add(profile_phase phase, size_t worker, double seconds, uint64_t samples) {
+        profile_stats& s = workers_[worker].stats[static_cast<int>(phase)];
+        s.calls++;
+        s.samples += samples;
+        s.seconds += seconds;
+    }
+
+    profile_stats total(profile_phase phase) const {
+        profile_stats sum;
+        for (auto& w : workers_) sum += w.stats[static_cast<int>(phase)];
+        return sum;
+    }
+
+private:
+    struct worker_slot {
+        profile_stats stats[profile_phase_size];
+        clock::time_point started;
+        bool running;
+        char padding[64]; // keep slots of different workers on different cache lines
+    };
+
+    worker_slot workers_[CNN_TASK_SIZE];
+};
+
+// records the lifetime of the scope into worker 0 of the profile
+class profile_scope {
+public:
+    profile_scope(layer_profile& profile, profile_phase phase, uint64_t samples)
+        : profile_(profile), phase_(phase), samples_(samples), started_(layer_profile::clock::now()) {}
+
+    ~profile_scope() {
+        const double seconds = std::chrono::duration<double>(layer_profile::clock::now() - started_).count();
+        profile_.add(phase_, 0, seconds, samples_);
+    }
+
+private:
+    profile_scope(const profile_scope&);
+    profile_scope& operator = (const profile_scope&);
+
+    layer_profile& profile_;
+    profile_phase phase_;
+    uint64_t samples_;
+    layer_profile::clock::time_point started_;
+};
+
+#define CNN_PROFILE_SCOPE(layer, phase, samples) \
+    tiny_cnn::profile_scope cnn_profile_scope_((layer)->profile(), phase, samples)
+#define CNN_PROFILE_START(layer, worker) (layer)->profile().start(worker)
+
+#else
+
+#define CNN_PROFILE_SCOPE(layer, phase, samples)
+#define CNN_PROFILE_START(layer, worker)
+
+#endif // CNN_USE_PROFILER
+
+} // namespace tiny_cnn
@@ -0,0 +1,208 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <random>
+#include <numeric>
+#include <map>
+#include <iostream>
+#include "util.h"
+
+namespace tiny_cnn {
+namespace sampling {
+
+/**
+ * decides which samples are trained in which order in each epoch (see network::sampler).
+ * samples are referenced by index, so that datasets are never copied or permuted.
+ **/
+class function {
+public:
+    virtual ~function() {}
+
+    /**
+     * indices of samples to be trained in next epoch
+     * @param num_samples [in]  number of samples in dataset
+     * @param order       [out] indices in [0, num_samples). can be shorter/longer than num_samples
+     **/
+    virtual void next_epoch(size_t num_samples, std::vector<size_t>* order) = 0;
+    virtual function* clone() const = 0;
+
+    // state of random engine, saved to checkpoint (see network::save_checkpoint)
+    virtual void save(std::ostream& os) const { CNN_UNREFERENCED_PARAMETER(os); }
+    virtual void load(std::istream& is) { CNN_UNREFERENCED_PARAMETER(is); }
+};
+
+/**
+ * samples in storage order (default)
+ **/
+class sequential : public function {
+public:
+    void next_epoch(size_t num_samples, std::vector<size_t>* order) override {
+        order->resize(num_samples);
+        std::iota(order->begin(), order->end(), size_t(0));
+    }
+
+    sequential* clone() const override { return new sequential(*this); }
+};
+
+/**
+ * random permutation for each epoch
+ **/
+class shuffle : public function {
+public:
+    explicit shuffle(unsigned seed = 1) : gen_(seed) {}
+
+    void next_epoch(size_t num_samples, std::vector<size_t>* order) override {
+        order->resize(num_samples);
+        std::iota(order->begin(), order->end(), size_t(0));
+        std::shuffle(order->begin(), order->end(), gen_);
+    }
+
+    shuffle* clone() const override { return new shuffle(*this); }
+    void save(std::ostream& os) const override { os << gen_; }
+    void load(std::istream& is) override { is >> gen_; }
+
+private:
+    std::mt19937 gen_;
+};
+
+/**
+ * random permutation in which labels are interleaved, so that every mini-batch holds
+ * all classes in proportion to the dataset.
+ **/
+class stratified : public function {
+public:
+    template <typename T>
+    explicit stratified(const std::vector<T>& labels, unsigned seed = 1) : gen_(seed) {
+        std::map<T, size_t> classes;
+        for (auto& l : labels) classes.insert(std::make_pair(l, classes.size()));
+
+        class_of_.resize(labels.size());
+        for (size_t i = 0; i < labels.size(); i++)
+            class_of_[i] = classes[labels[i]];
+        num_classes_ = classes.size();
+    }
+
+    void next_epoch(size_t num_samples, std::vector<size_t>* order) override {
+        if (num_samples != class_of_.size())
+            throw nn_error("number of labels given to sampler must be equal to training data");
+
+        std::vector<std::vector<size_t>> members(num_classes_);
+        for (size_t i = 0; i < num_samples; i++)
+            members[class_of_[i]].push_back(i);
+
+        // shuffle each class, and put i-th member of class c at (i + 0.5) / size(c) in [0, 1),
+        // so that each class is spread evenly over the epoch
+        std::vector<std::pair<double, size_t>> keys;
+        keys.reserve(num_samples);
+        for (auto& m : members) {
+            std::shuffle(m.begin(), m.end(), gen_);
+            for (size_t i = 0; i < m.size(); i++)
+                keys.push_back(std::make_pair((i + 0.5) / m.size(), m[i]));
+        }
+        std::stable_sort(keys.begin(), keys.end(),
+                         [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) { return a.first < b.first; });
+
+        order->resize(num_samples);
+        for (size_t i = 0; i < num_samples; i++)
+            (*order)[i] = keys[i].second;
+    }
+
+    stratified* clone() const override { return new stratified(*this); }
+    void save(std::ostream& os) const override { os << gen_; }
+    void load(std::istream& is) override { is >> gen_; }
+
+private:
+    std::mt19937 gen_;
+    std::vector<size_t> class_of_;
+    size_t num_classes_;
+};
+
+/**
+ * draw samples with replacement, with probability proportional to weight of each sample
+ * (e.g. inverse class frequency for imbalanced datasets).
+ **/
+class weighted : public function {
+public:
+    /**
+     * @param weights     non-negative weight for each sample
+     * @param num_draws   number of samples in each epoch (0: number of samples)
+     **/
+    explicit weighted(const std::vector<double>& weights, size_t num_draws = 0, unsigned seed = 1)
+        : gen_(seed), dist_(weights.begin(), weights.end()), num_samples_(weights.size()), num_draws_(num_draws) {}
+
+    void next_epoch(size_t num_samples, std::vector<size_t>* order) override {
+        if (num_samples != num_samples_)
+            throw nn_error("number of weights given to sampler must be equal to training data");
+
+        order->resize(num_draws_ ? num_draws_ : num_samples);
+        for (auto& i : *order)
+            i = static_cast<size_t>(dist_(gen_));
+    }
+
+    weighted* clone() const override { return new weighted(*this); }
+    void save(std::ostream& os) const override { os << gen_; }
+    void load(std::istream& is) override { is >> gen_; }
+
+private:
+    std::mt19937 gen_;
+    std::discrete_distribution<size_t> dist_;
+    size_t num_samples_;
+    size_t num_draws_;
+};
+
+/**
+ * fixed subset of samples (e.g. hold out validation data without splitting vectors)
+ **/
+class subset : public function {
+public:
+    /**
+     * @param indices  samples to be trained
+     * @param shuffle  shuffle indices for each epoch
+     **/
+    explicit subset(const std::vector<size_t>& indices, bool shuffle = false, unsigned seed = 1)
+        : gen_(seed), indices_(indices), shuffle_(shuffle) {}
+
+    void next_epoch(size_t num_samples, std::vector<size_t>* order) override {
+        for (auto i : indices_)
+            if (i >= num_samples) throw nn_error("index of subset is out of range");
+
+        *order = indices_;
+        if (shuffle_) std::shuffle(order->begin(), order->end(), gen_);
+    }
+
+    subset* clone() const override { return new subset(*this); }
+    void save(std::ostream& os) const override { os << gen_; }
+    void load(std::istream& is) override { is >> gen_; }
+
+private:
+    std::mt19937 gen_;
+    std::vector<size_t> indices_;
+    bool shuffle_;
+};
+
+} // namespace sampling
+} // namespace tiny_cnn
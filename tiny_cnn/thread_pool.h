@@ -0,0 +1,392 @@
+/*
+    Copyright (c) 2013, Taiga Nomi
+    All rights reserved.
+    
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY 
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND 
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace tiny_cnn {
+namespace detail {
+
+/**
+ * move-only void() callable like std::function, but callables up to inline_size bytes are stored
+ * in the object itself, so that submitting tasks of for_/task_group never allocates
+ **/
+class pool_task {
+public:
+    static const size_t inline_size = 64;
+
+    pool_task() : invoke_(nullptr), relocate_(nullptr) {}
+
+    template<typename Func>
+    pool_task(Func f) : invoke_(nullptr), relocate_(nullptr) {
+        store(std::move(f), std::integral_constant<bool, sizeof(Func) <= inline_size &&
+                                                         alignof(Func) <= alignof(storage)>());
+    }
+
+    pool_task(pool_task&& rhs) : invoke_(nullptr), relocate_(nullptr) {
+        *this = std::move(rhs);
+    }
+
+    pool_task& operator = (pool_task&& rhs) {
+        if (this != &rhs) {
+            reset();
+            if (rhs.invoke_) {
+                rhs.relocate_(&rhs.storage_, &storage_);
+                invoke_ = rhs.invoke_;
+                relocate_ = rhs.relocate_;
+                rhs.invoke_ = nullptr;
+                rhs.relocate_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    ~pool_task() { reset(); }
+
+    void operator () () { invoke_(&storage_); }
+
+    explicit operator bool() const { return invoke_ != nullptr; }
+
+private:
+    pool_task(const pool_task&);
+    pool_task& operator = (const pool_task&);
+
+    typedef typename std::aligned_storage<inline_size>::type storage;
+
+    template<typename Func>
+    void store(Func&& f, std::true_type /*fits*/) {
+        typedef typename std::decay<Func>::type F;
+        ::new(static_cast<void*>(&storage_)) F(std::move(f));
+        invoke_ = &invoke<F>;
+        relocate_ = &relocate<F>;
+    }
+
+    // callables larger than inline_size are kept on the heap
+    template<typename Func>
+    void store(Func&& f, std::false_type /*fits*/) {
+        typedef typename std::decay<Func>::type F;
+        std::shared_ptr<F> p = std::make_shared<F>(std::move(f));
+        store([p] { (*p)(); }, std::true_type());
+    }
+
+    template<typename F>
+    static void invoke(void* p) { (*static_cast<F*>(p))(); }
+
+    // move *src to dst (or just destroy it if dst is null)
+    template<typename F>
+    static void relocate(void* src, void* dst) {
+        F* f = static_cast<F*>(src);
+        if (dst) ::new(dst) F(std::move(*f));
+        f->~F();
+    }
+
+    void reset() {
+        if (relocate_) relocate_(&storage_, nullptr);
+        invoke_ = nullptr;
+        relocate_ = nullptr;
+    }
+
+    storage storage_;
+    void (*invoke_)(void*);
+    void (*relocate_)(void*, void*);
+};
+
+/**
+ * work-stealing thread pool, used by for_/task_group when neither TBB nor OMP is enabled.
+ *
+ * each worker has its own deque. a worker pushes/pops tasks at the back of its deque,
+ * and steals from the front of others' deques when its own is empty.
+ * tasks submitted from threads outside of the pool go to an extra shared deque.
+ * threads waiting for a task_group run pending tasks instead of blocking,
+ * so nested parallelism never deadlocks.
+ **/
+class thread_pool {
+public:
+    typedef pool_task task;
+
+    explicit thread_pool(size_t num_workers)
+        : queues_(num_workers + 1), queued_(0), stop_(false) {
+        for (size_t i = 0; i < num_workers; i++)
+            workers_.emplace_back([this, i] { worker_loop(i); });
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& w : workers_) w.join();
+    }
+
+    size_t num_workers() const { return workers_.size(); }
+
+    void submit(task t) {
+        queue& q = queues_[current_queue()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.push_back(std::move(t));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queued_++;
+        }
+        cv_.notify_one();
+    }
+
+    // run one pending task on the calling thread. returns false if no task is available
+    bool run_pending_task() {
+        task t;
+        if (!pop(t)) return false;
+        t();
+        return true;
+    }
+
+    static thread_pool& instance() {
+        thread_pool* p = published().load(std::memory_order_acquire);
+        if (!p) {
+            std::lock_guard<std::mutex> lock(holder_mutex());
+            p = published().load(std::memory_order_relaxed);
+            if (!p) {
+                holder().reset(new thread_pool(default_workers()));
+                p = holder().get();
+                published().store(p, std::memory_order_release);
+            }
+        }
+        return *p;
+    }
+
+    // re-create the pool (0: number of hardware threads). must not be called while any task is running
+    static void set_num_threads(size_t num_threads) {
+        std::lock_guard<std::mutex> lock(holder_mutex());
+        published().store(nullptr, std::memory_order_relaxed);
+        holder().reset(); // join old workers first
+        holder().reset(new thread_pool(num_threads > 0 ? num_threads - 1 : default_workers())); // calling thread also runs tasks
+        published().store(holder().get(), std::memory_order_release);
+    }
+
+private:
+    /**
+     * ring buffer of tasks. it grows by doubling and never shrinks, so that the pool
+     * stops allocating once queues are large enough for the workload
+     **/
+    struct queue {
+        queue() : head(0), size(0) {}
+
+        bool empty() const { return size == 0; }
+
+        void push_back(task&& t) {
+            if (size == ring.size()) grow();
+            ring[(head + size) & (ring.size() - 1)] = std::move(t);
+            size++;
+        }
+
+        void pop_back(task& t) {
+            size--;
+            t = std::move(ring[(head + size) & (ring.size() - 1)]);
+        }
+
+        void pop_front(task& t) {
+            t = std::move(ring[head]);
+            head = (head + 1) & (ring.size() - 1);
+            size--;
+        }
+
+        void grow() {
+            std::vector<task> r(std::max<size_t>(16, ring.size() * 2));
+            for (size_t i = 0; i < size; i++)
+                r[i] = std::move(ring[(head + i) & (ring.size() - 1)]);
+            ring.swap(r);
+            head = 0;
+        }
+
+        std::mutex mutex;
+        std::vector<task> ring; // size is a power of 2
+        size_t head;
+        size_t size;
+    };
+
+    struct thread_id {
+        thread_pool* pool;
+        size_t index;
+    };
+
+    static thread_id& current() {
+        static thread_local thread_id id = { nullptr, 0 };
+        return id;
+    }
+
+    static std::unique_ptr<thread_pool>& holder() {
+        static std::unique_ptr<thread_pool> p;
+        return p;
+    }
+
+    // the pool owned by holder(), read by instance() without locking
+    static std::atomic<thread_pool*>& published() {
+        static std::atomic<thread_pool*> p(nullptr);
+        return p;
+    }
+
+    static std::mutex& holder_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static size_t default_workers() {
+        const size_t n = std::thread::hardware_concurrency();
+        return n > 1 ? n - 1 : 0;
+    }
+
+    size_t current_queue() const {
+        const thread_id& id = current();
+        return id.pool == this ? id.index : queues_.size() - 1;
+    }
+
+    bool pop(task& t) {
+        const size_t self = current_queue();
+
+        // own tasks in LIFO order (the most recently pushed task is likely to be hot in cache)
+        if (self != queues_.size() - 1 && pop_back(queues_[self], t)) return true;
+
+        // steal the oldest task from others
+        for (size_t i = 1; i <= queues_.size(); i++) {
+            const size_t victim = (self + i) % queues_.size();
+            if (pop_front(queues_[victim], t)) return true;
+        }
+        return false;
+    }
+
+    bool pop_back(queue& q, task& t) {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.empty()) return false;
+        q.pop_back(t);
+        queued_--;
+        return true;
+    }
+
+    bool pop_front(queue& q, task& t) {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.empty()) return false;
+        q.pop_front(t);
+        queued_--;
+        return true;
+    }
+
+    void worker_loop(size_t index) {
+        current().pool = this;
+        current().index = index;
+
+        for (;;) {
+            if (run_pending_task()) continue;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+            if (stop_) return;
+        }
+    }
+
+    std::vector<queue> queues_; // [0, num_workers): workers, [num_workers]: submitted from outside
+    std::vector<std::thread> workers_;
+    std::atomic<int> queued_; // number of tasks in all queues
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_;
+};
+
+} // namespace detail
+
+/**
+ * runs tasks concurrently on the thread pool. wait() blocks until all tasks are finished,
+ * and rethrows the first exception thrown by the tasks.
+ **/
+class task_group {
+public:
+    task_group() : pending_(0) {}
+
+    ~task_group() {
+        // tasks refer to this object, so never leave them running
+        finish();
+    }
+
+    template<typename Func>
+    void run(Func f) {
+        pending_++;
+        detail::thread_pool::instance().submit([this, f] {
+            try {
+                f();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error_) error_ = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0) done_.notify_all();
+        });
+    }
+
+    void wait() {
+        finish();
+
+        if (error_) {
+            std::exception_ptr e = error_;
+            error_ = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+private:
+    task_group(const task_group&);
+    task_group& operator = (const task_group&);
+
+    // help running pending tasks until all tasks of this group are finished,
+    // and block once the rest of them are running on other threads
+    void finish() {
+        detail::thread_pool& pool = detail::thread_pool::instance();
+
+        while (pending_ > 0) {
+            if (pool.run_pending_task()) continue;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this] { return pending_ == 0; });
+        }
+        std::lock_guard<std::mutex> lock(mutex_); // the last task may still be holding mutex_ to notify
+    }
+
+    std::atomic<int> pending_;
+    std::mutex mutex_; // guards error_, and pending_ reaching 0
+    std::condition_variable done_;
+    std::exception_ptr error_;
+};
+
+} // namespace tiny_cnn
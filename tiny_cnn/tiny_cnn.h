@@ -34,6 +34,7 @@
 #include "fully_connected_layer.h"
 #include "fully_connected_dropout_layer.h"
 #include "max_pooling_layer.h"
+#include "partial_connected_layer.h"
 #include "ghh_activation_layer.h"
 #include "ghh_activation_dropout_layer.h"
 
@@ -41,9 +42,12 @@
 #include "loss_function.h"
 #include "optimizer.h"
 #include "weight_init.h"
+#include "sampler.h"
 
 #include "mnist_parser.h"
 #include "cifar10_parser.h"
+#include "image_dataset.h"
+#include "data_pipeline.h"
 #include "image.h"
 #include "deform.h"
 #include "product.h"
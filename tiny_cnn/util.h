@@ -26,13 +26,16 @@
 */
 #pragma once
 #include <vector>
+#include <algorithm>
 #include <functional>
+#include <exception>
 #include <random>
 #include <type_traits>
 #include <limits>
 #include <cassert>
 #include <cstdio>
 #include <cstdarg>
+#include "aligned_allocator.h"
 
 #ifdef CNN_USE_TBB
     #ifndef NOMINMAX
@@ -45,7 +48,11 @@
 
 
 #if !defined(CNN_USE_OMP) && !defined(CNN_USE_TBB)
-#define NO_THREADS
+    #ifdef CNN_SINGLE_THREAD
+        #define NO_THREADS
+    #else
+        #define CNN_USE_THREAD_POOL // builtin work-stealing pool (thread_pool.h)
+    #endif
 #endif
 #if defined(CNN_USE_OMP) && defined(CNN_USE_TBB)
     #undef CNN_USE_OMP
@@ -57,6 +64,14 @@
 #endif
 
 
+#ifdef CNN_USE_THREAD_POOL
+    #include "thread_pool.h"
+#endif
+
+#ifdef CNN_USE_OMP
+    #include <omp.h>
+#endif
+
 #define CNN_UNREFERENCED_PARAMETER(x) (void)(x)
 
 
@@ -68,7 +83,7 @@ typedef float float_t;
 // typedef unsigned short layer_size_t;
 typedef unsigned long layer_size_t;
 typedef size_t label_t;
-typedef std::vector<float_t> vec_t;
+typedef std::vector<float_t, aligned_allocator<float_t>> vec_t;
 
 class nn_error : public std::exception {
 public:
@@ -78,22 +93,31 @@ private:
     std::string msg_;
 };
 
+namespace detail {
+
+// engine used by uniform_rand<T>, one for each T (accessible so that checkpoint can save its state)
 template<typename T> inline
-typename std::enable_if<std::is_integral<T>::value, T>::type
-uniform_rand(T min, T max) {
+std::mt19937& random_engine() {
     // avoid gen(0) for MSVC known issue
     // https://connect.microsoft.com/VisualStudio/feedback/details/776456
     static std::mt19937 gen(1);
+    return gen;
+}
+
+} // namespace detail
+
+template<typename T> inline
+typename std::enable_if<std::is_integral<T>::value, T>::type
+uniform_rand(T min, T max) {
     std::uniform_int_distribution<T> dst(min, max);
-    return dst(gen);
+    return dst(detail::random_engine<T>());
 }
 
 template<typename T> inline
 typename std::enable_if<std::is_floating_point<T>::value, T>::type
 uniform_rand(T min, T max) {
-    static std::mt19937 gen(1);
     std::uniform_real_distribution<T> dst(min, max);
-    return dst(gen);
+    return dst(detail::random_engine<T>());
 }
 
 template<typename Container>
@@ -156,8 +180,8 @@ inline void nop()
     typedef tbb::task_group task_group;
 
     template<typename Func>
-    void parallel_for(int begin, int end, const Func& f) {
-        tbb::parallel_for(blocked_range(begin, end, 100), f);
+    void parallel_for(int begin, int end, const Func& f, int grainsize) {
+        tbb::parallel_for(blocked_range(begin, end, grainsize), f);
     }
     template<typename Func>
     void xparallel_for(int begin, int end, const Func& f) {
@@ -165,8 +189,8 @@ inline void nop()
     }
 
     template<typename Func>
-    void for_(bool parallelize, int begin, int end, Func f) {
-        parallelize ? parallel_for(begin, end, f) : xparallel_for(begin, end, f);
+    void for_(bool parallelize, int begin, int end, Func f, int grainsize = 100) {
+        parallelize ? parallel_for(begin, end, f, grainsize) : xparallel_for(begin, end, f);
     }
 #endif // CNN_USE_TBB
 
@@ -191,21 +215,33 @@ inline void nop()
         f(r);
     }
 
+#endif 
+
+#if !defined(CNN_USE_TBB) && !defined(CNN_USE_THREAD_POOL)
+    // tasks run immediately on the calling thread, and wait() rethrows the first exception
     class task_group {
     public:
         template<typename Func>
         void run(Func f) {
-            functions_.push_back(f);
+            if (error_) return;
+            try {
+                f();
+            } catch (...) {
+                error_ = std::current_exception();
+            }
         }
 
         void wait() {
-            for (auto f : functions_)
-                f();
+            if (error_) {
+                std::exception_ptr e = error_;
+                error_ = nullptr;
+                std::rethrow_exception(e);
+            }
         }
     private:
-        std::vector<std::function<void()>> functions_;
+        std::exception_ptr error_;
     };
-#endif 
+#endif
 
 
 #ifdef CNN_USE_OMP
@@ -224,7 +260,7 @@ inline void nop()
     }
 
     template<typename Func>
-    void for_(bool parallelize, size_t begin, size_t end, Func f) {
+    void for_(bool parallelize, size_t begin, size_t end, Func f, int /*grainsize*/ = 100) {
         parallelize = parallelize && value_representation<int>(begin);
         parallelize = parallelize && value_representation<int>(end);
         parallelize? parallel_for(static_cast<int>(begin), static_cast<int>(end), f) : xparallel_for(begin, end, f);
@@ -232,13 +268,72 @@ inline void nop()
 
 #endif
 
+#ifdef CNN_USE_THREAD_POOL
+
+    // split [begin, end) into chunks of at least grainsize, about 4 chunks per thread for load-balancing.
+    // the calling thread processes the first chunk by itself
+    template<typename Func>
+    void parallel_for(int begin, int end, const Func& f, int grainsize) {
+        const int num_threads = static_cast<int>(detail::thread_pool::instance().num_workers()) + 1;
+        const int max_chunks = num_threads * 4;
+        const int chunk = std::max(std::max(grainsize, 1), (end - begin + max_chunks - 1) / max_chunks);
+
+        if (num_threads == 1 || end - begin <= chunk) {
+            f(blocked_range(begin, end));
+            return;
+        }
+
+        task_group g;
+        for (int b = begin + chunk; b < end; b += chunk) {
+            const int e = std::min(end, b + chunk);
+            g.run([&f, b, e] { f(blocked_range(b, e)); });
+        }
+        f(blocked_range(begin, begin + chunk));
+        g.wait();
+    }
+
+    template<typename Func>
+    void for_(bool parallelize, size_t begin, size_t end, Func f, int grainsize = 100) {
+        parallelize ? parallel_for(static_cast<int>(begin), static_cast<int>(end), f, grainsize) : xparallel_for(begin, end, f);
+    }
+
+#endif
+
 #ifdef NO_THREADS
     template<typename Func>
-    void for_(bool /*parallelize*/, size_t begin, size_t end, Func f) { // ignore parallelize if you don't define CNN_USE_TBB
+    void for_(bool /*parallelize*/, size_t begin, size_t end, Func f, int /*grainsize*/ = 100) { // ignore parallelize if you define CNN_SINGLE_THREAD
         xparallel_for(begin, end, f);
     }
 #endif
 
+///< number of threads used by for_/task_group (including the calling thread)
+inline size_t num_threads() {
+#if defined(CNN_USE_THREAD_POOL)
+    return detail::thread_pool::instance().num_workers() + 1;
+#elif defined(CNN_USE_OMP)
+    return static_cast<size_t>(omp_get_max_threads());
+#elif defined(CNN_USE_TBB)
+    return static_cast<size_t>(tbb::task_scheduler_init::default_num_threads());
+#else
+    return 1;
+#endif
+}
+
+/**
+ * set number of threads used by for_/task_group (including the calling thread).
+ * 0 means number of hardware threads, which is the default.
+ * TBB build is configured by tbb::task_scheduler_init, so this is ignored
+ **/
+inline void set_num_threads(size_t num_threads) {
+#if defined(CNN_USE_THREAD_POOL)
+    detail::thread_pool::set_num_threads(num_threads);
+#elif defined(CNN_USE_OMP)
+    omp_set_num_threads(num_threads > 0 ? static_cast<int>(num_threads) : omp_get_num_procs());
+#else
+    CNN_UNREFERENCED_PARAMETER(num_threads);
+#endif
+}
+
 
 template <typename Func>
 void for_i(bool parallelize, int size, Func f)
@@ -257,6 +352,37 @@ void for_i(int size, Func f) {
     for_i(true, size, f);
 }
 
+// for_ over [0, size) split into blocks of block_size elements,
+// so that each task gets a contiguous range wide enough to vectorize (OMP splits for_ per element)
+template <typename Func>
+void for_blocks(bool parallelize, size_t size, size_t block_size, Func f) {
+    const size_t num_blocks = (size + block_size - 1) / block_size;
+
+    for_(parallelize, 0, num_blocks, [&](const blocked_range& r) {
+        f(blocked_range(static_cast<int>(r.begin() * block_size),
+                        static_cast<int>(std::min(size, r.end() * block_size))));
+    }, 1);
+}
+
+// bytes allocated by vector
+template <typename T, typename Alloc>
+size_t memory_size(const std::vector<T, Alloc>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+template <typename T, typename Alloc>
+size_t memory_size(const std::vector<std::vector<T, Alloc>>& v) {
+    size_t size = v.capacity() * sizeof(std::vector<T, Alloc>);
+    for (auto& e : v) size += memory_size(e);
+    return size;
+}
+
+// free memory of vector (clear() keeps capacity)
+template <typename Container>
+void release(Container& c) {
+    Container().swap(c);
+}
+
 template <typename T> inline T sqr(T value) { return value*value; }
 
 inline bool isfinite(float_t x) {
@@ -330,6 +456,46 @@ Stream& operator << (Stream& s, const index3d<T>& d) {
     return s;
 }
 
+/**
+ * lower sliding windows of a feature map to columns, so that a convolution becomes a gemm:
+ * col[(c*kh + dy)*kw + dx][y*out.width_ + x] = in(x + dx - pad, y + dy - pad, c), zero outside of input.
+ * ld is the distance between rows of col (at least out.width_ * out.height_)
+ **/
+inline void im2col(const float_t* in, const index3d<layer_size_t>& in_shape,
+                   layer_size_t kw, layer_size_t kh, layer_size_t pad,
+                   const index3d<layer_size_t>& out, float_t* col, size_t ld) {
+    const layer_size_t ow = out.width_;
+    const layer_size_t oh = out.height_;
+    const layer_size_t iw = in_shape.width_;
+    const layer_size_t ih = in_shape.height_;
+
+    for (layer_size_t c = 0; c < in_shape.depth_; c++) {
+        for (layer_size_t dy = 0; dy < kh; dy++) {
+            for (layer_size_t dx = 0; dx < kw; dx++, col += ld) {
+                // valid range of x: 0 <= x + dx - pad < iw
+                const layer_size_t x0 = std::min<layer_size_t>(ow, pad > dx ? pad - dx : 0);
+                const layer_size_t x1 = std::max<layer_size_t>(x0, std::min<layer_size_t>(ow, iw + pad - dx));
+                float_t *dst = col;
+
+                for (layer_size_t y = 0; y < oh; y++, dst += ow) {
+                    const long iy = long(y + dy) - long(pad);
+
+                    if (iy < 0 || iy >= long(ih)) {
+                        std::fill(dst, dst + ow, float_t(0));
+                        continue;
+                    }
+                    std::fill(dst, dst + x0, float_t(0));
+                    if (x1 > x0) {
+                        const float_t *src = &in[in_shape.get_index(x0 + dx - pad, iy, c)];
+                        std::copy(src, src + (x1 - x0), dst + x0);
+                    }
+                    std::fill(dst + x1, dst + ow, float_t(0));
+                }
+            }
+        }
+    }
+}
+
 
 // boilerplate to resolve dependent name
 #define CNN_USE_LAYER_MEMBERS using layer_base::in_size_;\
@@ -347,6 +513,11 @@ Stream& operator << (Stream& s, const index3d<T>& d) {
     using layer_base::Whessian_; \
     using layer_base::bhessian_; \
     using layer_base::prev_delta2_; \
+    using layer_base::batch_output_; \
+    using layer_base::batch_prev_delta_; \
+    using layer_base::forward_next; \
+    using layer_base::backward_prev; \
+    using layer_base::backward_prev_2nd; \
     using layer<Activation>::h_
 
 